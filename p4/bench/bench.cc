@@ -1,12 +1,15 @@
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <iostream>
 #include <libgen.h>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 
+#include "../common/flat_hashtable.h"
 #include "../common/hashtable.h"
+#include "../common/vec.h"
 
 using namespace std;
 
@@ -29,6 +32,19 @@ struct server_arg_t {
 
   /// Number of buckets for the server's hash tables
   size_t buckets = 1024;
+
+  /// Number of extra runs, each with a key range 10x larger than the last
+  size_t scale = 0;
+
+  /// Pass callbacks as std::function objects instead of lambdas?
+  bool functions = false;
+
+  /// Use the flat (open-addressing) table instead of the chained one?
+  bool flat = false;
+
+  /// If nonzero, measure memory instead of throughput, using values of this
+  /// many bytes
+  size_t value_size = 0;
 };
 
 /// Parse the command-line arguments, and use them to populate the provided args
@@ -39,7 +55,7 @@ struct server_arg_t {
 /// @param args The struct into which the parsed args should go
 void parse_args(int argc, char **argv, server_arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "k:t:r:i:b:h")) != -1) {
+  while ((opt = getopt(argc, argv, "k:t:r:i:b:s:fom:h")) != -1) {
     switch (opt) {
     case 'k':
       args.keys = atoi(optarg);
@@ -56,6 +72,18 @@ void parse_args(int argc, char **argv, server_arg_t &args) {
     case 'b':
       args.buckets = atoi(optarg);
       break;
+    case 's':
+      args.scale = atoi(optarg);
+      break;
+    case 'f':
+      args.functions = true;
+      break;
+    case 'o':
+      args.flat = true;
+      break;
+    case 'm':
+      args.value_size = atoi(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -77,6 +105,11 @@ void usage(char *progname) {
        << "  -r [int] Read-only percent\n"
        << "  -i [int] Iterations per thread\n"
        << "  -b [int] Number of buckets\n"
+       << "  -s [int] Scale steps (re-run with 10x the key range, s times)\n"
+       << "  -f       Use std::function callbacks instead of lambdas\n"
+       << "  -o       Use the flat (open-addressing) hash table\n"
+       << "  -m [int] Report memory use after loading the key range as string\n"
+       << "           keys with values of this many bytes\n"
        << "  -h       Print help (this message)\n";
 }
 
@@ -91,21 +124,16 @@ enum EVENTS {
   COUNT = 6
 };
 
-int main(int argc, char **argv) {
-  // Parse the command-line arguments
-  server_arg_t args;
-  parse_args(argc, argv, args);
-  if (args.usage) {
-    usage(argv[0]);
-    return 0;
-  }
-
+/// Run one benchmark trial and print its results
+///
+/// @param args The configuration for this trial
+template <class TABLE> void run_bench(const server_arg_t &args) {
   // Print configuration
   cout << "# (k,t,r,i,b) = (" << args.keys << "," << args.threads << ","
        << args.reads << "," << args.iters << "," << args.buckets << ")\n";
 
   // Make a hash table, populate it with 50% of the keys.  We ignore values
-  ConcurrentHashTable<int, int> tbl(args.buckets);
+  TABLE tbl(args.buckets);
   for (size_t i = 0; i < args.keys; i += 2) {
     tbl.insert(i, 0, []() {});
   }
@@ -137,23 +165,30 @@ int main(int argc, char **argv) {
             // spin
           }
 
+          // Type-erased callbacks, for measuring the cost of std::function
+          function<void(const int &)> read_fn = [](int) {};
+          function<void()> write_fn = []() {};
+
           // Run the test
           unsigned seed = tid;
           for (size_t o = 0; o < args.iters; ++o) {
             size_t action = rand_r(&seed) % 100;
             size_t key = rand_r(&seed) % args.keys;
             if (action < args.reads) {
-              if (tbl.do_with_readonly(key, [](int) {}))
+              if (args.functions ? tbl.do_with_readonly(key, read_fn)
+                                 : tbl.do_with_readonly(key, [](int) {}))
                 ++my_stats[EVENTS::LOK_T];
               else
                 ++my_stats[EVENTS::LOK_F];
             } else if (action < args.reads + (100 - args.reads) / 2) {
-              if (tbl.insert(key, 0, []() {}))
+              if (args.functions ? tbl.insert(key, 0, write_fn)
+                                 : tbl.insert(key, 0, []() {}))
                 ++my_stats[EVENTS::INS_T];
               else
                 ++my_stats[EVENTS::INS_F];
             } else {
-              if (tbl.remove(key, []() {}))
+              if (args.functions ? tbl.remove(key, write_fn)
+                                 : tbl.remove(key, []() {}))
                 ++my_stats[EVENTS::RMV_T];
               else
                 ++my_stats[EVENTS::RMV_F];
@@ -191,4 +226,49 @@ int main(int argc, char **argv) {
   cout << "  Insert (False):     " << stats[EVENTS::INS_F] << endl;
   cout << "  Remove (True) :     " << stats[EVENTS::RMV_T] << endl;
   cout << "  Remove (False):     " << stats[EVENTS::RMV_F] << endl;
+  cout << "Final Buckets:        " << tbl.bucket_count() << endl;
+}
+
+/// Load the key range into a table with string keys and shared values, the
+/// way the server's kv_store holds them, and print the memory use
+///
+/// @param args The configuration for this trial
+template <class TABLE> void run_memory(const server_arg_t &args) {
+  cout << "# (k,m,b) = (" << args.keys << "," << args.value_size << ","
+       << args.buckets << ")\n";
+  cout << "Before:\n" << slab_pool::report();
+  TABLE tbl(args.buckets);
+  vec value(args.value_size, 'v');
+  for (size_t i = 0; i < args.keys; ++i) {
+    tbl.insert("key_" + to_string(i), make_shared_vec(value), []() {});
+  }
+  cout << "After:\n" << slab_pool::report();
+}
+
+int main(int argc, char **argv) {
+  // Parse the command-line arguments
+  server_arg_t args;
+  parse_args(argc, argv, args);
+  if (args.usage) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  if (args.value_size) {
+    if (args.flat)
+      run_memory<FlatHashTable<string, shared_vec>>(args);
+    else
+      run_memory<ConcurrentHashTable<string, shared_vec>>(args);
+    return 0;
+  }
+
+  // Run once at the requested key range, and then once per scale step with a
+  // 10x larger range.  With a resizable table, throughput should stay flat.
+  for (size_t s = 0; s <= args.scale; ++s) {
+    if (args.flat)
+      run_bench<FlatHashTable<int, int>>(args);
+    else
+      run_bench<ConcurrentHashTable<int, int>>(args);
+    args.keys *= 10;
+  }
 }
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <openssl/sha.h>
+#include <string>
+#include <unordered_map>
+
+#include "vec.h"
+
+/// BlobStore is a content-addressed store of immutable byte buffers.  Each
+/// blob is named by the SHA-256 digest of its content, so that many keys with
+/// the same value can share one copy of it.
+///
+/// Blobs are reference counted by shared_ptr: a blob lives for as long as
+/// anyone holds it, and when the last holder lets go, the blob removes itself
+/// from the store.  The store only holds weak references, so it never keeps a
+/// blob alive.
+///
+/// All operations take a single lock, which is only held for a map lookup or
+/// update.  Hashing and copying bytes happen outside of it.
+class BlobStore {
+public:
+  /// A blob: the bytes of a value, and the digest that names them
+  struct blob_t {
+    /// The SHA-256 digest of the blob's content
+    const std::string digest;
+
+    /// The bytes that are stored.  These may be an encoding (such as a
+    /// compressed one) of the content that the digest names.
+    const slab_vec bytes;
+
+    /// The length of the content, if bytes holds an encoding of it, or 0
+    const uint32_t raw_size;
+
+    /// A mark for the owner's use, such as the generation of the file in which
+    /// the blob was last written
+    mutable std::atomic<uint64_t> mark{0};
+
+    /// A lock for the owner's use, such as for writing the blob once per file
+    mutable std::mutex lock;
+
+    /// Construct a blob
+    ///
+    /// @param d     The digest of the content
+    /// @param begin The start of the bytes to store
+    /// @param end   The end of the bytes to store
+    /// @param raw   The length of the content, if the bytes encode it, or 0
+    blob_t(const std::string &d, const unsigned char *begin,
+           const unsigned char *end, uint32_t raw)
+        : digest(d), bytes(begin, end), raw_size(raw) {}
+  };
+
+private:
+  /// The state of the store, which outlives the store while blobs are alive
+  struct state_t {
+    /// A lock protecting the map
+    std::mutex lock;
+
+    /// The live blobs, by digest
+    std::unordered_map<std::string, std::weak_ptr<const blob_t>> blobs;
+
+    /// The number of bytes stored in live blobs
+    std::atomic<size_t> bytes{0};
+  };
+
+  /// The state of the store.  Each blob's deleter holds a reference to it.
+  std::shared_ptr<state_t> state = std::make_shared<state_t>();
+
+public:
+  /// Compute the digest that names some content
+  ///
+  /// @param data The content
+  /// @param len  The length of the content
+  static std::string digest_of(const unsigned char *data, size_t len) {
+    unsigned char d[SHA256_DIGEST_LENGTH];
+    SHA256(data, len, d);
+    return std::string(reinterpret_cast<char *>(d), SHA256_DIGEST_LENGTH);
+  }
+
+  /// Find a live blob
+  ///
+  /// @param digest The digest of the blob's content
+  ///
+  /// @returns The blob, or nullptr if there is none
+  std::shared_ptr<const blob_t> find(const std::string &digest) {
+    std::lock_guard<std::mutex> g(state->lock);
+    auto i = state->blobs.find(digest);
+    return i == state->blobs.end() ? nullptr : i->second.lock();
+  }
+
+  /// Add a blob to the store.  If a blob with the same digest is already live,
+  /// it is returned instead, and the bytes are not used.
+  ///
+  /// @param digest The digest of the blob's content
+  /// @param begin  The start of the bytes to store
+  /// @param end    The end of the bytes to store
+  /// @param raw    The length of the content, if the bytes encode it, or 0
+  ///
+  /// @returns The blob with the given digest
+  std::shared_ptr<const blob_t> insert(const std::string &digest,
+                                       const unsigned char *begin,
+                                       const unsigned char *end,
+                                       uint32_t raw) {
+    if (auto b = find(digest))
+      return b;
+    // Build the blob without holding the lock.  Its deleter unmaps it, but only
+    // if the map still refers to it: a new blob with the same digest may have
+    // replaced it after it died.
+    std::shared_ptr<state_t> s = state;
+    std::shared_ptr<const blob_t> b(
+        new blob_t(digest, begin, end, raw), [s](const blob_t *p) {
+          {
+            std::lock_guard<std::mutex> g(s->lock);
+            auto i = s->blobs.find(p->digest);
+            if (i != s->blobs.end() && i->second.expired())
+              s->blobs.erase(i);
+          }
+          s->bytes -= p->bytes.size();
+          delete p;
+        });
+    state->bytes += b->bytes.size();
+    std::lock_guard<std::mutex> g(state->lock);
+    auto &slot = state->blobs[digest];
+    if (auto other = slot.lock())
+      return other;
+    slot = b;
+    return b;
+  }
+
+  /// Report the number of live blobs
+  size_t size() {
+    std::lock_guard<std::mutex> g(state->lock);
+    return state->blobs.size();
+  }
+
+  /// Report the number of bytes stored in live blobs
+  size_t bytes() { return state->bytes.load(); }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "vec.h"
+
+/// chunk_list is an immutable value that is stored as a sequence of shared
+/// chunks.  Every chunk but the last holds exactly CHUNK bytes, so the chunk
+/// that holds any offset is found with one division.
+///
+/// Appending to a chunk_list makes a new one that shares every full chunk of
+/// the old one, and only copies the old last chunk (which is less than CHUNK
+/// bytes).  An append therefore costs O(CHUNK + number of chunks), no matter
+/// how large the value is, and readers of the old value are not disturbed.
+///
+/// parts() hands out the chunks without joining them, so that a reader can
+/// copy a large value after it has released the table's locks.
+///
+/// Storage keeps every value that is larger than CHUNK, and that is neither
+/// compressed nor shared, as a chunk_list, so that no large value needs one
+/// contiguous buffer in the table.  This is only a storage layout: a value is
+/// still received and sent whole, so LEN_VAL still bounds it.
+class chunk_list {
+public:
+  /// The size of a full chunk
+  inline static const size_t CHUNK = 64 * 1024;
+
+private:
+  /// The chunks
+  std::vector<shared_vec> chunks;
+
+  /// The total number of bytes
+  size_t total = 0;
+
+  /// Add bytes to the end of this (new, unshared) chunk_list, filling the last
+  /// chunk before starting new ones
+  ///
+  /// @param begin The first byte
+  /// @param end   The byte after the last byte
+  void extend(const unsigned char *begin, const unsigned char *end) {
+    if (begin == end)
+      return;
+    if (!chunks.empty() && chunks.back()->size() < CHUNK) {
+      // Replace the partial last chunk with a copy that has the new bytes
+      const slab_vec &last = *chunks.back();
+      size_t n = std::min(CHUNK - last.size(), size_t(end - begin));
+      auto grown = std::allocate_shared<slab_vec>(slab_allocator<slab_vec>());
+      grown->reserve(last.size() + n);
+      grown->insert(grown->end(), last.begin(), last.end());
+      grown->insert(grown->end(), begin, begin + n);
+      chunks.back() = grown;
+      total += n;
+      begin += n;
+    }
+    for (; begin != end;) {
+      size_t n = std::min(CHUNK, size_t(end - begin));
+      chunks.push_back(make_shared_vec(begin, begin + n));
+      total += n;
+      begin += n;
+    }
+  }
+
+public:
+  /// Build a chunk_list from some bytes
+  ///
+  /// @param begin The first byte
+  /// @param end   The byte after the last byte
+  static std::shared_ptr<const chunk_list> make(const unsigned char *begin,
+                                                const unsigned char *end) {
+    auto c = std::make_shared<chunk_list>();
+    c->chunks.reserve((end - begin + CHUNK - 1) / CHUNK);
+    c->extend(begin, end);
+    return c;
+  }
+
+  /// Build a new chunk_list with the bytes of this one, followed by some more
+  ///
+  /// @param begin The first byte to add
+  /// @param end   The byte after the last byte to add
+  std::shared_ptr<const chunk_list> append(const unsigned char *begin,
+                                           const unsigned char *end) const {
+    auto c = std::make_shared<chunk_list>();
+    c->chunks.reserve(chunks.size() + (end - begin) / CHUNK + 1);
+    c->chunks = chunks;
+    c->total = total;
+    c->extend(begin, end);
+    return c;
+  }
+
+  /// Report the number of bytes in the value
+  size_t size() const { return total; }
+
+  /// Copy a range of the value's bytes to the end of a vector
+  ///
+  /// @param off The offset of the first byte (at most size())
+  /// @param len The number of bytes (at most size() - off)
+  /// @param out The vector to which the bytes are appended
+  void read(size_t off, size_t len, vec &out) const {
+    out.reserve(out.size() + len);
+    for (size_t i = off / CHUNK; len > 0; ++i) {
+      const slab_vec &c = *chunks[i];
+      size_t start = off - i * CHUNK, n = std::min(len, c.size() - start);
+      out.insert(out.end(), c.begin() + start, c.begin() + start + n);
+      off += n;
+      len -= n;
+    }
+  }
+
+  /// Get references to the chunks, in order, without copying any bytes
+  std::vector<shared_vec> parts() const { return chunks; }
+
+  /// Apply a function to each chunk, in order
+  ///
+  /// @param f The function, which takes a const slab_vec&
+  template <typename F> void for_each(F &&f) const {
+    for (const auto &c : chunks)
+      f(*c);
+  }
+};
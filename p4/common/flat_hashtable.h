@@ -0,0 +1,906 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "scan_cursor.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// FlatHashTable is a concurrent hash table (a Key/Value store) with the same
+/// interface as ConcurrentHashTable, but a flatter memory layout.
+///
+/// The table is one contiguous array of cache-line-aligned groups.  Each group
+/// has a lock, 16 slots for key/value pairs, and 16 one-byte fingerprints (7
+/// bits of the key's hash, plus a high bit to distinguish them from empty
+/// slots).  A lookup hashes to a group, locks it, and compares the key's
+/// fingerprint against all 16 fingerprints at once (with SSE2, when it is
+/// available).  Only slots whose fingerprints match have their keys compared,
+/// so a lookup usually costs one cache miss for the group header and one for
+/// the matching slot.
+///
+/// When a group is full, it gets an overflow group, which is protected by the
+/// lock of the group it hangs off of.  Overflow groups at the end of a chain
+/// are freed as soon as removals empty them.  When the table holds more than
+/// 7/8 of its slots, it doubles the number of groups.  Unlike
+/// ConcurrentHashTable, this resize is not incremental: it locks every group
+/// while it rehashes.  Old group arrays are kept until the table is
+/// destructed, since a thread may still be waiting on one of their locks.
+///
+/// evict() runs CLOCK at group granularity, as in ConcurrentHashTable.
+///
+/// NB: Because its resize stops the world, and its snapshots hold every group
+///     lock (2PL) instead of copying on write, FlatHashTable is meant for
+///     benchmarking the layout (TABLE=flat), not for serving.  The server's
+///     default build uses ConcurrentHashTable.
+template <typename K, typename V> class FlatHashTable {
+  /// The number of slots in a group
+  static const size_t GROUP_SIZE = 16;
+
+  /// The fingerprint of an empty slot
+  static const uint8_t EMPTY = 0;
+
+  /// The type used to pass keys to lookups.  For std::string keys, this is a
+  /// std::string_view, so that a caller can search with a slice of a buffer
+  /// instead of building a std::string.  (std::hash gives the same result for
+  /// a std::string and a std::string_view of the same characters.)
+  typedef typename std::conditional<std::is_same<K, std::string>::value,
+                                    std::string_view, const K &>::type
+      key_view_t;
+
+  /// A group_t is a lockable, fixed-size array of key/value slots
+  struct alignas(64) group_t {
+    /// The fingerprint of each slot, or EMPTY.  These come first, so that they
+    /// share a cache line with the lock.
+    alignas(16) uint8_t ctrl[GROUP_SIZE] = {0};
+
+    /// A lock, for protecting this group and its overflow groups
+    std::mutex lock;
+
+    /// The next group to search if this one is full, or nullptr
+    group_t *overflow = nullptr;
+
+    /// True once this group's pairs have been moved to a larger table
+    bool moved = false;
+
+    /// True if the group has been used since the clock hand last passed it
+    bool referenced = true;
+
+    /// The slots.  Slot i holds a constructed pair iff ctrl[i] != EMPTY
+    alignas(std::pair<K, V>) unsigned char slots[GROUP_SIZE]
+                                                [sizeof(std::pair<K, V>)];
+
+    /// Get the pair stored in a slot
+    ///
+    /// @param i The slot number
+    std::pair<K, V> *slot(size_t i) {
+      return std::launder(reinterpret_cast<std::pair<K, V> *>(slots[i]));
+    }
+
+    /// Find the slots whose fingerprints equal a given byte
+    ///
+    /// @param fp The fingerprint to look for
+    ///
+    /// @returns A bitmask with bit i set if ctrl[i] == fp
+    uint32_t match(uint8_t fp) const {
+#ifdef __SSE2__
+      __m128i c = _mm_load_si128(reinterpret_cast<const __m128i *>(ctrl));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(fp)));
+#else
+      uint32_t mask = 0;
+      for (size_t i = 0; i < GROUP_SIZE; ++i)
+        if (ctrl[i] == fp)
+          mask |= 1u << i;
+      return mask;
+#endif
+    }
+
+    /// Destroy every pair in the group, and free its overflow groups
+    void reset() {
+      for (size_t i = 0; i < GROUP_SIZE; ++i) {
+        if (ctrl[i] != EMPTY) {
+          slot(i)->~pair();
+          ctrl[i] = EMPTY;
+        }
+      }
+      delete overflow;
+      overflow = nullptr;
+    }
+
+    /// Destruct a group by destroying its pairs and overflow groups
+    ~group_t() { reset(); }
+  };
+
+  /// A table_t is one array of groups
+  struct table_t {
+    /// The number of groups in the table
+    const size_t num_groups;
+
+    /// The groups, contiguous in memory
+    std::unique_ptr<group_t[]> groups;
+
+    /// The table that replaced this one, if any
+    std::atomic<table_t *> next{nullptr};
+
+    /// Construct a table with a fixed number of empty groups
+    ///
+    /// @param n The number of groups in the table
+    table_t(size_t n) : num_groups(n), groups(new group_t[n]) {}
+  };
+
+  /// The newest (largest) array of groups
+  std::atomic<table_t *> active;
+
+  /// The number of groups the table started with.  Every table's group count
+  /// is this times a power of two.
+  const size_t base_groups;
+
+  /// The number of key/value pairs in the table
+  std::atomic<size_t> count{0};
+
+  /// A lock that serializes resize operations
+  std::mutex resize_lock;
+
+  /// Replaced tables, which are freed when the FlatHashTable is destructed
+  std::vector<table_t *> retired;
+
+  /// The position of evict()'s clock hand, as a scan cursor
+  uint64_t clock_hand = 0;
+
+  /// A lock that allows only one evict() at a time
+  std::mutex evict_lock;
+
+  /// The type in which batch operations receive their keys (key_view_t,
+  /// without the reference)
+  typedef typename std::decay<key_view_t>::type key_arg_t;
+
+  /// Run a callback about a pair whose value was replaced or removed.  If the
+  /// callback accepts the old value (after its other arguments), it gets it.
+  ///
+  /// @param f    The callback
+  /// @param old  The old value
+  /// @param args The callback's other arguments
+  template <typename F, typename... A>
+  static void notify(F &&f, const V &old, A... args) {
+    if constexpr (std::is_invocable<F, A..., const V &>::value)
+      f(args..., old);
+    else
+      f(args...);
+  }
+
+  /// Compute a key's hash.  The result of std::hash is mixed, because for
+  /// integers it is the identity, and we need good high bits for fingerprints.
+  ///
+  /// @param key The key to hash
+  static size_t hash_of(key_view_t key) {
+    return std::hash<typename std::decay<key_view_t>::type>{}(key) *
+           0x9E3779B97F4A7C15ull;
+  }
+
+  /// Compute a key's fingerprint from its hash
+  ///
+  /// @param h The hash of the key
+  static uint8_t fingerprint(size_t h) { return 0x80 | (h >> 57); }
+
+  /// Find the group that is responsible for a hash, and return it with its
+  /// lock held
+  ///
+  /// @param h The hash of the key
+  ///
+  /// @returns The locked group
+  group_t *lock_group(size_t h) {
+    table_t *t = active.load();
+    for (;;) {
+      group_t *g = &t->groups[h % t->num_groups];
+      g->lock.lock();
+      if (!g->moved) {
+        g->referenced = true;
+        return g;
+      }
+      g->lock.unlock();
+      t = t->next.load();
+    }
+  }
+
+  /// Search a group and its overflow groups for a key.  The caller must hold
+  /// the group's lock.
+  ///
+  /// @param g   The group to search
+  /// @param fp  The key's fingerprint
+  /// @param key The key to find
+  ///
+  /// @returns The group and slot holding key, or {nullptr, 0}
+  static std::pair<group_t *, size_t> find(group_t *g, uint8_t fp,
+                                           key_view_t key) {
+    for (; g != nullptr; g = g->overflow) {
+      for (uint32_t m = g->match(fp); m != 0; m &= m - 1) {
+        size_t i = __builtin_ctz(m);
+        if (g->slot(i)->first == key)
+          return {g, i};
+      }
+    }
+    return {nullptr, 0};
+  }
+
+  /// Construct a pair in the first empty slot of a group or its overflow
+  /// groups, adding an overflow group if they are all full.  The caller must
+  /// hold the group's lock (or own the group exclusively).
+  ///
+  /// @param g  The group in which to place the pair
+  /// @param fp The key's fingerprint
+  /// @param e  The pair to place
+  static void place(group_t *g, uint8_t fp, std::pair<K, V> &&e) {
+    for (;;) {
+      uint32_t m = g->match(EMPTY);
+      if (m != 0) {
+        size_t i = __builtin_ctz(m);
+        new (g->slots[i]) std::pair<K, V>(std::move(e));
+        g->ctrl[i] = fp;
+        return;
+      }
+      if (g->overflow == nullptr)
+        g->overflow = new group_t();
+      g = g->overflow;
+    }
+  }
+
+  /// Free the overflow groups at the end of a group's chain that hold no
+  /// pairs.  The caller must hold the group's lock.
+  ///
+  /// @param g The first group of the chain
+  static void trim(group_t *g) {
+    group_t *last = g;
+    for (group_t *o = g->overflow; o != nullptr; o = o->overflow)
+      if (o->match(EMPTY) != (1u << GROUP_SIZE) - 1)
+        last = o;
+    delete last->overflow;
+    last->overflow = nullptr;
+  }
+
+  /// Lock every group of the active table, in ascending order
+  ///
+  /// @returns The table whose groups were locked
+  table_t *lock_all() {
+    for (;;) {
+      table_t *t = active.load();
+      for (size_t i = 0; i < t->num_groups; ++i)
+        t->groups[i].lock.lock();
+      if (t->next.load() == nullptr)
+        return t;
+      unlock_all(t);
+    }
+  }
+
+  /// Lock every group that is responsible for one of a batch of keys, in
+  /// ascending order within each table, and older tables first (the order
+  /// that a resize uses).
+  ///
+  /// @param hashes The hashes of the keys in the batch
+  ///
+  /// @returns Each locked group, with the (ascending) indices of the keys
+  ///          that it is responsible for
+  std::vector<std::pair<group_t *, std::vector<size_t>>>
+  lock_batch(const std::vector<size_t> &hashes) {
+    using namespace std;
+    vector<pair<group_t *, vector<size_t>>> locked;
+    vector<size_t> pending(hashes.size());
+    iota(pending.begin(), pending.end(), 0);
+    table_t *t = active.load();
+    while (!pending.empty()) {
+      size_t n = t->num_groups;
+      sort(pending.begin(), pending.end(), [&](size_t x, size_t y) {
+        return make_pair(hashes[x] % n, x) < make_pair(hashes[y] % n, y);
+      });
+      // Keys whose group here has moved are retried in the next table
+      vector<size_t> later;
+      for (size_t i = 0, j; i < pending.size(); i = j) {
+        size_t idx = hashes[pending[i]] % n;
+        for (j = i + 1; j < pending.size() && hashes[pending[j]] % n == idx;)
+          ++j;
+        group_t *g = &t->groups[idx];
+        g->lock.lock();
+        if (g->moved) {
+          g->lock.unlock();
+          later.insert(later.end(), pending.begin() + i, pending.begin() + j);
+        } else {
+          g->referenced = true;
+          locked.push_back(
+              {g, vector<size_t>(pending.begin() + i, pending.begin() + j)});
+        }
+      }
+      pending.swap(later);
+      t = t->next.load();
+    }
+    return locked;
+  }
+
+  /// Hash every key of a batch
+  ///
+  /// @param n      The number of keys
+  /// @param key_of A function that returns the key at an index
+  template <typename F>
+  static std::vector<size_t> hash_batch(size_t n, F &&key_of) {
+    std::vector<size_t> hashes(n);
+    for (size_t i = 0; i < n; ++i)
+      hashes[i] = hash_of(key_of(i));
+    return hashes;
+  }
+
+  /// Apply a function to the pairs of the group that a scan cursor names.  If
+  /// the group has moved, its pairs are found in the two groups it split into.
+  ///
+  /// @param t      The table to start in
+  /// @param cursor The cursor of the group
+  /// @param f      The function to apply to each key/value pair
+  ///
+  /// @returns The number of pairs visited
+  template <typename F> size_t scan_group(table_t *t, uint64_t cursor, F &f) {
+    unsigned k = __builtin_ctzll(t->num_groups / base_groups);
+    group_t *g = &t->groups[scan_cursor_bucket(cursor, base_groups, k)];
+    {
+      std::lock_guard<std::mutex> l(g->lock);
+      if (!g->moved) {
+        size_t seen = 0;
+        for (group_t *o = g; o != nullptr; o = o->overflow) {
+          for (size_t s = 0; s < GROUP_SIZE; ++s) {
+            if (o->ctrl[s] != EMPTY) {
+              const auto &e = *o->slot(s);
+              f(e.first, e.second);
+              ++seen;
+            }
+          }
+        }
+        return seen;
+      }
+    }
+    table_t *n = t->next.load();
+    return scan_group(n, cursor, f) +
+           scan_group(n, scan_cursor_split(cursor, k), f);
+  }
+
+  /// Advance the clock hand over the group that a scan cursor names (or the
+  /// groups it split into, if it has moved).  A referenced group is unmarked;
+  /// an unreferenced one has all of its pairs evicted.
+  ///
+  /// @param t        The table to start in
+  /// @param cursor   The cursor of the group
+  /// @param on_evict The function to apply to each evicted key/value pair
+  ///
+  /// @returns The number of pairs evicted
+  template <typename F>
+  size_t evict_group(table_t *t, uint64_t cursor, F &on_evict) {
+    unsigned k = __builtin_ctzll(t->num_groups / base_groups);
+    group_t *g = &t->groups[scan_cursor_bucket(cursor, base_groups, k)];
+    {
+      std::lock_guard<std::mutex> l(g->lock);
+      if (!g->moved) {
+        if (g->referenced) {
+          g->referenced = false;
+          return 0;
+        }
+        size_t n = 0;
+        for (group_t *o = g; o != nullptr; o = o->overflow) {
+          for (size_t s = 0; s < GROUP_SIZE; ++s) {
+            if (o->ctrl[s] != EMPTY) {
+              const auto &e = *o->slot(s);
+              on_evict(e.first, e.second);
+              ++n;
+            }
+          }
+        }
+        g->reset();
+        count -= n;
+        return n;
+      }
+    }
+    table_t *n = t->next.load();
+    return evict_group(n, cursor, on_evict) +
+           evict_group(n, scan_cursor_split(cursor, k), on_evict);
+  }
+
+  /// Release the locks acquired by lock_all()
+  ///
+  /// @param t The table returned by lock_all()
+  void unlock_all(table_t *t) {
+    for (size_t i = 0; i < t->num_groups; ++i)
+      t->groups[i].lock.unlock();
+  }
+
+  /// Double the number of groups if the table is more than 7/8 full.  This
+  /// must be called without holding any group locks.
+  void maintain() {
+    table_t *t = active.load();
+    if (count.load(std::memory_order_relaxed) * 8 <=
+        t->num_groups * GROUP_SIZE * 7)
+      return;
+    std::unique_lock<std::mutex> g(resize_lock, std::try_to_lock);
+    if (!g || active.load() != t)
+      return;
+    for (size_t i = 0; i < t->num_groups; ++i)
+      t->groups[i].lock.lock();
+    table_t *n = new table_t(t->num_groups * 2);
+    for (size_t i = 0; i < t->num_groups; ++i) {
+      for (group_t *o = &t->groups[i]; o != nullptr; o = o->overflow) {
+        for (size_t s = 0; s < GROUP_SIZE; ++s) {
+          if (o->ctrl[s] != EMPTY) {
+            size_t h = hash_of(o->slot(s)->first);
+            place(&n->groups[h % n->num_groups], o->ctrl[s],
+                  std::move(*o->slot(s)));
+          }
+        }
+      }
+      t->groups[i].reset();
+      t->groups[i].moved = true;
+    }
+    t->next = n;
+    active = n;
+    retired.push_back(t);
+    unlock_all(t);
+  }
+
+public:
+  /// Construct a flat hash table by specifying the number of groups it should
+  /// start with
+  ///
+  /// @param _groups The initial number of groups
+  FlatHashTable(size_t _groups)
+      : active(new table_t(_groups ? _groups : 1)),
+        base_groups(_groups ? _groups : 1) {}
+
+  /// Destruct the hash table, freeing the active table and any replaced tables
+  ~FlatHashTable() {
+    delete active.load();
+    for (auto t : retired)
+      delete t;
+  }
+
+  /// Report the number of groups in the active table
+  size_t bucket_count() { return active.load()->num_groups; }
+
+  /// Report the number of key/value pairs in the table
+  size_t size() { return count.load(); }
+
+  /// Report the memory held by replaced and removed values that are not yet
+  /// destroyed.  This table destroys them right away, so it is always 0.
+  template <typename F> size_t retained(F &&) { return 0; }
+
+  /// Clear the Flat Hash Table.  This operation needs to use 2pl
+  void clear() {
+    table_t *t = lock_all();
+    for (size_t i = 0; i < t->num_groups; ++i)
+      t->groups[i].reset();
+    count = 0;
+    unlock_all(t);
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @returns true if the key/value was inserted, false if the key already
+  ///          existed in the table
+  template <typename F>
+  bool insert(key_view_t key, V val, F &&on_success) {
+    using namespace std;
+    size_t h = hash_of(key);
+    uint8_t fp = fingerprint(h);
+    {
+      group_t *g = lock_group(h);
+      lock_guard<mutex> l(g->lock, adopt_lock);
+      if (find(g, fp, key).first != nullptr)
+        return false;
+      place(g, fp, {K(key), std::move(val)});
+      ++count;
+      on_success();
+    }
+    maintain();
+    return true;
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @returns true if the key/value was inserted, false if the key already
+  ///          existed in the table and was thus updated instead
+  template <typename FI, typename FU>
+  bool upsert(key_view_t key, V val, FI &&on_ins, FU &&on_upd) {
+    using namespace std;
+    size_t h = hash_of(key);
+    uint8_t fp = fingerprint(h);
+    {
+      group_t *g = lock_group(h);
+      lock_guard<mutex> l(g->lock, adopt_lock);
+      auto found = find(g, fp, key);
+      if (found.first != nullptr) {
+        V old = std::move(found.first->slot(found.second)->second);
+        found.first->slot(found.second)->second = std::move(val);
+        notify(on_upd, old);
+        return false;
+      }
+      place(g, fp, {K(key), std::move(val)});
+      ++count;
+      on_ins();
+    }
+    maintain();
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @returns true if the key existed and the function was applied, false
+  ///          otherwise
+  template <typename F> bool do_with(key_view_t key, F &&f) {
+    using namespace std;
+    size_t h = hash_of(key);
+    group_t *g = lock_group(h);
+    lock_guard<mutex> l(g->lock, adopt_lock);
+    auto found = find(g, fingerprint(h), key);
+    if (found.first == nullptr)
+      return false;
+    f(found.first->slot(found.second)->second);
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @returns true if the key existed and the function was applied, false
+  ///          otherwise
+  template <typename F> bool do_with_readonly(key_view_t key, F &&f) {
+    using namespace std;
+    size_t h = hash_of(key);
+    group_t *g = lock_group(h);
+    lock_guard<mutex> l(g->lock, adopt_lock);
+    auto found = find(g, fingerprint(h), key);
+    if (found.first == nullptr)
+      return false;
+    const V &val = found.first->slot(found.second)->second;
+    f(val);
+    return true;
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @returns true if the key was found and the value unmapped, false otherwise
+  template <typename F> bool remove(key_view_t key, F &&on_success) {
+    return remove_if(key, [](const V &) { return true; },
+                     std::forward<F>(on_success));
+  }
+
+  /// Remove the mapping from a key to its value, if the value satisfies a
+  /// predicate that is checked while the key's group is locked
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param pred       The predicate that the value must satisfy
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @returns true if the key was found and the value unmapped, false otherwise
+  template <typename P, typename F>
+  bool remove_if(key_view_t key, P &&pred, F &&on_success) {
+    using namespace std;
+    size_t h = hash_of(key);
+    group_t *g = lock_group(h);
+    lock_guard<mutex> l(g->lock, adopt_lock);
+    auto found = find(g, fingerprint(h), key);
+    if (found.first == nullptr ||
+        !pred(static_cast<const V &>(found.first->slot(found.second)->second)))
+      return false;
+    V old = std::move(found.first->slot(found.second)->second);
+    found.first->slot(found.second)->~pair();
+    found.first->ctrl[found.second] = EMPTY;
+    trim(g);
+    --count;
+    notify(on_success, old);
+    return true;
+  }
+
+  /// Look up a batch of keys, locking each group once.  Every group stays
+  /// locked until the whole batch is done.
+  ///
+  /// @param keys The keys to find
+  /// @param f    The function to apply to each value that is found, given the
+  ///             key's index in keys
+  ///
+  /// @returns The number of keys that were found
+  template <typename F>
+  size_t multi_get(const std::vector<key_arg_t> &keys, F &&f) {
+    auto hashes =
+        hash_batch(keys.size(), [&](size_t i) -> key_view_t { return keys[i]; });
+    size_t found = 0;
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      for (size_t i : l.second) {
+        auto e = find(l.first, fingerprint(hashes[i]), keys[i]);
+        if (e.first != nullptr) {
+          const V &val = e.first->slot(e.second)->second;
+          f(i, val);
+          ++found;
+        }
+      }
+    }
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    return found;
+  }
+
+  /// Insert or update a batch of key/value pairs, locking each group once.  If
+  /// a key appears more than once, its pairs are applied in order.
+  ///
+  /// @param items  The pairs to upsert
+  /// @param on_ins Code to run for each pair that is inserted, given its index
+  /// @param on_upd Code to run for each pair that is an update, given its index
+  /// @param then   Code to run when the batch is done, but before unlocking
+  ///
+  /// @returns The number of pairs that were inserted
+  template <typename FI, typename FU, typename T>
+  size_t multi_upsert(std::vector<std::pair<key_arg_t, V>> items, FI &&on_ins,
+                      FU &&on_upd, T &&then) {
+    auto hashes = hash_batch(
+        items.size(), [&](size_t i) -> key_view_t { return items[i].first; });
+    size_t inserted = 0;
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      for (size_t i : l.second) {
+        uint8_t fp = fingerprint(hashes[i]);
+        auto e = find(l.first, fp, items[i].first);
+        if (e.first != nullptr) {
+          V old = std::move(e.first->slot(e.second)->second);
+          e.first->slot(e.second)->second = std::move(items[i].second);
+          notify(on_upd, old, i);
+        } else {
+          place(l.first, fp, {K(items[i].first), std::move(items[i].second)});
+          ++count;
+          ++inserted;
+          on_ins(i);
+        }
+      }
+    }
+    then();
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    maintain();
+    return inserted;
+  }
+
+  /// Remove a batch of keys, locking each group once
+  ///
+  /// @param keys       The keys to remove
+  /// @param on_success Code to run for each key that is removed, given its
+  ///                   index
+  /// @param then       Code to run when the batch is done, but before
+  ///                   unlocking
+  ///
+  /// @returns The number of keys that were removed
+  template <typename F, typename T>
+  size_t multi_remove(const std::vector<key_arg_t> &keys, F &&on_success,
+                      T &&then) {
+    auto hashes =
+        hash_batch(keys.size(), [&](size_t i) -> key_view_t { return keys[i]; });
+    size_t removed = 0;
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      for (size_t i : l.second) {
+        auto e = find(l.first, fingerprint(hashes[i]), keys[i]);
+        if (e.first != nullptr) {
+          V old = std::move(e.first->slot(e.second)->second);
+          e.first->slot(e.second)->~pair();
+          e.first->ctrl[e.second] = EMPTY;
+          --count;
+          ++removed;
+          notify(on_success, old, i);
+        }
+      }
+      trim(l.first);
+    }
+    then();
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    return removed;
+  }
+
+  /// Apply a function to every key/value pair in the FlatHashTable.  Note that
+  /// the function is not allowed to modify keys or values.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  template <typename F, typename T> void do_all_readonly(F &&f, T &&then) {
+    /// We'll use "strict" 2pl... first we acquire all locks, then we do all
+    /// operations, then we release all locks.
+    table_t *t = lock_all();
+    for (size_t i = 0; i < t->num_groups; ++i) {
+      for (group_t *g = &t->groups[i]; g != nullptr; g = g->overflow) {
+        for (size_t s = 0; s < GROUP_SIZE; ++s) {
+          if (g->ctrl[s] != EMPTY) {
+            const auto &e = *g->slot(s);
+            f(e.first, e.second);
+          }
+        }
+      }
+    }
+    // Before releasing locks, run the 'then'
+    then();
+    unlock_all(t);
+  }
+
+  /// Visit one page of a scan of the FlatHashTable, locking one group at a
+  /// time.  See ConcurrentHashTable::scan_page().
+  ///
+  /// @param cursor The cursor returned by the previous page, or 0
+  /// @param limit  The number of pairs after which the page ends
+  /// @param f      The function to apply to each key/value pair
+  ///
+  /// @returns The cursor for the next page, or 0 if the scan is done
+  template <typename F>
+  uint64_t scan_page(uint64_t cursor, size_t limit, F &&f) {
+    size_t seen = 0;
+    do {
+      table_t *t = active.load();
+      unsigned k = __builtin_ctzll(t->num_groups / base_groups);
+      // The cursor may come from a table newer than the one we loaded.  A
+      // cursor that no table is aligned with ends the scan.
+      while (cursor & ((uint64_t(1) << (32 - k)) - 1)) {
+        t = t->next.load();
+        if (t == nullptr)
+          return 0;
+        k = __builtin_ctzll(t->num_groups / base_groups);
+      }
+      seen += scan_group(t, cursor, f);
+      cursor = scan_cursor_next(cursor, base_groups, k);
+    } while (cursor != 0 && seen < limit);
+    return cursor;
+  }
+
+  /// Check if a scan cursor from a client could have come from scan_page()
+  ///
+  /// @param cursor The cursor
+  ///
+  /// @returns true if scan_page() can resume from the cursor
+  bool valid_cursor(uint64_t cursor) {
+    table_t *t = active.load();
+    return scan_cursor_valid(cursor, base_groups,
+                             __builtin_ctzll(t->num_groups / base_groups));
+  }
+
+  /// Evict cold pairs, using the CLOCK algorithm at group granularity.  See
+  /// ConcurrentHashTable::evict().
+  ///
+  /// @param target   The number of pairs to evict
+  /// @param on_evict Code to run for each evicted pair, given its key and
+  ///                 value, while its group is locked
+  ///
+  /// @returns The number of pairs evicted
+  template <typename F> size_t evict(size_t target, F &&on_evict) {
+    std::lock_guard<std::mutex> l(evict_lock);
+    size_t evicted = 0;
+    for (size_t steps = 2 * bucket_count(); evicted < target && steps > 0;
+         --steps) {
+      table_t *t = active.load();
+      unsigned k = __builtin_ctzll(t->num_groups / base_groups);
+      while (clock_hand & ((uint64_t(1) << (32 - k)) - 1)) {
+        t = t->next.load();
+        k = __builtin_ctzll(t->num_groups / base_groups);
+      }
+      evicted += evict_group(t, clock_hand, on_evict);
+      clock_hand = scan_cursor_next(clock_hand, base_groups, k);
+    }
+    return evicted;
+  }
+
+  /// Apply a function to every key/value pair in a snapshot of the
+  /// FlatHashTable.  The flat table does not keep copy-on-write versions of
+  /// its groups, so this is do_all_readonly(), and writers wait for the scan.
+  ///
+  /// @param f The function to apply to each key/value pair
+  template <typename F> void snapshot_readonly(F &&f) {
+    do_all_readonly(std::forward<F>(f), []() {});
+  }
+
+  /// Apply a function to every key/value pair in the FlatHashTable, using
+  /// several threads.  The groups are split into contiguous partitions, each
+  /// scanned by its own thread, so f must be safe to call concurrently for
+  /// different partitions.  The scan holds every lock, until after 'then'.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair.  Its first
+  ///              argument is the partition number, in [0, parts).
+  /// @param then  A function to run when all partitions are done, but before
+  ///              unlocking... useful for merging per-partition results
+  template <typename F, typename T>
+  void do_all_readonly(size_t parts, F &&f, T &&then) {
+    do_all_readonly(parts, std::forward<F>(f), std::forward<T>(then), []() {});
+  }
+
+  /// A version of do_all_readonly() that runs a function as soon as every
+  /// lock is held, before the scan
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair
+  /// @param then  A function to run when all partitions are done
+  /// @param first A function to run before any partition starts
+  template <typename F, typename T, typename S>
+  void do_all_readonly(size_t parts, F &&f, T &&then, S &&first) {
+    using namespace std;
+    table_t *t = lock_all();
+    first();
+    parts = max<size_t>(1, min(parts, t->num_groups));
+    auto run = [&](size_t p) {
+      size_t hi = t->num_groups * (p + 1) / parts;
+      for (size_t i = t->num_groups * p / parts; i < hi; ++i) {
+        for (group_t *g = &t->groups[i]; g != nullptr; g = g->overflow) {
+          for (size_t s = 0; s < GROUP_SIZE; ++s) {
+            if (g->ctrl[s] != EMPTY) {
+              const auto &e = *g->slot(s);
+              f(p, e.first, e.second);
+            }
+          }
+        }
+      }
+    };
+    vector<thread> workers;
+    for (size_t p = 1; p < parts; ++p)
+      workers.emplace_back(run, p);
+    run(0);
+    for (auto &w : workers)
+      w.join();
+    then();
+    unlock_all(t);
+  }
+
+  /// A parallel version of snapshot_readonly().  Like snapshot_readonly(),
+  /// this is the 2PL scan.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair
+  /// @param merge A function to run once every partition is done
+  template <typename F, typename M>
+  void snapshot_parallel(size_t parts, F &&f, M &&merge) {
+    do_all_readonly(parts, std::forward<F>(f), std::forward<M>(merge));
+  }
+
+  /// A version of snapshot_parallel() that runs a function at the snapshot's
+  /// point in time: here, as soon as every lock is held, before the scan.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair
+  /// @param merge A function to run once every partition is done
+  /// @param start A function to run when the snapshot is taken
+  template <typename F, typename M, typename S>
+  void snapshot_parallel(size_t parts, F &&f, M &&merge, S &&start) {
+    do_all_readonly(parts, std::forward<F>(f), std::forward<M>(merge),
+                    std::forward<S>(start));
+  }
+};
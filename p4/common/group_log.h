@@ -0,0 +1,479 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "vec.h"
+
+/// GroupLog is an append-only log file with group commit.  Writers hand their
+/// records to a dedicated writer thread through a bounded, lock-free,
+/// multi-producer/single-consumer ring, and get back the record's log sequence
+/// number (LSN): its position in the log, counting from 1.  The writer thread
+/// drains the ring, so that the records of many writers reach the file with
+/// one write(), and share one fdatasync().  A writer whose record must be
+/// durable before it replies waits on its LSN, after it has released every
+/// other lock.
+///
+/// A writer that must order its record with a change to a table reserves the
+/// record's LSN while it holds the bucket lock, which never blocks, and
+/// publishes the record after it has released the lock.  When the ring is
+/// full, publishing blocks until the writer thread makes room, which throttles
+/// writers to the speed of the disk without stalling anyone on their locks.
+/// Every reserved LSN must be published, since the writer thread writes
+/// records in LSN order, and parks until a reserved record is published.
+///
+/// How long a writer waits on its LSN depends on the log's sync policy:
+///  - OS_BUFFERED: until its record has been written, leaving it to the
+///    operating system to put it on disk (as fflush() would)
+///  - EVERY_COMMIT: until its record has been written and synced
+///  - N > 0: not at all.  The writer thread writes and syncs the ring every N
+///    milliseconds, so a crash loses at most the last N ms of records.
+///
+/// Records are written in LSN order.
+///
+/// If a write or a sync fails, the log latches the failure: no later record is
+/// written (so the file never has a hole in the middle), and every wait() or
+/// flush() for a record that was not yet as durable as the policy promises
+/// reports the failure, so that the writer can answer with an error instead of
+/// claiming success.  The latch is cleared by a switch to a file whose prepare
+/// function vouches that the file is complete without the dropped records
+/// (for example, because it holds a snapshot taken after them).
+class GroupLog {
+public:
+  /// The policy that never syncs
+  static const int OS_BUFFERED = -1;
+
+  /// The policy that syncs before any writer is released
+  static const int EVERY_COMMIT = 0;
+
+  /// The default number of slots in the ring
+  static const size_t RING_SLOTS = 4096;
+
+private:
+  /// A slot of the ring.  seq says who may use the slot next: it is pos when
+  /// the slot is free for the record at position pos, and pos + 1 once that
+  /// record has been published.
+  struct slot_t {
+    std::atomic<uint64_t> seq;
+    vec rec;
+  };
+
+  /// The sync policy: OS_BUFFERED, EVERY_COMMIT, or a number of milliseconds
+  const int policy;
+
+  /// The ring, and its size minus one (its size is a power of two)
+  std::unique_ptr<slot_t[]> ring;
+  const uint64_t mask;
+
+  /// The position that the next writer will claim.  LSN n is at position n-1.
+  std::atomic<uint64_t> tail{0};
+
+  /// The position that the writer thread will read next (only it uses this)
+  uint64_t head = 0;
+
+  /// True while the writer thread sleeps and needs a notify to wake up
+  std::atomic<bool> sleeping{false};
+
+  /// True while the writer thread waits for a reserved record to be published
+  std::atomic<bool> stalled{false};
+
+  /// The number of writers that are blocked on a full ring
+  std::atomic<size_t> blocked{0};
+
+  /// Every LSN up to this one has been written
+  std::atomic<uint64_t> written{0};
+
+  /// Every LSN up to this one has been written and synced
+  std::atomic<uint64_t> synced{0};
+
+  /// True once a write or a sync has failed, until a prepared switch
+  std::atomic<bool> failed{false};
+
+  /// The LSN of the last record that was dropped, or not synced, because of
+  /// a failure, or 0
+  std::atomic<uint64_t> dropped{0};
+
+  /// A lock protecting the fields below, and used by the condition variables
+  std::mutex lock;
+
+  /// A condition variable for waking the writer thread
+  std::condition_variable work_cv;
+
+  /// A condition variable for waking writers that wait on LSNs
+  std::condition_variable done_cv;
+
+  /// A condition variable for waking writers that wait for room in the ring
+  std::condition_variable space_cv;
+
+  /// The open file, or -1
+  int fd = -1;
+
+  /// The name of the open file
+  std::string path;
+
+  /// The size of the open file when it was opened
+  off_t opened_size = 0;
+
+  /// The size of the open file, as of the last batch written to it
+  std::atomic<uint64_t> file_size{0};
+
+  /// The file that the writer thread should switch to, if switching is true,
+  /// and the function to run on it before anything else is written to it
+  std::string next_path;
+  std::function<bool(int)> prepare;
+
+  /// Should the writer thread switch to next_path, after writing every record
+  /// before position switch_at?
+  bool switching = false;
+  uint64_t switch_at = 0;
+
+  /// The number of flush() calls that are waiting for a sync
+  size_t sync_requests = 0;
+
+  /// True once the writer thread should drain the ring and stop
+  bool stopping = false;
+
+  /// Records that the writer thread has taken from the ring, but not written
+  /// yet because there is no file (only the writer thread uses this)
+  vec held;
+
+  /// The writer thread
+  std::thread writer;
+
+  /// Check if the record at head has been published
+  bool ready() const { return ring[head & mask].seq.load() == head + 1; }
+
+  /// Check if the writer thread has something to do right away
+  bool has_work() const {
+    return stopping || switching || sync_requests > 0 ||
+           (fd >= 0 && !held.empty()) ||
+           ((policy <= 0 || blocked.load() > 0) && ready());
+  }
+
+  /// Move published records from the ring to the end of a batch, stopping at
+  /// a position.  Records before the position that have been reserved but
+  /// not published yet are waited for, with the writer thread parked.
+  ///
+  /// @param batch The batch
+  /// @param limit The position to stop at, or 0 to stop at the first record
+  ///              that has not been published
+  void drain(vec &batch, uint64_t limit) {
+    while (limit == 0 ? ready() : head < limit) {
+      slot_t &s = ring[head & mask];
+      if (s.seq.load() != head + 1) {
+        // As with sleeping, either the publisher sees stalled, or we see its
+        // record
+        std::unique_lock<std::mutex> g(lock);
+        stalled = true;
+        if (blocked.load() > 0)
+          space_cv.notify_all();
+        work_cv.wait(g, [&]() { return s.seq.load() == head + 1; });
+        stalled = false;
+      }
+      batch.insert(batch.end(), s.rec.begin(), s.rec.end());
+      s.rec.clear();
+      s.seq.store(head + mask + 1);
+      ++head;
+    }
+    if (blocked.load() > 0) {
+      std::lock_guard<std::mutex> g(lock);
+      space_cv.notify_all();
+    }
+  }
+
+  /// The writer thread's loop: take every record in the ring, write them
+  /// (and sync them, if the policy calls for it) without holding the lock,
+  /// and then release the writers whose LSNs they covered
+  void run() {
+    std::unique_lock<std::mutex> g(lock);
+    while (true) {
+      // Every atomic access is sequentially consistent, so either a writer
+      // that publishes sees sleeping, or has_work() sees its record
+      sleeping = true;
+      if (policy > 0)
+        work_cv.wait_for(g, std::chrono::milliseconds(policy),
+                         [&]() { return has_work(); });
+      else
+        work_cv.wait(g, [&]() { return has_work(); });
+      sleeping = false;
+      // Requests that arrive while the batch is written wait for the next one
+      size_t requests = sync_requests;
+      bool do_switch = switching;
+      uint64_t limit = do_switch ? switch_at : 0;
+      std::string to = do_switch ? next_path : path;
+      std::function<bool(int)> prep = do_switch ? std::move(prepare) : nullptr;
+      bool sync = policy != OS_BUFFERED || requests > 0 || do_switch || stopping;
+      int f = fd;
+      g.unlock();
+      drain(held, limit);
+      uint64_t end = head;
+      // After a failure, records are dropped instead of written
+      bool wrote = f >= 0 && !failed;
+      bool synced_ok = false;
+      if (f >= 0) {
+        if (wrote && !held.empty()) {
+          wrote = write_all(f, held.data(), held.size());
+          if (wrote)
+            file_size += held.size();
+        }
+        held.clear();
+        if (wrote && sync)
+          synced_ok = fdatasync(f) == 0;
+      }
+      // The failure is latched before prep runs, so that prep sees it
+      if (f >= 0 && (!wrote || (sync && !synced_ok))) {
+        failed = true;
+        if (end > 0)
+          dropped = end;
+      }
+      // Open the next file, and prepare it, before any later record goes to it.
+      // If it can't be prepared, go back to the old file.  A file that was
+      // prepared is complete, so it clears the failure.
+      int nf = f;
+      off_t size = opened_size;
+      bool prepared = false;
+      if (do_switch) {
+        if (f >= 0)
+          ::close(f);
+        nf = ::open(to.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (nf >= 0 && prep) {
+          prepared = prep(nf);
+          if (!prepared) {
+            ::close(nf);
+            to = path;
+            nf = path.empty() ? -1 : ::open(path.c_str(), O_WRONLY | O_APPEND);
+          }
+        }
+        size = nf >= 0 ? lseek(nf, 0, SEEK_END) : 0;
+      }
+      g.lock();
+      if (prepared)
+        failed = false;
+      if (wrote) {
+        written = end;
+        if (synced_ok)
+          synced = end;
+      }
+      sync_requests -= requests;
+      if (do_switch) {
+        fd = nf;
+        path = to;
+        opened_size = size;
+        file_size = size;
+        switching = false;
+      }
+      done_cv.notify_all();
+      if (stopping && (fd < 0 || (held.empty() && !ready())))
+        break;
+    }
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+public:
+  /// Write all of a buffer to a file, retrying short writes
+  ///
+  /// @param f   The file
+  /// @param buf The bytes to write
+  /// @param len The number of bytes
+  ///
+  /// @returns true if every byte was written
+  static bool write_all(int f, const unsigned char *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+      ssize_t n = ::write(f, buf + done, len - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+    return true;
+  }
+
+  /// Construct a log that has no file yet, and start its writer thread.
+  /// Records that are appended before open() are written to the file that it
+  /// opens.
+  ///
+  /// @param sync_policy OS_BUFFERED, EVERY_COMMIT, or a number of milliseconds
+  ///                    between syncs
+  /// @param slots       The number of records that the ring holds (rounded up
+  ///                    to a power of two)
+  GroupLog(int sync_policy, size_t slots = RING_SLOTS)
+      : policy(sync_policy < OS_BUFFERED ? OS_BUFFERED : sync_policy),
+        mask([&]() {
+          uint64_t n = 2;
+          while (n < slots)
+            n <<= 1;
+          return n - 1;
+        }()) {
+    ring.reset(new slot_t[mask + 1]);
+    for (uint64_t i = 0; i <= mask; ++i)
+      ring[i].seq = i;
+    writer = std::thread([this]() { run(); });
+  }
+
+  /// Write every record that has been appended, and stop the writer thread
+  ~GroupLog() {
+    {
+      std::lock_guard<std::mutex> g(lock);
+      stopping = true;
+    }
+    work_cv.notify_one();
+    writer.join();
+  }
+
+  /// Start switching the log to a file, opening it for appending (and
+  /// creating it if needed), without waiting for the switch.  Records appended
+  /// before the call go to the old file, if there was one, and are synced;
+  /// records appended after it go to the new file.  Only one switch may be in
+  /// progress at a time.
+  ///
+  /// @param to   The name of the file (which may be the current one)
+  /// @param prep A function to run on the writer thread, given the new file,
+  ///             before any record is written to it.  If it returns false,
+  ///             the log goes back to the old file.  If it returns true, it
+  ///             vouches that the file is complete and synced, even without
+  ///             any records that were dropped because of a failure, so the
+  ///             failure is cleared.
+  ///
+  /// @returns The LSN of the last record that goes to the old file
+  uint64_t request_open(const std::string &to,
+                        std::function<bool(int)> prep = nullptr) {
+    std::lock_guard<std::mutex> g(lock);
+    next_path = to;
+    prepare = std::move(prep);
+    switch_at = tail.load();
+    switching = true;
+    work_cv.notify_one();
+    return switch_at;
+  }
+
+  /// Wait for the switch that request_open() started
+  ///
+  /// @returns The size of the file that the log now appends to, when it was
+  ///          opened (and prepared).  Records appended after the switch start
+  ///          at this offset.
+  off_t wait_open() {
+    std::unique_lock<std::mutex> g(lock);
+    done_cv.wait(g, [&]() { return !switching; });
+    return opened_size;
+  }
+
+  /// Switch the log to a file, and wait for the switch (see request_open())
+  ///
+  /// @param to   The name of the file
+  /// @param prep A function to run on the new file before it is used
+  ///
+  /// @returns The file's size when it was opened (and prepared)
+  off_t open(const std::string &to, std::function<bool(int)> prep = nullptr) {
+    request_open(to, std::move(prep));
+    return wait_open();
+  }
+
+  /// Reserve the LSN of the next record, without waiting.  Records are
+  /// written in the order of their LSNs, so reserving while a bucket lock is
+  /// held orders the record with the bucket's change.  The record must then
+  /// be published, with publish().
+  ///
+  /// @returns The record's LSN
+  uint64_t reserve() { return tail.fetch_add(1) + 1; }
+
+  /// Publish the record for a reserved LSN.  If the ring is full, this blocks
+  /// until the writer thread has made room, so it should be called after every
+  /// lock has been released.
+  ///
+  /// @param lsn The LSN, from reserve()
+  /// @param rec The bytes of the record, which are moved into the ring
+  void publish(uint64_t lsn, vec &&rec) {
+    uint64_t pos = lsn - 1;
+    slot_t &s = ring[pos & mask];
+    if (s.seq.load() != pos) {
+      // The slot still holds a record from an earlier lap: the ring is full
+      std::unique_lock<std::mutex> g(lock);
+      ++blocked;
+      work_cv.notify_one();
+      space_cv.wait(g, [&]() { return s.seq.load() == pos; });
+      --blocked;
+    }
+    s.rec = std::move(rec);
+    s.seq.store(pos + 1);
+    if (stalled.load() ||
+        ((policy <= 0 || blocked.load() > 0) && sleeping.load())) {
+      std::lock_guard<std::mutex> g(lock);
+      work_cv.notify_one();
+    }
+  }
+
+  /// Add a record to the log: reserve its LSN and publish it right away
+  ///
+  /// @param rec The bytes of the record, which are moved into the ring
+  ///
+  /// @returns The record's LSN, for wait(), or 0 if the record was empty
+  uint64_t append(vec &&rec) {
+    if (rec.empty())
+      return 0;
+    uint64_t lsn = reserve();
+    publish(lsn, std::move(rec));
+    return lsn;
+  }
+
+  /// Wait until a record is as durable as the policy promises.  With a timed
+  /// policy, or no file, this returns right away.
+  ///
+  /// @param lsn The record's LSN, from append() or reserve(), or 0 for none
+  ///
+  /// @returns false if the log has failed before the record was written (or
+  ///          synced, if the policy calls for it), true otherwise.  With a
+  ///          timed policy, false means that the log has failed.
+  bool wait(uint64_t lsn) {
+    if (lsn == 0)
+      return true;
+    if (policy > 0)
+      return !failed;
+    std::unique_lock<std::mutex> g(lock);
+    auto done = [&]() {
+      return (policy == EVERY_COMMIT ? synced : written) >= lsn;
+    };
+    done_cv.wait(g, [&]() { return fd < 0 || failed || done(); });
+    return done() || !failed;
+  }
+
+  /// Check if a write or a sync of the log has failed, since the last
+  /// prepared switch
+  bool has_failed() const { return failed.load(); }
+
+  /// Report the LSN of the last record that was dropped (or written but not
+  /// synced) because of a failure, or 0 if there was none.  A prepare
+  /// function can compare it with a snapshot's point in time.
+  uint64_t dropped_lsn() const { return dropped.load(); }
+
+  /// Report the size of the file that the log appends to, as of the last
+  /// batch that was written to it
+  uint64_t size() const { return file_size.load(); }
+
+  /// Report the LSN of the last record that has been written and synced
+  uint64_t durable_lsn() const { return synced.load(); }
+
+  /// Write and sync every record that has been appended, whatever the policy
+  ///
+  /// @returns false if the log has failed before every record was synced
+  bool flush() {
+    std::unique_lock<std::mutex> g(lock);
+    uint64_t target = tail.load();
+    ++sync_requests;
+    work_cv.notify_one();
+    done_cv.wait(g, [&]() { return fd < 0 || failed || synced >= target; });
+    return synced >= target || !failed;
+  }
+};
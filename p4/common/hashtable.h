@@ -1,15 +1,29 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "inline_key.h"
+#include "read_epoch.h"
+#include "scan_cursor.h"
+#include "slab.h"
+
 /// ConcurrentHashTable is a concurrent hash table (a Key/Value store).  It is
-/// not resizable, which means that the O(1) guarantees of a hash table are lost
-/// if the number of elements in the table gets too big.
+/// resizable: when the load factor passes a threshold, the table doubles its
+/// bucket count, so that the O(1) guarantees of a hash table are preserved as
+/// the number of elements grows.
 ///
 /// The ConcurrentHashTable is templated on the Key and Value types
 ///
@@ -18,32 +32,859 @@
 /// pair, consisting of a key and a value.  We can use std::hash() to choose a
 /// bucket from a key.
 ///
-/// NB: This ConcurrentHashTable isn't good, and nobody should ever use it.  It
-///     doesn't have O(1) operations, but it implements a map interface, so it
-///     can be used in the assignment.
-template <typename K, typename V> class ConcurrentHashTable {
-  /// A lock, for protecting this bucket
-  std::mutex lock;
+/// Resizing is incremental.  When the table grows, a new (twice as large)
+/// array of buckets is installed, and the old array is "drained" a few buckets
+/// at a time by the threads that are performing ordinary operations on the
+/// table.  A bucket that has been drained is marked as migrated, and any
+/// operation that finds a migrated bucket follows the old array's forwarding
+/// pointer to the new array.  At most one migration is in progress at a time,
+/// so a key is always in exactly one of (a) its unmigrated bucket in the
+/// draining array, or (b) its bucket in the active array.
+///
+/// NB: Drained arrays are not freed until the ConcurrentHashTable is
+///     destructed, because a thread may still be holding a pointer to one.
+///     Since the table only grows, all of the drained arrays together are
+///     smaller than the active array.
+///
+/// When K and V are trivially copyable, do_with_readonly() does not lock.  Each
+/// bucket has a sequence number (a seqlock) that writers make odd while they
+/// change the bucket, and readers copy the value out and then check that the
+/// sequence number did not change.  For this to be safe, a bucket's pair array
+/// is never freed while the table is alive: when it must grow, the old array is
+/// kept in the bucket's "outgrown" list.  Like the drained tables, the outgrown
+/// arrays are together smaller than the array that replaced them.
+///
+/// A table with std::string keys can take the same path for a value type that
+/// is not trivially copyable, but is cheap to copy (such as one that holds
+/// shared_ptrs), by setting SHARED_READS.  A reader copies the bytes of each
+/// entry, compares the key in the copy (keys longer than inline_key::INLINE
+/// take the locked path, since their bytes are not in the entry), and once the
+/// sequence number checks out, copy-constructs the value from those bytes.
+/// That copy is only safe if the value it refers to is still alive, so
+/// writers retire the values they replace or remove instead of destroying
+/// them (see read_epoch).  Retired values wait in a table-wide limbo, which is
+/// drained as soon as no reader can still be copying them: by the write that
+/// retired them, if no reader is in the way, and otherwise by the next write
+/// or read that finds the readers gone.
+///
+/// snapshot_readonly() visits a consistent snapshot of the table without
+/// stopping writers.  Starting a snapshot bumps a snapshot epoch.  The first
+/// writer to change a bucket after that saves a copy of the bucket's pairs
+/// (copy-on-write), and the scanner, which locks one bucket at a time, reads the
+/// saved copy if there is one, and the bucket itself otherwise.  Migration
+/// counts as a write to both of the buckets involved, so a snapshot that runs
+/// during a resize sees each key exactly once.
+///
+/// evict() implements the CLOCK algorithm at bucket granularity.  Every
+/// operation on a key marks its bucket as referenced, and a clock hand sweeps
+/// the buckets, clearing the marks.  A bucket that is still unmarked when the
+/// hand comes back has not been used for a whole revolution, so all of its
+/// pairs are cold.  The hand is a scan cursor, so it survives resizes.
+///
+/// std::string keys are stored as inline_keys, which cache the key's hash and
+/// keep short keys inside the entry, so that a search rejects most entries
+/// without reading key bytes.  Callbacks receive keys as key_view_t.
+template <typename K, typename V, bool SHARED_READS = false>
+class ConcurrentHashTable {
+  /// True if keys and values can be copied with memcpy, so that readers can
+  /// search a bucket without holding its lock
+  static constexpr bool OPTIMISTIC = std::is_trivially_copyable<K>::value &&
+                                     std::is_trivially_copyable<V>::value &&
+                                     std::is_default_constructible<K>::value &&
+                                     std::is_default_constructible<V>::value;
+
+  /// True if readers search a bucket without holding its lock, and copy the
+  /// value out under the protection of a read_epoch (see SHARED_READS)
+  static constexpr bool GUARDED = SHARED_READS && !OPTIMISTIC &&
+                                  std::is_same<K, std::string>::value &&
+                                  std::is_default_constructible<V>::value;
+
+  /// True if buckets are kept readable by readers that do not lock them
+  static constexpr bool LOCK_FREE_READS = OPTIMISTIC || GUARDED;
+
+  /// The type used to pass keys to lookups.  For std::string keys, this is a
+  /// std::string_view, so that a caller can search with a slice of a buffer
+  /// instead of building a std::string.  (std::hash gives the same result for
+  /// a std::string and a std::string_view of the same characters.)
+  typedef typename std::conditional<std::is_same<K, std::string>::value,
+                                    std::string_view, const K &>::type
+      key_view_t;
+
+  /// The type in which batch operations receive their keys (key_view_t,
+  /// without the reference)
+  typedef typename std::decay<key_view_t>::type key_arg_t;
+
+  /// Hash a key, given as a key_view_t
+  ///
+  /// @param key The key to hash
+  static size_t hash_key(key_view_t key) {
+    return std::hash<typename std::decay<key_view_t>::type>{}(key);
+  }
+
+  /// True if keys are stored as inline_keys
+  static constexpr bool INLINE_KEYS = std::is_same<K, std::string>::value;
+
+  /// The type in which an entry stores its key
+  typedef typename std::conditional<INLINE_KEYS, inline_key, K>::type
+      stored_key_t;
+
+  /// The type of an entry: a stored key and its value
+  typedef std::pair<stored_key_t, V> entry_t;
+
+  /// Make the stored form of a key
+  ///
+  /// @param key The key
+  /// @param h   The key's hash
+  static stored_key_t make_key(key_view_t key, size_t h) {
+    if constexpr (INLINE_KEYS)
+      return inline_key(key, h);
+    else
+      return K(key);
+  }
+
+  /// Find the hash of a stored key, without rehashing it if it is cached
+  ///
+  /// @param s The stored key
+  static size_t stored_hash(const stored_key_t &s) {
+    if constexpr (INLINE_KEYS)
+      return s.hash();
+    else
+      return hash_key(s);
+  }
+
+  /// Check if a stored key is a given key
+  ///
+  /// @param s   The stored key
+  /// @param h   The hash of the given key
+  /// @param key The given key
+  static bool key_matches(const stored_key_t &s, size_t h, key_view_t key) {
+    if constexpr (INLINE_KEYS)
+      return s.matches(h, key);
+    else
+      return s == key;
+  }
+
+  /// View a stored key the way callbacks receive keys
+  ///
+  /// @param s The stored key
+  static key_view_t view_of(const stored_key_t &s) { return s; }
+
+  /// The type of a bucket's array of pairs.  Bucket arrays are small and
+  /// numerous, so they come from the slab allocator.
+  typedef std::vector<entry_t, slab_allocator<entry_t>> pairs_t;
+
+  /// A bucket_t is a lockable vector of key/value pairs
+  struct bucket_t {
+    /// A lock, for protecting this bucket
+    std::mutex lock;
+
+    /// The vector of key/value pairs in this bucket
+    pairs_t pairs;
+
+    /// True once this bucket's pairs have been moved to the next table
+    std::atomic<bool> migrated{false};
+
+    /// True if the bucket has been used since the clock hand last passed it.
+    /// New buckets start out referenced, so that a resize does not make the
+    /// whole table look cold.
+    bool referenced = true;
+
+    /// The seqlock sequence number.  It is odd while a writer is changing the
+    /// bucket.  Only maintained for LOCK_FREE_READS tables.
+    std::atomic<uint64_t> seq{0};
+
+    /// The address of pairs' array, published for lock-free readers
+    std::atomic<entry_t *> view_data{nullptr};
+
+    /// The length of pairs, published for lock-free readers
+    std::atomic<size_t> view_size{0};
+
+    /// Pair arrays that were replaced by larger ones, and that a lock-free
+    /// reader might still be looking at
+    std::vector<pairs_t> outgrown;
+
+    /// The snapshot epoch for which this bucket has been saved or scanned
+    uint64_t cow_epoch = 0;
+
+    /// The bucket's pairs as of the start of snapshot cow_epoch, if a writer
+    /// changed the bucket before the snapshot scanned it
+    pairs_t saved;
+
+    /// Start changing the bucket.  The caller must hold the lock.
+    void begin_write() {
+      if constexpr (LOCK_FREE_READS) {
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+    }
+
+    /// Finish changing the bucket, and publish its array to lock-free readers.
+    /// The array is published before its length, so that a reader who sees a
+    /// length never uses it with an array that is smaller.
+    void end_write() {
+      if constexpr (LOCK_FREE_READS) {
+        view_data.store(pairs.data(), std::memory_order_release);
+        view_size.store(pairs.size(), std::memory_order_release);
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+      }
+    }
+
+    /// Append a pair to the bucket.  The caller must hold the lock and be
+    /// between begin_write() and end_write().
+    ///
+    /// @param e The pair to append
+    void append(entry_t &&e) {
+      if constexpr (LOCK_FREE_READS) {
+        // Grow by hand, so that the old array is kept instead of freed.  Its
+        // pairs are moved out, so it holds no references.
+        if (pairs.size() == pairs.capacity()) {
+          pairs_t bigger;
+          bigger.reserve(pairs.capacity() ? 2 * pairs.capacity() : 4);
+          bigger.insert(bigger.end(), std::make_move_iterator(pairs.begin()),
+                        std::make_move_iterator(pairs.end()));
+          outgrown.push_back(std::move(pairs));
+          pairs = std::move(bigger);
+        }
+      }
+      pairs.push_back(std::move(e));
+    }
+  };
+
+  /// A table_t is one array of buckets, along with the state for draining it
+  /// into its successor
+  struct table_t {
+    /// The table of buckets.  Note that we store pointers to bucket_t, not
+    /// bucket_t's themselves, so that locks are less likely to be on the same
+    /// cache line.
+    std::vector<bucket_t *> buckets;
+
+    /// The table into which this table is being drained, if any
+    std::atomic<table_t *> next{nullptr};
+
+    /// The index of the next bucket to hand out for migration
+    std::atomic<size_t> cursor{0};
+
+    /// The number of buckets whose migration has completed
+    std::atomic<size_t> drained{0};
+
+    /// Construct a table with a fixed number of empty buckets
+    ///
+    /// @param num_buckets The number of buckets in the table
+    /// @param epoch       The snapshot in progress, if any.  A table created
+    ///                    during a snapshot is not part of it.
+    table_t(size_t num_buckets, uint64_t epoch = 0) {
+      for (size_t i = 0; i < num_buckets; ++i) {
+        buckets.emplace_back(new bucket_t());
+        buckets.back()->cow_epoch = epoch;
+      }
+    }
+
+    /// Free all of the buckets of the table
+    ~table_t() {
+      for (auto b : buckets)
+        delete b;
+    }
+  };
+
+  /// The number of buckets that each operation migrates while a resize is in
+  /// progress
+  static const size_t MIGRATE_STEP = 2;
+
+  /// The number of times a lock-free read is attempted before falling back to
+  /// locking the bucket
+  static const size_t OPTIMISTIC_TRIES = 4;
+
+  /// The average number of elements per bucket that triggers a resize
+  const size_t max_load;
+
+  /// The number of buckets the table started with.  Every table's bucket
+  /// count is this times a power of two.
+  const size_t base_buckets;
+
+  /// The newest (largest) array of buckets
+  std::atomic<table_t *> active;
+
+  /// The array that is being drained into active, or nullptr if no resize is
+  /// in progress
+  std::atomic<table_t *> draining{nullptr};
+
+  /// The number of key/value pairs in the table
+  std::atomic<size_t> count{0};
+
+  /// A lock that serializes the start and end of resize operations.  It is
+  /// never held by get/put/remove operations.
+  std::mutex resize_lock;
+
+  /// Drained tables, which are freed when the ConcurrentHashTable is destructed
+  std::vector<table_t *> retired;
 
-  /// The vector of key/value pairs in this bucket
-  std::vector<std::pair<K, V>> pairs;
+  /// The epoch of the snapshot in progress, or 0 if there is none
+  std::atomic<uint64_t> snapping{0};
+
+  /// The epoch of the most recent snapshot
+  uint64_t last_epoch = 0;
+
+  /// A lock that allows only one snapshot at a time
+  std::mutex snap_lock;
+
+  /// Held (shared) while a bucket is migrated, or while a multi-key write
+  /// holds its buckets, so that a snapshot can't start after a migration has
+  /// moved some of a bucket's pairs but not all of them, or after a batch has
+  /// written some of its buckets but not all of them
+  std::shared_mutex migrate_gate;
+
+  /// The position of evict()'s clock hand, as a scan cursor
+  uint64_t clock_hand = 0;
+
+  /// A lock that allows only one evict() at a time
+  std::mutex evict_lock;
+
+  /// The epochs of lock-free readers, for GUARDED tables
+  read_epoch reads;
+
+  /// Values that were replaced or removed, with the epochs in which they were
+  /// retired, that a lock-free reader might still be copying.  Epochs never
+  /// decrease from front to back.  Only used by GUARDED tables.
+  std::deque<std::pair<uint64_t, V>> limbo;
+
+  /// The length of limbo, so that readers can skip reclaim() without locking
+  std::atomic<size_t> limbo_size{0};
+
+  /// A lock that protects limbo
+  std::mutex limbo_lock;
+
+  /// Run a callback about a pair whose value was replaced or removed.  If the
+  /// callback accepts the old value (after its other arguments), it gets it.
+  ///
+  /// @param f    The callback
+  /// @param old  The old value
+  /// @param args The callback's other arguments
+  template <typename F, typename... A>
+  static void notify(F &&f, const V &old, A... args) {
+    if constexpr (std::is_invocable<F, A..., const V &>::value)
+      f(args..., old);
+    else
+      f(args...);
+  }
+
+  /// Start changing a bucket.  If a snapshot is in progress and has not yet
+  /// seen this bucket, save the bucket's pairs for it first.  The caller must
+  /// hold the bucket's lock.
+  ///
+  /// @param b The bucket that is about to change
+  void before_write(bucket_t *b) {
+    uint64_t e = snapping.load();
+    if (e != 0 && b->cow_epoch != e) {
+      b->saved = pairs_t(b->pairs);
+      b->cow_epoch = e;
+    }
+    b->begin_write();
+  }
+
+  /// Dispose of a value that was just replaced in, or removed from, a bucket.
+  /// In a GUARDED table, a lock-free reader may be copying it, so it is put in
+  /// limbo until that is no longer possible; otherwise it is destroyed by the
+  /// caller.  The caller must have finished the write that unlinked the value.
+  ///
+  /// @param old The value
+  void retire(V &&old) {
+    if constexpr (GUARDED) {
+      {
+        std::lock_guard<std::mutex> g(limbo_lock);
+        limbo.emplace_back(reads.current(), std::move(old));
+        limbo_size = limbo.size();
+      }
+      reclaim(true);
+    }
+  }
+
+  /// Advance the read epoch as far as the readers allow, and destroy the
+  /// values in limbo that no reader can still be copying.  With no reader in
+  /// the way, two advances make everything in limbo safe.
+  ///
+  /// @param wait Should we wait for the limbo lock?  A reader does not, since
+  ///             whoever holds it is reclaiming already.
+  void reclaim(bool wait) {
+    if constexpr (GUARDED) {
+      using namespace std;
+      if (limbo_size.load(memory_order_relaxed) == 0)
+        return;
+      reads.advance();
+      reads.advance();
+      unique_lock<mutex> g(limbo_lock, defer_lock);
+      if (wait)
+        g.lock();
+      else if (!g.try_lock())
+        return;
+      size_t n = 0;
+      while (n < limbo.size() && reads.safe(limbo[n].first))
+        ++n;
+      if (n == 0)
+        return;
+      // Destroy the values once the lock is released
+      vector<V> dead;
+      dead.reserve(n);
+      for (size_t i = 0; i < n; ++i)
+        dead.push_back(std::move(limbo[i].second));
+      limbo.erase(limbo.begin(), limbo.begin() + n);
+      limbo_size = limbo.size();
+      g.unlock();
+    }
+  }
+
+  /// Find the bucket that currently holds (or should hold) a key, and return
+  /// it with its lock held.
+  ///
+  /// @param h The hash of the key to locate
+  ///
+  /// @returns The locked bucket that is responsible for the key
+  bucket_t *lock_bucket(size_t h) {
+    // Read active before draining: a resize publishes draining first, so if we
+    // see the new active table we are guaranteed to see its draining table.
+    table_t *t = active.load();
+    table_t *d = draining.load();
+    if (d != nullptr)
+      t = d;
+    for (;;) {
+      bucket_t *b = t->buckets[h % t->buckets.size()];
+      b->lock.lock();
+      if (!b->migrated) {
+        b->referenced = true;
+        return b;
+      }
+      b->lock.unlock();
+      t = t->next.load();
+    }
+  }
+
+  /// Search for a key without taking any locks.  Only valid for OPTIMISTIC
+  /// tables.
+  ///
+  /// @param key   The key to find
+  /// @param found Set to true if the key was in the table
+  /// @param out   Set to a copy of the key's value, if it was found
+  ///
+  /// @returns true if no writer interfered, so that found and out can be
+  ///          trusted, false if the caller must try again
+  bool read_optimistic(key_view_t key, bool &found, V &out) {
+    using namespace std;
+    size_t h = hash_key(key);
+    table_t *t = active.load();
+    table_t *d = draining.load();
+    if (d != nullptr)
+      t = d;
+    for (;;) {
+      bucket_t *b = t->buckets[h % t->buckets.size()];
+      uint64_t s = b->seq.load(memory_order_acquire);
+      if (s & 1)
+        return false;
+      if (b->migrated.load(memory_order_acquire)) {
+        t = t->next.load();
+        continue;
+      }
+      size_t n = b->view_size.load(memory_order_acquire);
+      entry_t *p = b->view_data.load(memory_order_acquire);
+      found = false;
+      for (size_t i = 0; i < n; ++i) {
+        K k;
+        memcpy(&k, &p[i].first, sizeof(K));
+        if (k == key) {
+          memcpy(&out, &p[i].second, sizeof(V));
+          found = true;
+          break;
+        }
+      }
+      atomic_thread_fence(memory_order_acquire);
+      return b->seq.load(memory_order_relaxed) == s;
+    }
+  }
+
+  /// Search for a key without taking any locks.  Only valid for GUARDED
+  /// tables, and for keys that are stored inline.  Each entry is copied as
+  /// raw bytes, so that a writer can't change it while it is compared, and the
+  /// value is only copy-constructed from those bytes once the bucket's
+  /// sequence number shows that they were a real entry.  The read_epoch guard
+  /// keeps that entry's value alive until the copy is done, even if a writer
+  /// has replaced it by then.
+  ///
+  /// @param key   The key to find (at most inline_key::INLINE bytes)
+  /// @param found Set to true if the key was in the table
+  /// @param out   Set to a copy of the key's value, if it was found
+  ///
+  /// @returns true if no writer interfered, so that found and out can be
+  ///          trusted, false if the caller must try again
+  bool read_shared(key_view_t key, bool &found, V &out) {
+    using namespace std;
+    size_t h = hash_key(key);
+    read_epoch::guard g(reads);
+    table_t *t = active.load();
+    table_t *d = draining.load();
+    if (d != nullptr)
+      t = d;
+    for (;;) {
+      bucket_t *b = t->buckets[h % t->buckets.size()];
+      uint64_t s = b->seq.load(memory_order_acquire);
+      if (s & 1)
+        return false;
+      if (b->migrated.load(memory_order_acquire)) {
+        t = t->next.load();
+        continue;
+      }
+      size_t n = b->view_size.load(memory_order_acquire);
+      entry_t *p = b->view_data.load(memory_order_acquire);
+      alignas(entry_t) unsigned char img[sizeof(entry_t)];
+      const entry_t *e = std::launder(reinterpret_cast<const entry_t *>(img));
+      found = false;
+      for (size_t i = 0; i < n; ++i) {
+        memcpy(img, static_cast<const void *>(p + i), sizeof(entry_t));
+        // A key of this length is inline, so matching never follows a pointer
+        if (e->first.matches(h, key)) {
+          found = true;
+          break;
+        }
+      }
+      atomic_thread_fence(memory_order_acquire);
+      if (b->seq.load(memory_order_relaxed) != s)
+        return false;
+      if (found)
+        out = e->second;
+      return true;
+    }
+  }
+
+  /// Move the pairs of one bucket of a draining table into its successor
+  ///
+  /// @param t The table being drained
+  /// @param i The index of the bucket to move
+  void migrate_bucket(table_t *t, size_t i) {
+    using namespace std;
+    table_t *n = t->next.load();
+    bucket_t *src = t->buckets[i];
+    {
+      shared_lock<shared_mutex> m(migrate_gate);
+      lock_guard<mutex> g(src->lock);
+      before_write(src);
+      for (auto &e : src->pairs) {
+        bucket_t *dst = n->buckets[stored_hash(e.first) % n->buckets.size()];
+        lock_guard<mutex> g2(dst->lock);
+        before_write(dst);
+        dst->append(move(e));
+        dst->end_write();
+      }
+      // Lock-free readers may still be scanning the array, so keep it
+      if constexpr (LOCK_FREE_READS)
+        src->pairs.clear();
+      else
+        pairs_t().swap(src->pairs);
+      src->migrated = true;
+      src->end_write();
+    }
+    // The thread that finishes the last bucket retires the draining table
+    if (++t->drained == t->buckets.size()) {
+      lock_guard<mutex> g(resize_lock);
+      retired.push_back(t);
+      draining = nullptr;
+    }
+  }
+
+  /// Start a resize if the table is overloaded, or help an in-progress resize
+  /// by migrating a few buckets.  This must be called without holding any
+  /// bucket locks.
+  void maintain() {
+    table_t *d = draining.load();
+    if (d != nullptr) {
+      for (size_t s = 0; s < MIGRATE_STEP; ++s) {
+        size_t i = d->cursor++;
+        if (i >= d->buckets.size())
+          return;
+        migrate_bucket(d, i);
+      }
+      return;
+    }
+    table_t *t = active.load();
+    if (count.load(std::memory_order_relaxed) <= max_load * t->buckets.size())
+      return;
+    // Only one thread installs the new table; everyone else keeps going
+    std::unique_lock<std::mutex> g(resize_lock, std::try_to_lock);
+    if (!g || draining.load() != nullptr || active.load() != t)
+      return;
+    table_t *n = new table_t(t->buckets.size() * 2, snapping.load());
+    t->next = n;
+    draining = t;
+    active = n;
+  }
+
+  /// Lock every bucket that might hold data, in a deadlock-free order (the
+  /// draining table, then the active table, each in ascending order).  Since
+  /// every bucket of the draining table is locked, no migration can make
+  /// progress until unlock_all().
+  ///
+  /// @returns The tables whose buckets were locked: {draining, active}
+  std::pair<table_t *, table_t *> lock_all() {
+    for (;;) {
+      table_t *a = active.load();
+      table_t *d = draining.load();
+      if (d != nullptr) {
+        a = d->next.load();
+        for (auto b : d->buckets)
+          b->lock.lock();
+      }
+      for (auto b : a->buckets)
+        b->lock.lock();
+      // If a new resize started before we got all the locks, some pairs may
+      // already be in a table we don't hold, so try again
+      if (a->next.load() == nullptr)
+        return {d, a};
+      unlock_all({d, a});
+    }
+  }
+
+  /// Visit every bucket of a draining table and its successor, split into
+  /// contiguous ranges that are handled by separate threads.  The calling
+  /// thread handles the first range.
+  ///
+  /// @param d     The draining table, or nullptr
+  /// @param a     The active table
+  /// @param parts The number of ranges
+  /// @param visit The function to run on each bucket, given its range number
+  template <typename F>
+  static void scan_parallel(table_t *d, table_t *a, size_t parts, F &&visit) {
+    using namespace std;
+    vector<bucket_t *> all;
+    if (d != nullptr)
+      all.insert(all.end(), d->buckets.begin(), d->buckets.end());
+    all.insert(all.end(), a->buckets.begin(), a->buckets.end());
+    parts = max<size_t>(1, min(parts, all.size()));
+    auto run = [&](size_t p) {
+      size_t hi = all.size() * (p + 1) / parts;
+      for (size_t i = all.size() * p / parts; i < hi; ++i)
+        visit(p, all[i]);
+    };
+    vector<thread> workers;
+    for (size_t p = 1; p < parts; ++p)
+      workers.emplace_back(run, p);
+    run(0);
+    for (auto &w : workers)
+      w.join();
+  }
+
+  /// Lock every bucket that is responsible for one of a batch of keys.  The
+  /// buckets are locked in the same global order as lock_all() and
+  /// migrate_bucket() use (older tables first, and ascending indices within a
+  /// table), so batches can't deadlock with each other or with migrations.
+  ///
+  /// @param hashes The hashes of the keys in the batch
+  ///
+  /// @returns Each locked bucket, with the (ascending) indices of the keys
+  ///          that it holds
+  std::vector<std::pair<bucket_t *, std::vector<size_t>>>
+  lock_batch(const std::vector<size_t> &hashes) {
+    using namespace std;
+    vector<pair<bucket_t *, vector<size_t>>> locked;
+    vector<size_t> pending(hashes.size());
+    iota(pending.begin(), pending.end(), 0);
+    table_t *t = active.load();
+    table_t *d = draining.load();
+    if (d != nullptr)
+      t = d;
+    while (!pending.empty()) {
+      size_t n = t->buckets.size();
+      sort(pending.begin(), pending.end(), [&](size_t x, size_t y) {
+        return make_pair(hashes[x] % n, x) < make_pair(hashes[y] % n, y);
+      });
+      // Keys whose bucket here has migrated are retried in the next table
+      vector<size_t> later;
+      for (size_t i = 0, j; i < pending.size(); i = j) {
+        size_t idx = hashes[pending[i]] % n;
+        for (j = i + 1; j < pending.size() && hashes[pending[j]] % n == idx;)
+          ++j;
+        bucket_t *b = t->buckets[idx];
+        b->lock.lock();
+        if (b->migrated) {
+          b->lock.unlock();
+          later.insert(later.end(), pending.begin() + i, pending.begin() + j);
+        } else {
+          b->referenced = true;
+          locked.push_back({b, vector<size_t>(pending.begin() + i,
+                                              pending.begin() + j)});
+        }
+      }
+      pending.swap(later);
+      t = t->next.load();
+    }
+    return locked;
+  }
+
+  /// Find how many times the table had doubled when a table was created
+  ///
+  /// @param t The table
+  unsigned level_of(table_t *t) {
+    return __builtin_ctzll(t->buckets.size() / base_buckets);
+  }
+
+  /// Apply a function to the pairs of the bucket that a scan cursor names.  If
+  /// the bucket has migrated, its pairs are found in the two buckets it split
+  /// into.  Locks one bucket at a time.
+  ///
+  /// @param t      The table to start in
+  /// @param cursor The cursor of the bucket
+  /// @param f      The function to apply to each key/value pair
+  ///
+  /// @returns The number of pairs visited
+  template <typename F> size_t scan_bucket(table_t *t, uint64_t cursor, F &f) {
+    unsigned k = level_of(t);
+    bucket_t *b = t->buckets[scan_cursor_bucket(cursor, base_buckets, k)];
+    {
+      std::lock_guard<std::mutex> g(b->lock);
+      if (!b->migrated) {
+        for (const auto &e : b->pairs)
+          f(view_of(e.first), e.second);
+        return b->pairs.size();
+      }
+    }
+    table_t *n = t->next.load();
+    return scan_bucket(n, cursor, f) +
+           scan_bucket(n, scan_cursor_split(cursor, k), f);
+  }
+
+  /// Advance the clock hand over the bucket that a scan cursor names (or the
+  /// buckets it split into, if it has migrated).  A referenced bucket is
+  /// unmarked; an unreferenced one has all of its pairs evicted.
+  ///
+  /// @param t        The table to start in
+  /// @param cursor   The cursor of the bucket
+  /// @param on_evict The function to apply to each evicted key/value pair
+  ///
+  /// @returns The number of pairs evicted
+  template <typename F>
+  size_t evict_bucket(table_t *t, uint64_t cursor, F &on_evict) {
+    unsigned k = level_of(t);
+    bucket_t *b = t->buckets[scan_cursor_bucket(cursor, base_buckets, k)];
+    {
+      std::lock_guard<std::mutex> g(b->lock);
+      if (!b->migrated) {
+        if (b->referenced) {
+          b->referenced = false;
+          return 0;
+        }
+        size_t n = b->pairs.size();
+        if (n == 0)
+          return 0;
+        before_write(b);
+        std::vector<V> old;
+        for (auto &e : b->pairs) {
+          on_evict(view_of(e.first), e.second);
+          if constexpr (GUARDED)
+            old.push_back(std::move(e.second));
+        }
+        b->pairs.clear();
+        b->end_write();
+        for (auto &v : old)
+          retire(std::move(v));
+        count -= n;
+        return n;
+      }
+    }
+    table_t *n = t->next.load();
+    return evict_bucket(n, cursor, on_evict) +
+           evict_bucket(n, scan_cursor_split(cursor, k), on_evict);
+  }
+
+  /// Hash every key of a batch
+  ///
+  /// @param n      The number of keys
+  /// @param key_of A function that returns the key at an index
+  template <typename F>
+  static std::vector<size_t> hash_batch(size_t n, F &&key_of) {
+    std::vector<size_t> hashes(n);
+    for (size_t i = 0; i < n; ++i)
+      hashes[i] = hash_key(key_of(i));
+    return hashes;
+  }
+
+  /// Release the locks acquired by lock_all()
+  ///
+  /// @param tables The tables returned by lock_all()
+  void unlock_all(std::pair<table_t *, table_t *> tables) {
+    if (tables.first != nullptr)
+      for (auto b : tables.first->buckets)
+        b->lock.unlock();
+    for (auto b : tables.second->buckets)
+      b->lock.unlock();
+  }
 
 public:
   /// Construct a concurrent hash table by specifying the number of buckets it
   /// should have
   ///
-  /// @param _buckets The number of buckets in the concurrent hash table
-  ConcurrentHashTable(size_t _buckets) {}
+  /// @param _buckets  The initial number of buckets in the concurrent hash
+  ///                  table
+  /// @param _max_load The average bucket length at which the table grows
+  ConcurrentHashTable(size_t _buckets, size_t _max_load = 4)
+      : max_load(_max_load), base_buckets(_buckets ? _buckets : 1),
+        active(new table_t(base_buckets)) {}
+
+  /// Destruct the hash table, freeing the active table, the table being
+  /// drained (if any), and any drained tables
+  ~ConcurrentHashTable() {
+    delete draining.load();
+    delete active.load();
+    for (auto t : retired)
+      delete t;
+  }
+
+  /// Report the number of buckets in the active table
+  size_t bucket_count() { return active.load()->buckets.size(); }
+
+  /// Report the number of key/value pairs in the table
+  size_t size() { return count.load(); }
+
+  /// Report the memory held by replaced and removed values that a lock-free
+  /// reader might still be copying.  Only GUARDED tables hold any.
+  ///
+  /// @param size A function that reports the memory of a value
+  template <typename F> size_t retained(F &&size) {
+    size_t n = 0;
+    if constexpr (GUARDED) {
+      if (limbo_size.load() == 0)
+        return 0;
+      std::lock_guard<std::mutex> g(limbo_lock);
+      for (const auto &x : limbo)
+        n += size(x.second);
+    }
+    return n;
+  }
 
   /// Clear the Concurrent Hash Table.  This operation needs to use 2pl
   void clear() {
-    using namespace std;
-    lock_guard<mutex> g(lock);
-    pairs.clear();
+    /// We'll use "strict" 2pl... first we acquire all locks, then we do all
+    /// operations, then we release all locks.
+    auto tables = lock_all();
+    auto empty = [&](bucket_t *b) {
+      before_write(b);
+      std::vector<V> old;
+      if constexpr (GUARDED)
+        for (auto &e : b->pairs)
+          old.push_back(std::move(e.second));
+      b->pairs.clear();
+      b->end_write();
+      for (auto &v : old)
+        retire(std::move(v));
+    };
+    if (tables.first != nullptr)
+      for (auto b : tables.first->buckets)
+        empty(b);
+    for (auto b : tables.second->buckets)
+      empty(b);
+    count = 0;
+    unlock_all(tables);
   }
 
   /// Insert the provided key/value pair only if there is no mapping for the key
-  /// yet.
+  /// yet.  The value is moved into the bucket, so a caller that has no more
+  /// use for it can pass it with std::move, and it is never copied.
   ///
   /// @param key        The key to insert
   /// @param val        The value to insert
@@ -51,21 +892,30 @@ public:
   ///
   /// @returns true if the key/value was inserted, false if the key already
   ///          existed in the table
-  bool insert(K key, V val, std::function<void()> on_success) {
+  template <typename F>
+  bool insert(key_view_t key, V val, F &&on_success) {
     using namespace std;
-    lock_guard<mutex> g(lock);
-    for (const auto &e : pairs) {
-      if (e.first == key)
-        return false;
+    {
+      size_t h = hash_key(key);
+      bucket_t *b = lock_bucket(h);
+      lock_guard<mutex> g(b->lock, adopt_lock);
+      for (const auto &e : b->pairs) {
+        if (key_matches(e.first, h, key))
+          return false;
+      }
+      before_write(b);
+      b->append({make_key(key, h), std::move(val)});
+      b->end_write();
+      ++count;
+      on_success();
     }
-    pairs.push_back({key, val});
-    on_success();
+    maintain();
     return true;
   }
 
   /// Insert the provided key/value pair if there is no mapping for the key yet.
   /// If there is a key, then update the mapping by replacing the old value with
-  /// the provided value
+  /// the provided value.  As with insert(), the value is moved into the bucket.
   ///
   /// @param key    The key to upsert
   /// @param val    The value to upsert
@@ -74,20 +924,36 @@ public:
   ///
   /// @returns true if the key/value was inserted, false if the key already
   ///          existed in the table and was thus updated instead
-  bool upsert(K key, V val, std::function<void()> on_ins,
-              std::function<void()> on_upd) {
+  template <typename FI, typename FU>
+  bool upsert(key_view_t key, V val, FI &&on_ins, FU &&on_upd) {
     using namespace std;
-    lock_guard<mutex> g(lock);
-    for (auto &e : pairs) {
-      if (e.first == key) {
-        e.second = val;
-        on_upd();
-        return false;
+    bool inserted = true;
+    {
+      size_t h = hash_key(key);
+      bucket_t *b = lock_bucket(h);
+      lock_guard<mutex> g(b->lock, adopt_lock);
+      for (auto &e : b->pairs) {
+        if (key_matches(e.first, h, key)) {
+          before_write(b);
+          V old = std::move(e.second);
+          e.second = std::move(val);
+          b->end_write();
+          notify(on_upd, old);
+          retire(std::move(old));
+          inserted = false;
+          break;
+        }
+      }
+      if (inserted) {
+        before_write(b);
+        b->append({make_key(key, h), std::move(val)});
+        b->end_write();
+        ++count;
+        on_ins();
       }
     }
-    pairs.push_back({key, val});
-    on_ins();
-    return true;
+    maintain();
+    return inserted;
   }
 
   /// Apply a function to the value associated with a given key.  The function
@@ -98,36 +964,89 @@ public:
   ///
   /// @returns true if the key existed and the function was applied, false
   ///          otherwise
-  bool do_with(K key, std::function<void(V &)> f) {
+  template <typename F> bool do_with(key_view_t key, F &&f) {
     using namespace std;
-    lock_guard<mutex> g(lock);
-    for (auto &e : pairs) {
-      if (e.first == key) {
-        f(e.second);
-        return true;
+    bool found = false;
+    {
+      size_t h = hash_key(key);
+      bucket_t *b = lock_bucket(h);
+      lock_guard<mutex> g(b->lock, adopt_lock);
+      for (auto &e : b->pairs) {
+        if (key_matches(e.first, h, key)) {
+          before_write(b);
+          if constexpr (GUARDED) {
+            // f may replace what the value refers to, so keep the old value
+            V old = e.second;
+            f(e.second);
+            b->end_write();
+            retire(std::move(old));
+          } else {
+            f(e.second);
+            b->end_write();
+          }
+          found = true;
+          break;
+        }
       }
     }
-    return false;
+    maintain();
+    return found;
   }
 
   /// Apply a function to the value associated with a given key.  The function
   /// is not allowed to modify the value.
   ///
+  /// NB: For OPTIMISTIC and GUARDED tables, f usually runs on a copy of the
+  ///     value, without holding the bucket's lock.
+  ///
   /// @param key The key whose value will be modified
   /// @param f   The function to apply to the key's value
   ///
   /// @returns true if the key existed and the function was applied, false
   ///          otherwise
-  bool do_with_readonly(K key, std::function<void(const V &)> f) {
+  template <typename F> bool do_with_readonly(key_view_t key, F &&f) {
     using namespace std;
-    lock_guard<mutex> g(lock);
-    for (const auto &e : pairs) {
-      if (e.first == key) {
-        f(e.second);
-        return true;
+    bool found = false;
+    if constexpr (OPTIMISTIC) {
+      V val;
+      for (size_t i = 0; i < OPTIMISTIC_TRIES; ++i) {
+        if (read_optimistic(key, found, val)) {
+          if (found)
+            f(val);
+          maintain();
+          return found;
+        }
+      }
+    } else if constexpr (GUARDED) {
+      if (key.size() <= inline_key::INLINE) {
+        V val;
+        for (size_t i = 0; i < OPTIMISTIC_TRIES; ++i) {
+          bool ok = read_shared(key, found, val);
+          // Once this reader has left its epoch, limbo may be reclaimable
+          reclaim(false);
+          if (ok) {
+            if (found)
+              f(val);
+            maintain();
+            return found;
+          }
+        }
+      }
+    }
+    {
+      size_t h = hash_key(key);
+      bucket_t *b = lock_bucket(h);
+      lock_guard<mutex> g(b->lock, adopt_lock);
+      for (const auto &e : b->pairs) {
+        if (key_matches(e.first, h, key)) {
+          f(e.second);
+          found = true;
+          break;
+        }
       }
     }
-    return false;
+    maintain();
+    return found;
   }
 
   /// Remove the mapping from a key to its value
@@ -136,17 +1055,184 @@ public:
   /// @param on_success Code to run if the remove succeeds
   ///
   /// @returns true if the key was found and the value unmapped, false otherwise
-  bool remove(K key, std::function<void()> on_success) {
+  template <typename F> bool remove(key_view_t key, F &&on_success) {
+    return remove_if(key, [](const V &) { return true; },
+                     std::forward<F>(on_success));
+  }
+
+  /// Remove the mapping from a key to its value, if the value satisfies a
+  /// predicate.  The predicate runs while the key's bucket is locked, so the
+  /// value cannot change between the check and the removal.
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param pred       The predicate that the value must satisfy
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @returns true if the key was found and the value unmapped, false otherwise
+  template <typename P, typename F>
+  bool remove_if(key_view_t key, P &&pred, F &&on_success) {
     using namespace std;
-    lock_guard<mutex> g(lock);
-    for (auto i = pairs.begin(), e = pairs.end(); i != e; ++i) {
-      if (i->first == key) {
-        pairs.erase(i);
-        on_success();
-        return true;
+    bool found = false;
+    {
+      size_t h = hash_key(key);
+      bucket_t *b = lock_bucket(h);
+      lock_guard<mutex> g(b->lock, adopt_lock);
+      for (auto i = b->pairs.begin(), e = b->pairs.end(); i != e; ++i) {
+        if (key_matches(i->first, h, key)) {
+          if (!pred(static_cast<const V &>(i->second)))
+            break;
+          before_write(b);
+          V old = std::move(i->second);
+          b->pairs.erase(i);
+          b->end_write();
+          --count;
+          notify(on_success, old);
+          retire(std::move(old));
+          found = true;
+          break;
+        }
+      }
+    }
+    maintain();
+    return found;
+  }
+
+  /// Look up a batch of keys.  Each bucket that holds one of the keys is
+  /// locked once, and all of the bucket's keys are found in one pass.  Every
+  /// bucket stays locked until the whole batch is done, so the results are a
+  /// consistent view of the keys.
+  ///
+  /// @param keys The keys to find
+  /// @param f    The function to apply to each value that is found.  Its
+  ///             first argument is the key's index in keys.  It is not
+  ///             allowed to modify the value.
+  ///
+  /// @returns The number of keys that were found
+  template <typename F>
+  size_t multi_get(const std::vector<key_arg_t> &keys, F &&f) {
+    size_t found = 0;
+    auto hashes =
+        hash_batch(keys.size(), [&](size_t i) -> key_view_t { return keys[i]; });
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      for (size_t i : l.second) {
+        for (const auto &e : l.first->pairs) {
+          if (key_matches(e.first, hashes[i], keys[i])) {
+            f(i, e.second);
+            ++found;
+            break;
+          }
+        }
       }
     }
-    return false;
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    maintain();
+    return found;
+  }
+
+  /// Insert or update a batch of key/value pairs.  Each bucket is locked once,
+  /// and all of its pairs are written in one pass.  If a key appears more than
+  /// once, its pairs are applied in the order they appear in items.
+  ///
+  /// @param items  The pairs to upsert
+  /// @param on_ins Code to run for each pair that is inserted, given its index
+  /// @param on_upd Code to run for each pair that is an update, given its index
+  /// @param then   Code to run when the batch is done, but before unlocking
+  ///
+  /// @returns The number of pairs that were inserted
+  template <typename FI, typename FU, typename T>
+  size_t multi_upsert(std::vector<std::pair<key_arg_t, V>> items, FI &&on_ins,
+                      FU &&on_upd, T &&then) {
+    size_t inserted = 0;
+    auto hashes = hash_batch(
+        items.size(), [&](size_t i) -> key_view_t { return items[i].first; });
+    std::shared_lock<std::shared_mutex> gate(migrate_gate);
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      bucket_t *b = l.first;
+      std::vector<V> replaced;
+      before_write(b);
+      for (size_t i : l.second) {
+        bool found = false;
+        for (auto &e : b->pairs) {
+          if (key_matches(e.first, hashes[i], items[i].first)) {
+            V old = std::move(e.second);
+            e.second = std::move(items[i].second);
+            notify(on_upd, old, i);
+            if constexpr (GUARDED)
+              replaced.push_back(std::move(old));
+            found = true;
+            break;
+          }
+        }
+        if (!found) {
+          b->append(
+              {make_key(items[i].first, hashes[i]), std::move(items[i].second)});
+          ++count;
+          ++inserted;
+          on_ins(i);
+        }
+      }
+      b->end_write();
+      for (auto &v : replaced)
+        retire(std::move(v));
+    }
+    then();
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    gate.unlock();
+    for (size_t i = 0; i < inserted; ++i)
+      maintain();
+    return inserted;
+  }
+
+  /// Remove a batch of keys.  Each bucket is locked once, and all of its keys
+  /// are removed in one pass.
+  ///
+  /// @param keys       The keys to remove
+  /// @param on_success Code to run for each key that is removed, given its
+  ///                   index
+  /// @param then       Code to run when the batch is done, but before
+  ///                   unlocking
+  ///
+  /// @returns The number of keys that were removed
+  template <typename F, typename T>
+  size_t multi_remove(const std::vector<key_arg_t> &keys, F &&on_success,
+                      T &&then) {
+    size_t removed = 0;
+    auto hashes =
+        hash_batch(keys.size(), [&](size_t i) -> key_view_t { return keys[i]; });
+    std::shared_lock<std::shared_mutex> gate(migrate_gate);
+    auto locked = lock_batch(hashes);
+    for (auto &l : locked) {
+      bucket_t *b = l.first;
+      std::vector<V> gone;
+      before_write(b);
+      for (size_t i : l.second) {
+        for (auto j = b->pairs.begin(), e = b->pairs.end(); j != e; ++j) {
+          if (key_matches(j->first, hashes[i], keys[i])) {
+            V old = std::move(j->second);
+            b->pairs.erase(j);
+            --count;
+            ++removed;
+            notify(on_success, old, i);
+            if constexpr (GUARDED)
+              gone.push_back(std::move(old));
+            break;
+          }
+        }
+      }
+      b->end_write();
+      for (auto &v : gone)
+        retire(std::move(v));
+    }
+    then();
+    for (auto &l : locked)
+      l.first->lock.unlock();
+    gate.unlock();
+    maintain();
+    return removed;
   }
 
   /// Apply a function to every key/value pair in the ConcurrentHashTable.  Note
@@ -155,14 +1241,254 @@ public:
   /// @param f    The function to apply to each key/value pair
   /// @param then A function to run when this is done, but before unlocking...
   ///             useful for 2pl
-  void do_all_readonly(std::function<void(const K, const V &)> f,
-                       std::function<void()> then) {
-    lock.lock();
-    for (const auto &e : pairs) {
-      f(e.first, e.second);
+  template <typename F, typename T> void do_all_readonly(F &&f, T &&then) {
+    /// We'll use "strict" 2pl... first we acquire all locks, then we do all
+    /// operations, then we release all locks.
+    auto tables = lock_all();
+    if (tables.first != nullptr) {
+      for (auto b : tables.first->buckets) {
+        // Migrated buckets are empty; their pairs are in the active table
+        for (const auto &e : b->pairs) {
+          f(view_of(e.first), e.second);
+        }
+      }
+    }
+    for (auto b : tables.second->buckets) {
+      for (const auto &e : b->pairs) {
+        f(view_of(e.first), e.second);
+      }
     }
     // Before releasing locks, run the 'then'
     then();
-    lock.unlock();
+    unlock_all(tables);
+  }
+
+  /// Apply a function to every key/value pair in a snapshot of the
+  /// ConcurrentHashTable, taken when the call starts.  Unlike do_all_readonly(),
+  /// this holds at most one bucket lock at a time, so writers keep running
+  /// while the snapshot is scanned.  Only one snapshot runs at a time.
+  ///
+  /// @param f The function to apply to each key/value pair
+  template <typename F> void snapshot_readonly(F &&f) {
+    snapshot_parallel(
+        1, [&](size_t, key_view_t k, const V &v) { f(k, v); }, []() {});
+  }
+
+  /// Apply a function to every key/value pair in the ConcurrentHashTable,
+  /// using several threads.  The buckets are split into contiguous ranges
+  /// ("partitions"), and each partition is scanned by its own thread, so f
+  /// must be safe to call concurrently for different partitions.  As with
+  /// do_all_readonly(), the scan holds every lock, until after 'then' runs.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair.  Its first
+  ///              argument is the partition number, in [0, parts).
+  /// @param then  A function to run when all partitions are done, but before
+  ///              unlocking... useful for merging per-partition results
+  template <typename F, typename T>
+  void do_all_readonly(size_t parts, F &&f, T &&then) {
+    auto tables = lock_all();
+    scan_parallel(tables.first, tables.second, parts,
+                  [&](size_t p, bucket_t *b) {
+                    for (const auto &e : b->pairs)
+                      f(p, view_of(e.first), e.second);
+                  });
+    then();
+    unlock_all(tables);
+  }
+
+  /// Apply a function to every key/value pair in a snapshot of the
+  /// ConcurrentHashTable (see snapshot_readonly()), using several threads.
+  /// Each partition is scanned by its own thread, so f must be safe to call
+  /// concurrently for different partitions.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair.  Its first
+  ///              argument is the partition number, in [0, parts).
+  /// @param merge A function to run once every partition is done
+  template <typename F, typename M>
+  void snapshot_parallel(size_t parts, F &&f, M &&merge) {
+    snapshot_parallel(parts, std::forward<F>(f), std::forward<M>(merge),
+                      nullptr);
+  }
+
+  /// A version of snapshot_parallel() that runs a function at the snapshot's
+  /// point in time.  'start' runs while every bucket is locked, so no write
+  /// is in progress: every write that finished before it is in the snapshot,
+  /// and no write that starts after it is.  The pause lasts as long as it
+  /// takes to lock every bucket, not as long as the scan.  Without 'start',
+  /// the snapshot is taken without locking buckets, but never while a
+  /// multi-key write is between its first and last bucket, so a batch is
+  /// either entirely in the snapshot or not at all.
+  ///
+  /// @param parts The number of partitions (and threads) to use
+  /// @param f     The function to apply to each key/value pair
+  /// @param merge A function to run once every partition is done
+  /// @param start A function to run when the snapshot is taken, or nullptr
+  template <typename F, typename M, typename S>
+  void snapshot_parallel(size_t parts, F &&f, M &&merge, S &&start) {
+    using namespace std;
+    {
+      lock_guard<mutex> s(snap_lock);
+      table_t *d, *a;
+      uint64_t e;
+      {
+        // Resizes can't start or finish, and no bucket can be half-migrated,
+        // while we pick the snapshot's tables
+        lock_guard<mutex> g(resize_lock);
+        lock_guard<shared_mutex> m(migrate_gate);
+        e = ++last_epoch;
+        if constexpr (is_null_pointer<decay_t<S>>::value) {
+          snapping = e;
+        } else {
+          // No resize can start, so this locks every bucket on the first try
+          auto tables = lock_all();
+          snapping = e;
+          start();
+          unlock_all(tables);
+        }
+        a = active.load();
+        d = draining.load();
+      }
+      scan_parallel(d, a, parts, [&](size_t p, bucket_t *b) {
+        pairs_t frozen;
+        {
+          lock_guard<mutex> g(b->lock);
+          if (b->cow_epoch != e) {
+            // Unchanged since the snapshot started, so read it in place
+            b->cow_epoch = e;
+            pairs_t().swap(b->saved);
+            for (const auto &x : b->pairs)
+              f(p, view_of(x.first), x.second);
+            return;
+          }
+          frozen.swap(b->saved);
+        }
+        for (const auto &x : frozen)
+          f(p, view_of(x.first), x.second);
+      });
+      snapping = 0;
+    }
+    merge();
+  }
+
+  /// Visit one page of a scan of the ConcurrentHashTable.  A scan starts with a
+  /// cursor of 0, and each call returns the cursor for the next page.  Pages
+  /// end on bucket boundaries, and only one bucket is locked at a time.  Every
+  /// key that is in the table for the whole scan is visited exactly once, even
+  /// if the table grows between pages (see scan_cursor.h).  Keys that are
+  /// inserted or removed during the scan may or may not be visited.
+  ///
+  /// @param cursor The cursor returned by the previous page, or 0
+  /// @param limit  The number of pairs after which the page ends.  A page
+  ///               always includes at least one bucket, and includes the whole
+  ///               bucket that reaches the limit.
+  /// @param f      The function to apply to each key/value pair
+  ///
+  /// @returns The cursor for the next page, or 0 if the scan is done
+  template <typename F>
+  uint64_t scan_page(uint64_t cursor, size_t limit, F &&f) {
+    size_t seen = 0;
+    do {
+      table_t *t = active.load();
+      table_t *d = draining.load();
+      if (d != nullptr)
+        t = d;
+      // A stale read may give a table coarser than the one that produced the
+      // cursor; start at the table whose buckets the cursor is aligned with.
+      // A cursor that no table is aligned with ends the scan.
+      while (cursor & ((uint64_t(1) << (32 - level_of(t))) - 1)) {
+        t = t->next.load();
+        if (t == nullptr)
+          return 0;
+      }
+      unsigned k = level_of(t);
+      seen += scan_bucket(t, cursor, f);
+      cursor = scan_cursor_next(cursor, base_buckets, k);
+    } while (cursor != 0 && seen < limit);
+    return cursor;
+  }
+
+  /// Check if a scan cursor from a client could have come from scan_page()
+  ///
+  /// @param cursor The cursor
+  ///
+  /// @returns true if scan_page() can resume from the cursor
+  bool valid_cursor(uint64_t cursor) {
+    return scan_cursor_valid(cursor, base_buckets, level_of(active.load()));
+  }
+
+  /// Evict cold pairs, using the CLOCK algorithm at bucket granularity (see
+  /// above).  The hand moves one bucket at a time, and only that bucket is
+  /// locked.  Only one evict() runs at a time.
+  ///
+  /// @param target   The number of pairs to evict.  More may be evicted, since
+  ///                 a cold bucket is emptied all at once, and fewer may be if
+  ///                 two revolutions of the hand do not find enough.
+  /// @param on_evict Code to run for each evicted pair, given its key and
+  ///                 value, while its bucket is locked
+  ///
+  /// @returns The number of pairs evicted
+  template <typename F> size_t evict(size_t target, F &&on_evict) {
+    std::lock_guard<std::mutex> g(evict_lock);
+    size_t evicted = 0;
+    for (size_t steps = 2 * bucket_count(); evicted < target && steps > 0;
+         --steps) {
+      table_t *t = active.load();
+      table_t *d = draining.load();
+      if (d != nullptr)
+        t = d;
+      while (clock_hand & ((uint64_t(1) << (32 - level_of(t))) - 1))
+        t = t->next.load();
+      unsigned k = level_of(t);
+      evicted += evict_bucket(t, clock_hand, on_evict);
+      // The cursor wraps to 0, which is the first bucket
+      clock_hand = scan_cursor_next(clock_hand, base_buckets, k);
+    }
+    return evicted;
+  }
+
+  /// The methods above take their callbacks as template parameters, so that
+  /// the compiler can inline them.  The overloads below accept std::function
+  /// callbacks, for callers that already have one, and forward to the
+  /// templates.
+
+  /// A version of insert() that takes a std::function
+  bool insert(key_view_t key, V val, std::function<void()> on_success) {
+    return insert<std::function<void()> &>(key, std::move(val), on_success);
+  }
+
+  /// A version of upsert() that takes std::functions
+  bool upsert(key_view_t key, V val, std::function<void()> on_ins,
+              std::function<void()> on_upd) {
+    return upsert<std::function<void()> &, std::function<void()> &>(
+        key, std::move(val), on_ins, on_upd);
+  }
+
+  /// A version of do_with() that takes a std::function
+  bool do_with(key_view_t key, std::function<void(V &)> f) {
+    return do_with<std::function<void(V &)> &>(key, f);
+  }
+
+  /// A version of do_with_readonly() that takes a std::function
+  bool do_with_readonly(key_view_t key, std::function<void(const V &)> f) {
+    return do_with_readonly<std::function<void(const V &)> &>(key, f);
+  }
+
+  /// A version of remove() that takes a std::function
+  bool remove(key_view_t key, std::function<void()> on_success) {
+    return remove<std::function<void()> &>(key, on_success);
+  }
+
+  /// A version of do_all_readonly() that takes std::functions
+  void do_all_readonly(std::function<void(key_view_t, const V &)> f,
+                       std::function<void()> then) {
+    do_all_readonly<std::function<void(key_view_t, const V &)> &,
+                    std::function<void()> &>(f, then);
+  }
+
+  /// A version of snapshot_readonly() that takes a std::function
+  void snapshot_readonly(std::function<void(key_view_t, const V &)> f) {
+    snapshot_readonly<std::function<void(key_view_t, const V &)> &>(f);
   }
-};
\ No newline at end of file
+};
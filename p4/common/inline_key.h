@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "slab.h"
+
+/// inline_key is how a hash table entry stores a std::string key.  Alongside
+/// the key, it keeps the key's full hash and its length, and keys of up to
+/// INLINE bytes are stored in the entry itself.  Longer keys spill to memory
+/// from the slab allocator.
+///
+/// A search compares the cached hash and the length first, so an entry that
+/// does not match is almost always rejected without reading any key bytes,
+/// and a short key that does match is compared without following a pointer.
+///
+/// INLINE is chosen so that an inline_key is 32 bytes, the same as a
+/// std::string, whose own inline buffer holds only 15 bytes.  A larger buffer
+/// made every entry larger, and cost more memory than spilling the few keys
+/// that did not fit.
+class inline_key {
+public:
+  /// The longest key that is stored inline
+  static const size_t INLINE = 20;
+
+private:
+  /// The full hash of the key
+  size_t h;
+
+  /// The length of the key
+  uint32_t len;
+
+  /// The key's bytes if it is short, or a pointer to them if it is long.  The
+  /// pointer is not aligned, so it is read and written with memcpy.
+  char bytes[INLINE];
+
+  /// Get the pointer to a long key's bytes
+  char *heap() const {
+    char *p;
+    memcpy(&p, bytes, sizeof(p));
+    return p;
+  }
+
+  /// Set the pointer to a long key's bytes
+  ///
+  /// @param p The pointer
+  void set_heap(char *p) { memcpy(bytes, &p, sizeof(p)); }
+
+  /// Copy a key into this (uninitialized) object
+  ///
+  /// @param key  The key
+  /// @param hash The key's hash
+  void assign(std::string_view key, size_t hash) {
+    h = hash;
+    len = uint32_t(key.size());
+    if (len <= INLINE) {
+      memcpy(bytes, key.data(), len);
+    } else {
+      char *p = static_cast<char *>(slab_pool::allocate(len));
+      memcpy(p, key.data(), len);
+      set_heap(p);
+    }
+  }
+
+  /// Free a long key's bytes
+  void release() {
+    if (len > INLINE)
+      slab_pool::deallocate(heap(), len);
+  }
+
+public:
+  /// Construct an inline_key
+  ///
+  /// @param key  The key
+  /// @param hash The key's hash (as computed by the table that stores it)
+  inline_key(std::string_view key, size_t hash) { assign(key, hash); }
+
+  /// Copy an inline_key
+  inline_key(const inline_key &o) { assign(o, o.h); }
+
+  /// Move an inline_key, taking its bytes if they are not inline
+  inline_key(inline_key &&o) noexcept : h(o.h), len(o.len) {
+    memcpy(bytes, o.bytes, len <= INLINE ? len : sizeof(char *));
+    if (len > INLINE)
+      o.len = 0;
+  }
+
+  /// Copy-assign an inline_key
+  inline_key &operator=(const inline_key &o) {
+    if (this != &o) {
+      release();
+      assign(o, o.h);
+    }
+    return *this;
+  }
+
+  /// Move-assign an inline_key
+  inline_key &operator=(inline_key &&o) noexcept {
+    if (this != &o) {
+      release();
+      new (this) inline_key(std::move(o));
+    }
+    return *this;
+  }
+
+  /// Destruct an inline_key
+  ~inline_key() { release(); }
+
+  /// Report the cached hash of the key
+  size_t hash() const { return h; }
+
+  /// Report the length of the key
+  size_t size() const { return len; }
+
+  /// Get the bytes of the key
+  const char *data() const { return len <= INLINE ? bytes : heap(); }
+
+  /// View the key as a string_view
+  operator std::string_view() const { return std::string_view(data(), len); }
+
+  /// Check if this is a given key.  The hash and the length are compared
+  /// before the bytes.
+  ///
+  /// @param hash The hash of the key
+  /// @param key  The key
+  bool matches(size_t hash, std::string_view key) const {
+    return h == hash && len == key.size() &&
+           memcmp(data(), key.data(), len) == 0;
+  }
+};
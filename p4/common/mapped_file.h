@@ -0,0 +1,71 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// mapped_file maps a whole file into memory, read-only, for as long as it
+/// lives.  Pages are read on demand (and ahead of time, as a hint to the
+/// kernel), so a large file can be parsed in place, by many threads, without
+/// first being copied into one buffer.
+class mapped_file {
+  /// The mapped bytes, or nullptr
+  const unsigned char *bytes = nullptr;
+
+  /// The number of mapped bytes
+  size_t len = 0;
+
+  /// Did the file open?
+  bool opened = false;
+
+  /// Did mapping a non-empty file fail?
+  bool failed = false;
+
+public:
+  /// Map a file
+  ///
+  /// @param path The name of the file
+  explicit mapped_file(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    opened = true;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      failed = true;
+    } else if (st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        failed = true;
+      } else {
+        bytes = static_cast<const unsigned char *>(p);
+        len = st.st_size;
+        madvise(p, len, MADV_WILLNEED);
+      }
+    }
+    ::close(fd);
+  }
+
+  /// Unmap the file
+  ~mapped_file() {
+    if (bytes != nullptr)
+      munmap(const_cast<unsigned char *>(bytes), len);
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  /// Report if the file exists (that is, if it could be opened)
+  bool exists() const { return opened; }
+
+  /// Report if the file exists, but could not be mapped
+  bool error() const { return failed; }
+
+  /// Get the file's bytes
+  const unsigned char *data() const { return bytes; }
+
+  /// Get the number of bytes in the file
+  size_t size() const { return len; }
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// OrderedIndex is a concurrent, ordered set of string keys.  It is kept
+/// alongside a hash table, so that the table's keys can be listed by prefix or
+/// by range without scanning the whole table.
+///
+/// The index is a skiplist.  Readers never lock: every link is an atomic
+/// pointer, and a node is fully built before it is linked in.  Writers are
+/// serialized by a single mutex, which is cheap compared to the hash table
+/// operations (and log writes) that accompany each index update.
+///
+/// A removed node is unlinked right away, but a reader may still be standing
+/// on it, so it is not freed until there are no readers.  Readers announce
+/// themselves in a counter; when the last one leaves, it frees the nodes that
+/// were removed before it checked that the counter was zero.
+class OrderedIndex {
+  /// The maximum number of levels in the skiplist
+  static const int MAX_HEIGHT = 20;
+
+  /// A node_t is one key, with its links at each of its levels
+  struct node_t {
+    /// The key
+    const std::string key;
+
+    /// The number of levels in which this node is linked
+    const int height;
+
+    /// The next node at each level
+    std::unique_ptr<std::atomic<node_t *>[]> next;
+
+    /// Construct an unlinked node
+    ///
+    /// @param k The key
+    /// @param h The number of levels
+    node_t(std::string_view k, int h)
+        : key(k), height(h), next(new std::atomic<node_t *>[h]) {
+      for (int i = 0; i < h; ++i)
+        next[i] = nullptr;
+    }
+  };
+
+  /// The sentinel node before the first key, linked at every level
+  node_t head{"", MAX_HEIGHT};
+
+  /// A lock that serializes writers
+  std::mutex write_lock;
+
+  /// The state of the random number generator for node heights.  Only used
+  /// while holding write_lock.
+  uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+  /// The number of readers traversing the skiplist
+  std::atomic<size_t> readers{0};
+
+  /// Removed nodes that a reader might still be using
+  std::vector<node_t *> limbo;
+
+  /// A lock for limbo
+  std::mutex limbo_lock;
+
+  /// The number of keys in the index
+  std::atomic<size_t> count{0};
+
+  /// Choose the height of a new node: each level is used by a quarter of the
+  /// nodes of the level below it
+  int random_height() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    int h = 1;
+    for (uint64_t r = rng; h < MAX_HEIGHT && (r & 3) == 0; r >>= 2)
+      ++h;
+    return h;
+  }
+
+  /// Find the last node at each level whose key is less than a key.  Only
+  /// valid for writers.
+  ///
+  /// @param key   The key to search for
+  /// @param preds Set to the predecessor at each level
+  ///
+  /// @returns The first node whose key is not less than key, or nullptr
+  node_t *find(std::string_view key, node_t **preds) {
+    node_t *x = &head;
+    node_t *n = nullptr;
+    for (int i = MAX_HEIGHT - 1; i >= 0; --i) {
+      while ((n = x->next[i].load()) != nullptr && n->key < key)
+        x = n;
+      preds[i] = x;
+    }
+    return n;
+  }
+
+  /// Free the removed nodes, if no reader can still see them
+  void reclaim() {
+    std::vector<node_t *> dead;
+    {
+      std::unique_lock<std::mutex> g(limbo_lock, std::try_to_lock);
+      if (!g || limbo.empty())
+        return;
+      dead.swap(limbo);
+    }
+    // Everything in dead was unlinked before we took it, so only readers that
+    // are active now could be using it
+    if (readers.load() != 0) {
+      std::lock_guard<std::mutex> g(limbo_lock);
+      limbo.insert(limbo.end(), dead.begin(), dead.end());
+      return;
+    }
+    for (auto n : dead)
+      delete n;
+  }
+
+public:
+  /// Compute the smallest string that is greater than every string that
+  /// starts with a prefix
+  ///
+  /// @param prefix The prefix
+  ///
+  /// @returns The bound, or "" if there is none (the prefix is all 0xFF)
+  static std::string prefix_end(std::string_view prefix) {
+    std::string end(prefix);
+    while (!end.empty() && (unsigned char)end.back() == 0xFF)
+      end.pop_back();
+    if (!end.empty())
+      end.back() = char((unsigned char)end.back() + 1);
+    return end;
+  }
+
+  /// Construct an empty index
+  OrderedIndex() = default;
+
+  /// Destruct the index, freeing every node
+  ~OrderedIndex() {
+    for (node_t *n = head.next[0].load(); n != nullptr;) {
+      node_t *next = n->next[0].load();
+      delete n;
+      n = next;
+    }
+    for (auto n : limbo)
+      delete n;
+  }
+
+  /// Report the number of keys in the index
+  size_t size() { return count.load(); }
+
+  /// Add a key to the index
+  ///
+  /// @param key The key to add
+  ///
+  /// @returns true if the key was added, false if it was already present
+  bool insert(std::string_view key) {
+    std::lock_guard<std::mutex> g(write_lock);
+    node_t *preds[MAX_HEIGHT];
+    node_t *n = find(key, preds);
+    if (n != nullptr && n->key == key)
+      return false;
+    node_t *x = new node_t(key, random_height());
+    // Link bottom-up, so that a reader who finds x at some level will also
+    // find it at every level below
+    for (int i = 0; i < x->height; ++i) {
+      x->next[i].store(preds[i]->next[i].load());
+      preds[i]->next[i].store(x);
+    }
+    ++count;
+    return true;
+  }
+
+  /// Remove a key from the index
+  ///
+  /// @param key The key to remove
+  ///
+  /// @returns true if the key was removed, false if it was not present
+  bool remove(std::string_view key) {
+    {
+      std::lock_guard<std::mutex> g(write_lock);
+      node_t *preds[MAX_HEIGHT];
+      node_t *x = find(key, preds);
+      if (x == nullptr || x->key != key)
+        return false;
+      // Unlink top-down, the reverse of insert().  x's own links are left
+      // alone, so a reader standing on x can keep going.
+      for (int i = x->height - 1; i >= 0; --i)
+        preds[i]->next[i].store(x->next[i].load());
+      --count;
+      std::lock_guard<std::mutex> l(limbo_lock);
+      limbo.push_back(x);
+    }
+    if (readers.load() == 0)
+      reclaim();
+    return true;
+  }
+
+  /// Remove every key from the index.  This must not run concurrently with
+  /// any other operation.
+  void clear() {
+    for (node_t *n = head.next[0].load(); n != nullptr;) {
+      node_t *next = n->next[0].load();
+      delete n;
+      n = next;
+    }
+    for (int i = 0; i < MAX_HEIGHT; ++i)
+      head.next[i] = nullptr;
+    for (auto n : limbo)
+      delete n;
+    limbo.clear();
+    count = 0;
+  }
+
+  /// Apply a function to the keys in a range, in ascending order, without
+  /// locking.  Keys that are added or removed during the scan may or may not
+  /// be seen.
+  ///
+  /// @param from  The smallest key to visit
+  /// @param to    The key at which to stop (exclusive), or "" for no bound
+  /// @param limit The maximum number of keys to visit
+  /// @param f     The function to apply to each key
+  ///
+  /// @returns The number of keys visited
+  template <typename F>
+  size_t range(std::string_view from, std::string_view to, size_t limit,
+               F &&f) {
+    readers.fetch_add(1);
+    node_t *x = &head;
+    for (int i = MAX_HEIGHT - 1; i >= 0; --i) {
+      node_t *n;
+      while ((n = x->next[i].load()) != nullptr && n->key < from)
+        x = n;
+    }
+    size_t seen = 0;
+    for (x = x->next[0].load(); x != nullptr && seen < limit;
+         x = x->next[0].load()) {
+      if (!to.empty() && x->key >= to)
+        break;
+      f(x->key);
+      ++seen;
+    }
+    if (readers.fetch_sub(1) == 1)
+      reclaim();
+    return seen;
+  }
+
+  /// Apply a function to the keys that start with a prefix, in ascending
+  /// order, without locking
+  ///
+  /// @param prefix The prefix
+  /// @param limit  The maximum number of keys to visit
+  /// @param f      The function to apply to each key
+  ///
+  /// @returns The number of keys visited
+  template <typename F>
+  size_t prefix(std::string_view prefix, size_t limit, F &&f) {
+    std::string end = prefix_end(prefix);
+    return range(prefix, end, limit, std::forward<F>(f));
+  }
+};
@@ -108,6 +108,10 @@ const std::string REQ_BYE = "BYE";
 /// is a convenience request to help the professor and TAs grade your
 /// assignment.
 ///
+/// The data is written by a background snapshot, so other requests are served
+/// while it runs, and the response does not wait for it.  A SAV that arrives
+/// while a snapshot is running does not start another.
+///
 /// @rblock   padR(enc(pubkey, "SAV".aeskey.length(@ablock)))
 /// @ablock   enc(aeskey, @u."\n".@p)
 /// @response enc(aeskey, "OK").<EOF>       -- Success
@@ -202,6 +206,14 @@ const std::string RES_ERR_XMIT = "ERR_XMIT";
 /// provided AES key
 const std::string RES_ERR_CRYPTO = "ERR_CRYPTO";
 
+/// Response code to indicate that the server could not make the change durable
+/// (for example, because writing or syncing its data file failed).  Once that
+/// happens, the server refuses every change without applying it, until a
+/// snapshot (SAV) succeeds.  A change that was already in progress when the
+/// failure happened may have been applied, though, so a command that is not
+/// idempotent (such as an append) is not safe to retry blindly.
+const std::string RES_ERR_SERVER = "ERR_SERVER";
+
 ////////////////////////////////////////////////////////////////
 // Below are the additions for Assignment #2
 ////////////////////////////////////////////////////////////////
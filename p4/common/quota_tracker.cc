@@ -26,7 +26,7 @@ struct quota_tracker::Internal {
   };
   mutable std::shared_mutex mtx;
   std::deque<quota_tracker::Internal::event> events;
-  size_t q_amt;
+  size_t q_amt = 0;
   size_t max;
   double dur;
 
@@ -53,7 +53,8 @@ quota_tracker::quota_tracker(const quota_tracker &other) : fields(new Internal(o
   other.fields->mtx.lock_shared();
   // do we need to copy the actual events? or is this okay?
   this->fields->events = other.fields->events;
-  other.fields->mtx.unlock();
+  this->fields->q_amt = other.fields->q_amt;
+  other.fields->mtx.unlock_shared();
 }
 
 /// Destruct a quota tracker
@@ -72,6 +73,7 @@ bool quota_tracker::check(size_t amount) {
   time(&cur_time);
   for (size_t i = 0; i < this->fields->events.size(); i++) {
     if (difftime(cur_time, this->fields->events[i].when) > this->fields->dur) {
+      this->fields->q_amt -= this->fields->events[i].amnt;
       this->fields->events.erase(this->fields->events.begin() + i--);
     }
   }
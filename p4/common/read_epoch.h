@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+/// read_epoch lets readers that take no locks copy values that writers may
+/// replace at any moment (epoch-based reclamation).  A reader enters the
+/// current epoch with a guard before it looks at shared memory, and leaves it
+/// when it is done.  A writer that unlinks a value does not destroy it right
+/// away: it notes the epoch in which the value was retired, and destroys it
+/// once safe() says that every reader that might have seen it has left.
+///
+/// The epoch only advances from E to E+1 when no reader is left in E-1, so at
+/// any time, readers are only in the current epoch and the one before it.  A
+/// value retired in epoch E is therefore unreachable once the epoch reaches
+/// E+2.  Reader counts are split into cache-line-sized stripes, so that readers
+/// on different cores rarely write the same line.
+class read_epoch {
+  /// The number of stripes per epoch parity
+  static const size_t STRIPES = 16;
+
+  /// One stripe of a reader count
+  struct alignas(64) stripe_t {
+    std::atomic<size_t> n{0};
+  };
+
+  /// The current epoch.  It starts at 2, so that retired + 2 never wraps.
+  std::atomic<uint64_t> epoch{2};
+
+  /// The readers in the epochs of each parity
+  stripe_t readers[2][STRIPES];
+
+  /// Pick the stripe for the calling thread
+  static size_t my_stripe() {
+    thread_local size_t s =
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) % STRIPES;
+    return s;
+  }
+
+  /// Count the readers in the epochs of a parity
+  ///
+  /// @param parity The parity (0 or 1)
+  size_t active(uint64_t parity) const {
+    size_t n = 0;
+    for (const auto &s : readers[parity])
+      n += s.n.load();
+    return n;
+  }
+
+public:
+  /// A reader's presence in an epoch, from construction to destruction
+  class guard {
+    /// The stripe that counts this reader
+    std::atomic<size_t> *count;
+
+  public:
+    /// Enter the current epoch.  If the epoch advances while we register, we
+    /// back out and register in the new one.
+    ///
+    /// @param d The epoch domain
+    explicit guard(read_epoch &d) {
+      size_t s = my_stripe();
+      for (;;) {
+        uint64_t e = d.epoch.load();
+        count = &d.readers[e & 1][s].n;
+        count->fetch_add(1);
+        if (d.epoch.load() == e)
+          return;
+        count->fetch_sub(1);
+      }
+    }
+
+    /// Leave the epoch
+    ~guard() { count->fetch_sub(1); }
+
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+  };
+
+  /// Report the current epoch, for tagging a value that was just unlinked
+  uint64_t current() const { return epoch.load(); }
+
+  /// Check if a value that was retired in an epoch can be destroyed
+  ///
+  /// @param retired The epoch that current() reported after the value was
+  ///                unlinked
+  bool safe(uint64_t retired) const { return epoch.load() >= retired + 2; }
+
+  /// Advance the epoch, if no reader is left in the one before it.  This never
+  /// waits.
+  void advance() {
+    uint64_t e = epoch.load();
+    if (active((e + 1) & 1) == 0)
+      epoch.compare_exchange_strong(e, e + 1);
+  }
+};
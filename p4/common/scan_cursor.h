@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// A scan cursor names a position in a paged scan of a hash table whose bucket
+/// count is always base * 2^k, for some fixed base and a k that only grows.  A
+/// key with hash h lives in bucket h % (base * 2^k), which is
+/// (h % base) + base * x, where x is the low k bits of h / base.
+///
+/// The cursor's upper 32 bits are the base slot (h % base).  Its lower 32 bits
+/// hold x with its bits reversed, starting from the top bit.  Stepping through
+/// the x values in that reversed order means that, when the table doubles, the
+/// buckets already visited are still exactly the ones before the cursor: the
+/// two buckets that a bucket splits into are adjacent in the new order.  So a
+/// scan that runs while the table grows visits every bucket's keys once.  (This
+/// is the technique used by Redis's SCAN command.)
+///
+/// A cursor of 0 starts a scan, and a scan that is done returns 0.
+
+/// Find the bucket that a cursor names, in a table of size base * 2^k
+///
+/// @param cursor The cursor
+/// @param base   The base bucket count of the table
+/// @param k      The log of the table's growth factor
+///
+/// @returns The index of the bucket
+inline size_t scan_cursor_bucket(uint64_t cursor, size_t base, unsigned k) {
+  uint32_t top = k == 0 ? 0 : uint32_t(cursor) >> (32 - k);
+  size_t x = 0;
+  for (unsigned i = 0; i < k; ++i)
+    x |= size_t((top >> i) & 1) << (k - 1 - i);
+  return (cursor >> 32) + base * x;
+}
+
+/// Advance a cursor past the bucket it names in a table of size base * 2^k
+///
+/// @param cursor The cursor, which must name the start of a bucket at this k
+/// @param base   The base bucket count of the table
+/// @param k      The log of the table's growth factor
+///
+/// @returns The next cursor, or 0 if there are no more buckets
+inline uint64_t scan_cursor_next(uint64_t cursor, size_t base, unsigned k) {
+  uint64_t step = uint64_t(1) << (32 - k);
+  cursor = (cursor | (step - 1)) + 1;
+  return (cursor >> 32) >= base ? 0 : cursor;
+}
+
+/// Check if a cursor could have come from a scan of a table of size base * 2^k
+/// or smaller: its base slot must exist, and it must name the start of a
+/// bucket at this k.  Cursors come from clients, so they are checked before
+/// they are used.
+///
+/// @param cursor The cursor
+/// @param base   The base bucket count of the table
+/// @param k      The log of the table's current growth factor
+///
+/// @returns true if the cursor is valid
+inline bool scan_cursor_valid(uint64_t cursor, size_t base, unsigned k) {
+  return (cursor >> 32) < base &&
+         (cursor & ((uint64_t(1) << (32 - k)) - 1)) == 0;
+}
+
+/// Find the cursor of the second of the two buckets that a bucket splits into
+/// when a table of size base * 2^k doubles.  (The first has the same cursor as
+/// the bucket that split.)
+///
+/// @param cursor The cursor of the bucket that splits
+/// @param k      The log of the table's growth factor before it doubled
+///
+/// @returns The cursor of the second bucket
+inline uint64_t scan_cursor_split(uint64_t cursor, unsigned k) {
+  return cursor + (uint64_t(1) << (31 - k));
+}
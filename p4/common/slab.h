@@ -0,0 +1,297 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unistd.h>
+
+/// slab_pool is a size-class allocator for the small objects that make up most
+/// of the server's memory: bucket arrays, and the bytes of short values.
+///
+/// Each request of up to MAX_SIZE bytes is rounded up to one of a few size
+/// classes.  Objects of a class are carved out of large chunks, so there is no
+/// per-object header, and a freed object goes on a free list for its class.
+/// Each thread keeps its own free list per class, and only touches the shared
+/// (locked) list to move a batch of objects at a time, so in the common case
+/// allocating and freeing take no lock at all.  An object may be freed by a
+/// different thread than the one that allocated it.
+///
+/// Larger requests go to operator new.  Chunks are never returned to the
+/// operating system: memory freed by the table is kept for reuse.
+///
+/// The slab is opt-in: by default (ALLOC=system, -DNO_SLAB), every request
+/// goes to operator new.  Building with ALLOC=slab turns it on, which makes it
+/// easy to compare the memory use of the two.  At 10M keys the slab uses more
+/// memory, since a bucket array that the table outgrows can only be reused by
+/// another array of the same class.
+class slab_pool {
+public:
+  /// The largest request that is served from a size class
+  static const size_t MAX_SIZE = 1024;
+
+  /// The number of size classes
+  static const size_t NUM_CLASSES = 20;
+
+  /// The object size of each class: 16-byte steps up to 128, and then four
+  /// classes per doubling, so that rounding up wastes at most a fifth of an
+  /// object.  Every class is a multiple of 16 bytes, so every object is 16-byte
+  /// aligned.
+  static constexpr size_t SIZES[NUM_CLASSES] = {
+      16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+      224, 256, 320, 384, 448, 512, 640, 768, 896, 1024};
+
+private:
+  /// The number of objects that move between a thread and the shared list at
+  /// once
+  static const size_t BATCH = 32;
+
+  /// The size of each chunk that objects are carved from
+  static const size_t CHUNK = 256 * 1024;
+
+  /// A free object, linked into a free list
+  struct free_node {
+    /// The next free object
+    free_node *next;
+  };
+
+  /// The shared state of one size class
+  struct central_t {
+    /// A lock protecting all of the fields except 'out'
+    std::mutex lock;
+
+    /// The free objects that no thread is caching
+    free_node *head = nullptr;
+
+    /// The unused part of the current chunk
+    char *bump = nullptr;
+
+    /// The end of the current chunk
+    char *bump_end = nullptr;
+
+    /// The number of objects currently given to threads (in use, or in a
+    /// thread's cache)
+    std::atomic<size_t> out{0};
+  };
+
+  /// A thread's free lists
+  struct cache_t {
+    /// The free objects of each class
+    free_node *head[NUM_CLASSES] = {};
+
+    /// The length of each free list
+    size_t count[NUM_CLASSES] = {};
+
+    /// True once the thread has started exiting, after which its frees go
+    /// straight to the shared lists
+    bool dead = false;
+  };
+
+  /// Returns each thread's cache to the shared lists when the thread exits
+  struct flusher_t {
+    /// Flush the calling thread's cache
+    ~flusher_t() {
+      cache_t &c = cache();
+      for (size_t k = 0; k < NUM_CLASSES; ++k)
+        release(k, c, c.count[k]);
+      c.dead = true;
+    }
+  };
+
+  /// Find the class for a request, by 16-byte steps
+  static constexpr std::array<uint8_t, MAX_SIZE / 16 + 1> CLASS_OF = [] {
+    std::array<uint8_t, MAX_SIZE / 16 + 1> t{};
+    size_t k = 0;
+    for (size_t i = 0; i <= MAX_SIZE / 16; ++i) {
+      while (SIZES[k] < i * 16)
+        ++k;
+      t[i] = uint8_t(k);
+    }
+    return t;
+  }();
+
+  /// The shared state of every class.  It is never destroyed, since objects
+  /// may be freed during static destruction.
+  static central_t *central() {
+    static central_t *c = new central_t[NUM_CLASSES];
+    return c;
+  }
+
+  /// The calling thread's cache.  Its storage stays valid until the thread is
+  /// gone; flusher_t empties it when the thread starts to exit.
+  static cache_t &cache() {
+    static thread_local cache_t c;
+    static thread_local flusher_t f;
+    (void)f;
+    return c;
+  }
+
+  /// The bytes obtained for chunks
+  inline static std::atomic<size_t> chunk_bytes{0};
+
+  /// The bytes currently allocated with operator new, for large requests
+  inline static std::atomic<size_t> large_bytes{0};
+
+  /// Move up to BATCH objects of a class from the shared list to a thread's
+  /// cache, carving new ones from a chunk as needed
+  ///
+  /// @param k The class
+  /// @param c The thread's cache
+  static void refill(size_t k, cache_t &c) {
+    central_t &s = central()[k];
+    std::lock_guard<std::mutex> g(s.lock);
+    size_t n = 0;
+    for (; n < BATCH && s.head != nullptr; ++n) {
+      free_node *x = s.head;
+      s.head = x->next;
+      x->next = c.head[k];
+      c.head[k] = x;
+    }
+    for (; n < BATCH; ++n) {
+      if (s.bump + SIZES[k] > s.bump_end) {
+        s.bump = static_cast<char *>(::operator new(CHUNK));
+        s.bump_end = s.bump + CHUNK;
+        chunk_bytes.fetch_add(CHUNK, std::memory_order_relaxed);
+      }
+      free_node *x = reinterpret_cast<free_node *>(s.bump);
+      s.bump += SIZES[k];
+      x->next = c.head[k];
+      c.head[k] = x;
+    }
+    c.count[k] += n;
+    s.out.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /// Move objects of a class from a thread's cache to the shared list
+  ///
+  /// @param k The class
+  /// @param c The thread's cache
+  /// @param n The number of objects to move
+  static void release(size_t k, cache_t &c, size_t n) {
+    if (n == 0)
+      return;
+    free_node *first = c.head[k], *last = first;
+    for (size_t i = 1; i < n; ++i)
+      last = last->next;
+    c.head[k] = last->next;
+    c.count[k] -= n;
+    central_t &s = central()[k];
+    std::lock_guard<std::mutex> g(s.lock);
+    last->next = s.head;
+    s.head = first;
+    s.out.fetch_sub(n, std::memory_order_relaxed);
+  }
+
+public:
+  /// Allocate memory
+  ///
+  /// @param n The number of bytes
+  ///
+  /// @returns Memory for n bytes, aligned to 16 bytes
+  static void *allocate(size_t n) {
+#ifndef NO_SLAB
+    if (n <= MAX_SIZE) {
+      size_t k = CLASS_OF[(n + 15) / 16];
+      cache_t &c = cache();
+      if (c.head[k] == nullptr)
+        refill(k, c);
+      free_node *x = c.head[k];
+      c.head[k] = x->next;
+      --c.count[k];
+      if (c.dead) {
+        // Don't keep a cache for a thread that is exiting
+        release(k, c, c.count[k]);
+      }
+      return x;
+    }
+    large_bytes.fetch_add(n, std::memory_order_relaxed);
+#endif
+    return ::operator new(n);
+  }
+
+  /// Free memory that came from allocate()
+  ///
+  /// @param p The memory
+  /// @param n The number of bytes that were requested
+  static void deallocate(void *p, size_t n) {
+#ifndef NO_SLAB
+    if (n <= MAX_SIZE) {
+      size_t k = CLASS_OF[(n + 15) / 16];
+      cache_t &c = cache();
+      free_node *x = static_cast<free_node *>(p);
+      x->next = c.head[k];
+      c.head[k] = x;
+      if (++c.count[k] >= 2 * BATCH || c.dead)
+        release(k, c, c.dead ? c.count[k] : BATCH);
+      return;
+    }
+    large_bytes.fetch_sub(n, std::memory_order_relaxed);
+#endif
+    ::operator delete(p);
+  }
+
+  /// Describe the memory use of the process and of the pool, one statistic
+  /// per line
+  static std::string report() {
+    std::string r;
+    auto line = [&](const std::string &name, size_t bytes) {
+      r += name + ": " + std::to_string(bytes) + "\n";
+    };
+    size_t pages = 0, resident = 0;
+    if (FILE *f = fopen("/proc/self/statm", "r")) {
+      if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+      fclose(f);
+    }
+    line("rss_bytes", resident * sysconf(_SC_PAGESIZE));
+#ifdef NO_SLAB
+    r += "slab: disabled\n";
+#else
+    line("slab_chunk_bytes", chunk_bytes.load());
+    line("slab_large_bytes", large_bytes.load());
+    for (size_t k = 0; k < NUM_CLASSES; ++k) {
+      size_t out = central()[k].out.load();
+      if (out != 0)
+        line("slab_class_" + std::to_string(SIZES[k]) + "_bytes",
+             out * SIZES[k]);
+    }
+#endif
+    return r;
+  }
+};
+
+/// slab_allocator lets standard containers get their memory from slab_pool
+template <typename T> struct slab_allocator {
+  static_assert(alignof(T) <= 16, "slab_pool objects are 16-byte aligned");
+
+  /// The type that is allocated
+  typedef T value_type;
+
+  /// Construct an allocator.  All slab_allocators share one pool.
+  slab_allocator() = default;
+
+  /// Construct an allocator from one for another type
+  template <typename U> slab_allocator(const slab_allocator<U> &) {}
+
+  /// Allocate space for n objects
+  T *allocate(size_t n) {
+    return static_cast<T *>(slab_pool::allocate(n * sizeof(T)));
+  }
+
+  /// Free space for n objects
+  void deallocate(T *p, size_t n) { slab_pool::deallocate(p, n * sizeof(T)); }
+
+  /// All slab_allocators are interchangeable
+  template <typename U> bool operator==(const slab_allocator<U> &) const {
+    return true;
+  }
+
+  /// All slab_allocators are interchangeable
+  template <typename U> bool operator!=(const slab_allocator<U> &) const {
+    return false;
+  }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// TimerWheel is a hierarchical timing wheel: a set of items, each with a
+/// deadline, from which the items whose deadlines have passed can be taken in
+/// time proportional to their number, rather than to the number of items.
+///
+/// Time is divided into ticks.  Level 0 has one slot per tick for the next
+/// SLOTS ticks, level 1 has one slot per SLOTS ticks for the next SLOTS^2
+/// ticks, and so on.  An item goes in the slot for its deadline at the lowest
+/// level that reaches that far.  Each time the wheel turns past a slot of a
+/// higher level, that slot's items are re-placed, so they move down a level
+/// at a time until they reach level 0, where they fire.  Deadlines beyond the
+/// top level wait in its last slot, and are re-placed when it comes around.
+///
+/// Items are never cancelled.  A user who changes an item's deadline just
+/// schedules it again, and ignores the stale copy when it fires.  This keeps
+/// scheduling O(1), at the cost of holding stale copies until their deadline.
+///
+/// All methods lock the wheel, so it can be shared by many threads.  Items
+/// are handed to the caller after the lock is released.
+template <typename T> class TimerWheel {
+  /// The number of bits of a tick number that each level covers
+  static const unsigned BITS = 6;
+
+  /// The number of slots per level
+  static const uint64_t SLOTS = 1ull << BITS;
+
+  /// The number of levels
+  static const unsigned LEVELS = 4;
+
+  /// An item and its deadline (in ticks)
+  typedef std::pair<uint64_t, T> timer_t;
+
+  /// A lock protecting all of the fields
+  std::mutex lock;
+
+  /// The length of a tick, in the units of the deadlines
+  const uint64_t tick_len;
+
+  /// The last tick that has been processed.  Every item whose deadline is at
+  /// or before this tick has fired.
+  uint64_t now = 0;
+
+  /// The slots of each level
+  std::vector<timer_t> wheel[LEVELS][SLOTS];
+
+  /// The number of items in the wheel
+  size_t count = 0;
+
+  /// Put an item in the slot for its deadline.  The deadline must be after
+  /// now.
+  ///
+  /// @param t The item and its deadline
+  void place(timer_t &&t) {
+    uint64_t delta = t.first - now;
+    for (unsigned l = 0; l < LEVELS; ++l) {
+      if (delta < (SLOTS << (l * BITS))) {
+        wheel[l][(t.first >> (l * BITS)) & (SLOTS - 1)].push_back(std::move(t));
+        return;
+      }
+    }
+    // Too far away for the top level: wait in the top level's last slot
+    uint64_t last = now + (SLOTS << ((LEVELS - 1) * BITS)) - 1;
+    wheel[LEVELS - 1][(last >> ((LEVELS - 1) * BITS)) & (SLOTS - 1)].push_back(
+        std::move(t));
+  }
+
+public:
+  /// Construct an empty wheel
+  ///
+  /// @param tick  The length of a tick, in the units of the deadlines
+  /// @param start The current time, in the units of the deadlines
+  TimerWheel(uint64_t tick, uint64_t start) : tick_len(tick), now(start / tick) {}
+
+  /// Report the number of items in the wheel, including stale ones
+  size_t size() {
+    std::lock_guard<std::mutex> g(lock);
+    return count;
+  }
+
+  /// Remove every item from the wheel, and restart it at a given time
+  ///
+  /// @param start The current time, in the units of the deadlines
+  void clear(uint64_t start) {
+    std::lock_guard<std::mutex> g(lock);
+    for (auto &level : wheel)
+      for (auto &slot : level)
+        std::vector<timer_t>().swap(slot);
+    count = 0;
+    now = start / tick_len;
+  }
+
+  /// Add an item to the wheel
+  ///
+  /// @param deadline The time at which the item should fire.  It is rounded up
+  ///                 to a tick, so an item never fires early.
+  /// @param item     The item
+  void schedule(uint64_t deadline, T item) {
+    std::lock_guard<std::mutex> g(lock);
+    uint64_t tick = (deadline + tick_len - 1) / tick_len;
+    // An item that is already due fires on the next tick
+    place({tick > now ? tick : now + 1, std::move(item)});
+    ++count;
+  }
+
+  /// Turn the wheel to a given time, and hand every item whose deadline has
+  /// passed to a function
+  ///
+  /// @param time The current time, in the units of the deadlines
+  /// @param fire The function to apply to each item that is due
+  ///
+  /// @returns The number of items that fired
+  template <typename F> size_t advance(uint64_t time, F &&fire) {
+    std::vector<T> due;
+    {
+      std::lock_guard<std::mutex> g(lock);
+      uint64_t target = time / tick_len;
+      while (now < target) {
+        // With nothing scheduled, there is nothing to turn through
+        if (count == 0) {
+          now = target;
+          break;
+        }
+        ++now;
+        // Bring down the slots of the higher levels that this tick starts
+        for (unsigned l = 1; l < LEVELS; ++l) {
+          if ((now & ((1ull << (l * BITS)) - 1)) != 0)
+            break;
+          std::vector<timer_t> slot;
+          slot.swap(wheel[l][(now >> (l * BITS)) & (SLOTS - 1)]);
+          for (auto &t : slot) {
+            if (t.first <= now) {
+              due.push_back(std::move(t.second));
+              --count;
+            } else {
+              place(std::move(t));
+            }
+          }
+        }
+        auto &slot = wheel[0][now & (SLOTS - 1)];
+        for (auto &t : slot)
+          due.push_back(std::move(t.second));
+        count -= slot.size();
+        slot.clear();
+      }
+    }
+    for (auto &item : due)
+      fire(std::move(item));
+    return due.size();
+  }
+};
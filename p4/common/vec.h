@@ -1,12 +1,56 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "slab.h"
+
 /// vec is a short name for a vector of unsigned chars, so that we don't have to
 /// clutter the code with long names
 typedef std::vector<unsigned char> vec;
 
+/// slab_vec is a vector of unsigned chars whose bytes come from the slab
+/// allocator, for values that are stored for a long time
+typedef std::vector<unsigned char, slab_allocator<unsigned char>> slab_vec;
+
+/// shared_vec is an immutable, reference-counted slab_vec.  Holding one keeps
+/// the bytes alive even after the table that it came from replaces or drops
+/// them, so readers can take a reference under a lock and use the bytes after
+/// it.
+typedef std::shared_ptr<const slab_vec> shared_vec;
+
+/// Create a shared_vec holding a copy of some bytes.  The reference count and
+/// the vector are one slab allocation, and the bytes are another, with no
+/// spare capacity.
+///
+/// @param begin The first byte
+/// @param end   The byte after the last byte
+///
+/// @returns A shared_vec with a copy of the bytes
+inline shared_vec make_shared_vec(const unsigned char *begin,
+                                  const unsigned char *end) {
+  return std::allocate_shared<slab_vec>(slab_allocator<slab_vec>(), begin,
+                                        end);
+}
+
+/// Create a shared_vec holding a copy of a vec
+///
+/// @param v The vec to copy
+///
+/// @returns A shared_vec with a copy of v
+inline shared_vec make_shared_vec(const vec &v) {
+  return make_shared_vec(v.data(), v.data() + v.size());
+}
+
+/// Append the contents of a slab_vec to a vector
+///
+/// @param to   The vector into which we should copy
+/// @param from The slab_vec from which to copy
+inline void vec_append(vec &to, const slab_vec &from) {
+  to.insert(to.end(), from.begin(), from.end());
+}
+
 /// Create a vector from a string, by copying the string contents into the
 /// vector
 ///
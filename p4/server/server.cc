@@ -5,6 +5,7 @@
 #include "../common/crypto.h"
 #include "../common/file.h"
 #include "../common/net.h"
+#include "../common/slab.h"
 
 #include "server_args.h"
 #include "server_parsing.h"
@@ -42,10 +43,15 @@ int main(int argc, char **argv) {
   // create an empty Storage object.
   Storage storage(args.datafile, args.num_buckets, args.quota_up,
                   args.quota_down, args.quota_req, args.quota_interval,
-                  args.top_size);
+                  args.top_size, args.key_index, args.mem_limit,
+                  args.compress_min, args.dedup_min, args.log_sync,
+                  args.compact_pct, args.compact_growth);
   if (!storage.load()) {
     return 0;
   }
+  if (args.alloc_report) {
+    cerr << slab_pool::report();
+  }
 
   // Start listening for connections.
   int sd = create_server_socket(args.port);
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "server_args.h"
+
+using namespace std;
+
+/// Parse the command-line arguments, and use them to populate the provided args
+/// object.
+///
+/// @param argc The number of command-line arguments passed to the program
+/// @param argv The list of command-line arguments
+/// @param args The struct into which the parsed args should go
+void parse_args(int argc, char **argv, server_arg_t &args) {
+  long opt;
+  while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:xm:z:s:l:g:c:v")) != -1) {
+    switch (opt) {
+    case 'p':
+      args.port = strtol(optarg, nullptr, 10);
+      break;
+    case 'f':
+      args.datafile = string(optarg);
+      break;
+    case 'k':
+      args.keyfile = string(optarg);
+      break;
+    case 'h':
+      args.usage = true;
+      break;
+    case 't':
+      args.threads = strtol(optarg, nullptr, 10);
+      break;
+    case 'b':
+      args.num_buckets = strtol(optarg, nullptr, 10);
+      break;
+    case 'i':
+      args.quota_interval = strtol(optarg, nullptr, 10);
+      break;
+    case 'u':
+      args.quota_up = strtol(optarg, nullptr, 10);
+      break;
+    case 'd':
+      args.quota_down = strtol(optarg, nullptr, 10);
+      break;
+    case 'r':
+      args.quota_req = strtol(optarg, nullptr, 10);
+      break;
+    case 'o':
+      args.top_size = strtol(optarg, nullptr, 10);
+      break;
+    case 'x':
+      args.key_index = true;
+      break;
+    case 'm':
+      args.mem_limit = strtol(optarg, nullptr, 10);
+      break;
+    case 'z':
+      args.compress_min = strtol(optarg, nullptr, 10);
+      break;
+    case 's':
+      args.dedup_min = strtol(optarg, nullptr, 10);
+      break;
+    case 'l':
+      args.log_sync = strtol(optarg, nullptr, 10);
+      break;
+    case 'g':
+      args.compact_pct = strtol(optarg, nullptr, 10);
+      break;
+    case 'c':
+      args.compact_growth = strtol(optarg, nullptr, 10);
+      break;
+    case 'v':
+      args.alloc_report = true;
+      break;
+    case 'a':
+      break;
+    default:
+      args.usage = true;
+      return;
+    }
+  }
+}
+
+/// Display a help message to explain how the command-line parameters for this
+/// program work
+///
+/// @progname The name of the program
+void usage(char *progname) {
+  cout << basename(progname) << ": company user directory server\n"
+       << "  -p [int]    Port on which to listen for incoming connections\n"
+       << "  -f [string] File for storing all data\n"
+       << "  -k [string] Basename of file for storing the server's RSA keys\n"
+       << "  -t [int]    # of threads that server should use\n"
+       << "  -b [int]    # of buckets for the server's hash tables\n"
+       << "  -i [int]    Quota interval (seconds)\n"
+       << "  -u [int]    Upload quota (MB/interval)\n"
+       << "  -d [int]    Download quota (MB/interval)\n"
+       << "  -r [int]    Request quota (requests/interval)\n"
+       << "  -o [int]    Size of the TOP key cache\n"
+       << "  -x          Keep an ordered index of keys (for range and prefix scans)\n"
+       << "  -m [int]    Memory limit for the K/V store (bytes, 0 = none)\n"
+       << "  -z [int]    Compress values of at least this size (bytes, 0 = none)\n"
+       << "  -s [int]    Share identical values of at least this size (bytes, 0 = none)\n"
+       << "  -l [int]    Log sync interval (ms, 0 = every op, -1 = OS-buffered)\n"
+       << "  -g [int]    Compact the data file at this % garbage (0 = never)\n"
+       << "  -c [int]    Compact the data file after it grows this much (bytes, 0 = never)\n"
+       << "  -v          Print allocator memory use after loading the data file\n"
+       << "  -a [string] Ignored\n"
+       << "  -h          Print help (this message)\n";
+}
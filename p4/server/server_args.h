@@ -36,6 +36,34 @@ struct server_arg_t {
 
   /// Number of keys to track for TOP queries
   size_t top_size = 4;
+
+  /// Keep an ordered index of the keys in the K/V store?
+  bool key_index = false;
+
+  /// Memory limit for the K/V store, in bytes, or 0 for no limit.  Past the
+  /// limit, cold keys are evicted.
+  size_t mem_limit = 0;
+
+  /// Values of at least this many bytes are compressed, or 0 for none
+  size_t compress_min = 0;
+
+  /// Values of at least this many bytes are stored once per distinct content,
+  /// or 0 for none
+  size_t dedup_min = 0;
+
+  /// Log sync policy: milliseconds between syncs of the log, 0 to sync before
+  /// every reply, or -1 to leave syncing to the OS
+  int log_sync = -1;
+
+  /// Compact the data file when this percent of it is garbage, or 0 for never
+  size_t compact_pct = 0;
+
+  /// Compact the data file when it grows this many bytes past the last
+  /// snapshot, or 0 for never
+  size_t compact_growth = 0;
+
+  /// Print the slab allocator's memory report after loading the data file?
+  bool alloc_report = false;
 };
 
 /// Parse the command-line arguments, and use them to populate the provided args
@@ -1,14 +1,28 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <openssl/md5.h>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <zlib.h>
 
+#include "../common/blob_store.h"
+#include "../common/chunk_list.h"
 #include "../common/contextmanager.h"
 #include "../common/err.h"
+#include "../common/flat_hashtable.h"
+#include "../common/group_log.h"
 #include "../common/hashtable.h"
+#include "../common/mapped_file.h"
 #include "../common/mru.h"
+#include "../common/ordered_index.h"
 #include "../common/protocol.h"
 #include "../common/quota_tracker.h"
+#include "../common/timer_wheel.h"
 #include "../common/vec.h"
 #include "../common/file.h"
 
@@ -16,6 +30,11 @@
 
 using namespace std;
 
+/// The number of partitions (and threads) to use when scanning a whole table
+static size_t scan_parts() {
+  return max(1u, thread::hardware_concurrency());
+}
+
 /// Storage::Internal is the private struct that holds all of the fields of
 /// the Storage object.  Organizing the fields as an Internal is part of the
 /// PIMPL pattern.
@@ -41,6 +60,29 @@ struct Storage::Internal {
     quota_tracker requests;
   };
 
+  /// KVTableEntry is one value in the key/value store
+  struct KVTableEntry {
+    /// The value's bytes
+    shared_vec value;
+
+    /// When the pair expires, in milliseconds since the epoch, or 0 if never
+    uint64_t expires = 0;
+
+    /// The value's length once decompressed, or 0 if value is not compressed
+    uint32_t raw_size = 0;
+
+    /// The shared blob that holds the value, or nullptr.  When it is set, value
+    /// points into the blob, and keeps it alive.
+    const BlobStore::blob_t *blob = nullptr;
+
+    /// The value's bytes, if it is stored in chunks, or nullptr.  When it is
+    /// set, value is nullptr, and the value is neither compressed nor shared.
+    shared_ptr<const chunk_list> chunks;
+
+    /// Check if the entry holds a value, in either form
+    bool has_value() const { return value != nullptr || chunks != nullptr; }
+  };
+
   /// A unique 8-byte code to use as a prefix each time an AuthTable Entry is
   /// written to disk.
   inline static const string AUTHENTRY = "AUTHAUTH";
@@ -61,18 +103,61 @@ struct Storage::Internal {
   /// store
   inline static const string KVDELETE = "KVDELETE";
 
+  /// A unique 8-byte code for persisting a KV pair that expires, in place of
+  /// KVENTRY or KVUPDATE
+  inline static const string KVEXPIRE = "KVEXPIRE";
+
+  /// The length of a tick of the expiry wheel, in milliseconds
+  inline static const uint64_t EXPIRY_TICK = 1000;
+
+  /// The bit of a persisted value's length that marks the value as compressed.
+  /// Values are at most LEN_VAL bytes, so the bit is never part of a length.
+  inline static const uint32_t COMPRESSED = 0x80000000;
+
+  /// The bit of a persisted value's length that marks the value as a
+  /// reference to a blob
+  inline static const uint32_t REFERENCE = 0x40000000;
+
+  /// A unique 8-byte code for persisting a blob that K/V pairs refer to
+  inline static const string BLOBENTRY = "BLOBBLOB";
+
+  /// A unique 8-byte code for incremental persistence of appends to a value
+  inline static const string KVAPPEND = "KVAPPEND";
+
+  /// The shared values.  It is declared before kv_store, so that it outlives
+  /// every blob in kv_store.
+  BlobStore blobs;
+
+  /// The blobs that have been read by a load() that is in progress, by views
+  /// of their digests in the mapped file
+  unordered_map<string_view, shared_ptr<const BlobStore::blob_t>> loading;
+
+  /// The generation of the file that log appends to.  A blob whose mark is
+  /// this generation has been written to the file (since the point in time
+  /// of the snapshot in progress, if there is one, so that the snapshot's new
+  /// file gets it too).
+  atomic<uint64_t> log_gen{1};
+
   /// The map of authentication information, indexed by username
   ConcurrentHashTable<string, AuthTableEntry> auth_table;
 
-  /// The map of key/value pairs
-  ConcurrentHashTable<string, vec> kv_store;
+  /// The map of key/value pairs.  Building with TABLE=flat selects the
+  /// open-addressing table instead of the chained one.  Values are immutable
+  /// and shared: an update swaps in a new buffer.  In the chained table, a
+  /// reader of a short key copies the pointer without taking the bucket lock,
+  /// and the entry it replaced lives until no such reader can still see it.
+#ifdef FLAT_TABLE
+  FlatHashTable<string, KVTableEntry> kv_store;
+#else
+  ConcurrentHashTable<string, KVTableEntry, true> kv_store;
+#endif
 
   /// filename is the name of the file from which the Storage object was loaded,
   /// and to which we persist the Storage object every time it changes
   string filename = "";
 
-  /// The open file
-  FILE *f_ptr = nullptr;
+  /// The log to which every change is appended, between calls to persist()
+  GroupLog log;
 
   /// The upload quota
   const size_t up_quota;
@@ -89,19 +174,935 @@ struct Storage::Internal {
   /// The MRU table for tracking the most recently used keys
   mru_manager mru;
 
+  /// The approximate memory used by kv_store, in bytes (see footprint())
+  atomic<size_t> mem_used{0};
+
+  /// The memory limit for kv_store, in bytes, or 0 for no limit
+  const size_t mem_limit;
+
+  /// A lock that allows only one thread to enforce the memory limit at a time
+  mutex evicting;
+
+  /// The smallest value that is compressed, in bytes, or 0 to never compress
+  const size_t compress_min;
+
+  /// The smallest value that is shared, in bytes, or 0 to never share
+  const size_t dedup_min;
+
+  /// The memory that a pair costs, beyond its key and value bytes: the table
+  /// entry, and the value's reference count and vector.  This is an estimate.
+  static const size_t PAIR_OVERHEAD = 128;
+
+  /// An ordered index of the keys in kv_store, for range and prefix scans.
+  /// nullptr unless the index was requested, since keeping it costs a skiplist
+  /// update on every insert and delete.
+  unique_ptr<OrderedIndex> key_index;
+
+  /// The keys that have an expiry, by expiry.  A key may be in the wheel more
+  /// than once, or after it was removed; expire() ignores every copy but the
+  /// ones whose pair really has expired.
+  TimerWheel<string> expiries;
+
+  /// The thread that turns the expiry wheel, and removes expired pairs
+  thread reaper;
+
+  /// A lock for stopping the reaper
+  mutex reaper_lock;
+
+  /// A condition variable for waking the reaper when it should stop
+  condition_variable reaper_cv;
+
+  /// True once the reaper should stop
+  bool stopping = false;
+
   /// Construct the Storage::Internal object by setting the filename and bucket
   /// count
   ///
   /// @param fname       The name of the file that should be used to load/store
   ///                    the data
   /// @param num_buckets The number of buckets for the hash
+  /// @param index       Should an ordered index of the keys be kept?
+  /// @param limit       The memory limit for kv_store, or 0 for none
+  /// @param zmin        The smallest value to compress, or 0 for none
+  /// @param dmin        The smallest value to share, or 0 for none
+  /// @param sync        The log's sync policy (see GroupLog)
+  /// @param gpct        The garbage percent that triggers compaction, or 0
+  /// @param growth      The growth that triggers compaction, or 0
   Internal(const string &fname, size_t num_buckets, size_t upq, size_t dnq,
-           size_t rqq, double qd, size_t top)
+           size_t rqq, double qd, size_t top, bool index, size_t limit,
+           size_t zmin, size_t dmin, int sync, size_t gpct, size_t growth)
       : auth_table(num_buckets), kv_store(num_buckets), filename(fname),
-        up_quota(upq), down_quota(dnq), req_quota(rqq), quota_dur(qd),
-        mru(top) {}
+        log(sync), up_quota(upq), down_quota(dnq), req_quota(rqq), quota_dur(qd),
+        mru(top), mem_limit(limit), compress_min(zmin), dedup_min(dmin),
+        key_index(index ? new OrderedIndex() : nullptr),
+        expiries(EXPIRY_TICK, now_ms()), compact_pct(gpct),
+        compact_growth(growth) {
+    reaper = thread([this]() { reap(); });
+  }
+
+  /// The thread that writes the current (or last) background snapshot
+  thread snapshotter;
+
+  /// A lock protecting the fields below, and snapshotter
+  mutex snap_lock;
+
+  /// Is a background snapshot running?
+  bool snap_running = false;
+
+  /// When the current (or last) snapshot started, and how long it took
+  chrono::steady_clock::time_point snap_start;
+  double snap_seconds = 0;
+
+  /// Did the last snapshot finish with its file in place?
+  bool snap_ok = true;
+
+  /// The progress of the current (or last) snapshot: pairs written, pairs in
+  /// the table when it started, and bytes written
+  atomic<size_t> snap_pairs{0}, snap_total{0}, snap_bytes{0};
+
+  /// Compact the file when this percent of it is garbage, or 0 for never
+  const size_t compact_pct;
+
+  /// Compact the file when it grows this many bytes past log_base, or 0 for
+  /// never
+  const size_t compact_growth;
+
+  /// The size of the file after the last snapshot, or 0 if there has not been
+  /// one, so that a large file that was loaded is compacted too
+  atomic<uint64_t> log_base{0};
+
+  /// The smallest file that is compacted for its garbage, so that small files
+  /// are not rewritten over and over
+  static const size_t COMPACT_MIN = 1 << 20;
+
+  /// The bytes of a K/V record beyond its key and value: the magic, and two
+  /// lengths.  This is an estimate.
+  static const size_t RECORD_OVERHEAD = 16;
+
+  /// Start a background snapshot of kv_store and auth_table, unless one is
+  /// already running (see Storage::persist())
+  void start_snapshot() {
+    lock_guard<mutex> g(snap_lock);
+    if (snap_running)
+      return;
+    if (snapshotter.joinable())
+      snapshotter.join();
+    snap_running = true;
+    snap_start = chrono::steady_clock::now();
+    snap_pairs = 0;
+    snap_bytes = 0;
+    snap_total = kv_store.size();
+    snapshotter = thread([this]() {
+      // Buffers are written whenever they reach this size, so memory stays small
+      const size_t FLUSH_AT = 1 << 20;
+      string tmp = filename + ".tmp";
+      FILE *out = fopen(tmp.c_str(), "w");
+      auto emit = [&](vec &buf, size_t at_least) {
+        if (buf.size() < at_least || buf.empty())
+          return;
+        if (out != nullptr)
+          fwrite(buf.data(), sizeof(char), buf.size(), out);
+        snap_bytes += buf.size();
+        buf.clear();
+      };
+      size_t parts = scan_parts();
+      vector<vec> bufs(parts);
+      // Each partition writes the blobs that its pairs share.  A blob can't be
+      // marked as written, since the old file still needs its own copy.
+      vector<unordered_set<const BlobStore::blob_t *>> seen(parts);
+      uint64_t now = now_ms();
+      off_t from = 0;
+      uint64_t cut = 0;
+      kv_store.snapshot_parallel(parts, [&](size_t p, string_view key, const KVTableEntry &value) {
+        if (expired(value, now))
+          return;
+        if (value.blob && seen[p].insert(value.blob).second)
+          log_blob_record(bufs[p], *value.blob);
+        log_pair(bufs[p], KVENTRY, key, value);
+        ++snap_pairs;
+        emit(bufs[p], FLUSH_AT);
+      }, [&]() {
+        for (auto &buf : bufs)
+          emit(buf, 0);
+      }, [&]() {
+        // The point in time: no K/V write is in progress.  Later records go to
+        // the old file after offset 'from', and log the blobs they use again.
+        ++log_gen;
+        cut = log.request_open(filename);
+      });
+      from = log.wait_open();
+      // Auth records are safe to replay, so users may be captured after the
+      // point in time
+      auth_table.snapshot_parallel(parts, [&](size_t p, string_view, const AuthTableEntry &entry) {
+        vec &buf = bufs[p];
+        vec_append(buf, AUTHENTRY);
+        vec_append(buf, (int)(entry.username.size()));
+        vec_append(buf, entry.username);
+        vec_append(buf, (int)(entry.pass_hash.size()));
+        vec_append(buf, entry.pass_hash);
+        vec_append(buf, (int)(entry.content.size()));
+        if(entry.content.size() > 0) {
+          vec_append(buf, entry.content);
+        }
+        emit(buf, FLUSH_AT);
+      }, [&]() {
+        for (auto &buf : bufs)
+          emit(buf, 0);
+      });
+      bool ok = out != nullptr && fflush(out) == 0 && fsync(fileno(out)) == 0;
+      if (out != nullptr)
+        fclose(out);
+      // Append the records from after the point in time, on the log's writer
+      // thread, so that nothing can be appended to the old file in the meantime
+      off_t size = 0;
+      if (ok)
+        size = log.open(tmp, [&](int fd) {
+          int in = open(filename.c_str(), O_RDONLY);
+          vec buf(FLUSH_AT);
+          for (off_t at = from; ok;) {
+            ssize_t n = in < 0 ? -1 : pread(in, buf.data(), buf.size(), at);
+            if (n == 0)
+              break;
+            ok = n > 0 && GroupLog::write_all(fd, buf.data(), n);
+            at += n;
+          }
+          if (in >= 0)
+            close(in);
+          // The snapshot stands in for records that the log dropped before
+          // the point in time, but not for any that it dropped after it
+          ok = ok && log.dropped_lsn() <= cut && fdatasync(fd) == 0 &&
+               rename(tmp.c_str(), filename.c_str()) == 0;
+          return ok;
+        });
+      if (!ok)
+        remove(tmp.c_str());
+      // After a failure, wait for the file to grow before trying again
+      log_base = ok ? size : log.size();
+      lock_guard<mutex> g(snap_lock);
+      snap_ok = ok;
+      snap_seconds = chrono::duration<double>(chrono::steady_clock::now() - snap_start).count();
+      snap_running = false;
+    });
+  }
+
+  /// Wait for the background snapshot, if one is running.  The snapshotter
+  /// takes snap_lock as it finishes, so it is joined without holding it.
+  void wait_snapshot() {
+    thread t;
+    {
+      lock_guard<mutex> g(snap_lock);
+      t.swap(snapshotter);
+    }
+    if (t.joinable())
+      t.join();
+  }
+
+  /// Stop the reaper (which may start snapshots) and then the snapshotter,
+  /// before any of the fields they use are destructed
+  ~Internal() {
+    {
+      lock_guard<mutex> g(reaper_lock);
+      stopping = true;
+    }
+    reaper_cv.notify_one();
+    reaper.join();
+    wait_snapshot();
+  }
+
+  /// Get the current time, in milliseconds since the epoch.  Expiries are
+  /// persisted, so they use the system clock rather than a steady one.
+  static uint64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /// Compute the expiry for a pair that should live for ttl seconds
+  ///
+  /// @param ttl The number of seconds, or 0 for a pair that never expires
+  static uint64_t deadline(uint32_t ttl) {
+    return ttl == 0 ? 0 : now_ms() + uint64_t(ttl) * 1000;
+  }
+
+  /// Check if a pair has expired.  An expired pair is invisible to reads,
+  /// even before the reaper removes it.
+  ///
+  /// @param e   The pair's value
+  /// @param now The current time, from now_ms()
+  static bool expired(const KVTableEntry &e, uint64_t now) {
+    return e.expires != 0 && e.expires <= now;
+  }
+
+  /// Build the value to store for a client's bytes.  If the value is big
+  /// enough, it is compressed, and the compressed bytes are kept if they save
+  /// at least an eighth of the space.  If it is big enough to share, it is
+  /// looked up by digest, and an existing blob with the same content is used
+  /// without compressing or copying anything.  A value that is neither, and
+  /// is longer than a chunk, is stored in chunks.  This runs before any lock
+  /// is taken.
+  ///
+  /// @param val     The client's bytes
+  /// @param size    The number of bytes
+  /// @param expires The pair's expiry, or 0
+  KVTableEntry pack(const unsigned char *val, size_t size, uint64_t expires) {
+    string digest;
+    if (dedup_min != 0 && size >= dedup_min) {
+      digest = BlobStore::digest_of(val, size);
+      if (auto b = blobs.find(digest))
+        return from_blob(b, expires);
+    }
+    const unsigned char *bytes = val;
+    size_t len = size;
+    uint32_t raw = 0;
+    vec buf;
+    if (compress_min != 0 && size >= compress_min) {
+      uLongf zlen = compressBound(size);
+      buf.resize(zlen);
+      if (compress2(buf.data(), &zlen, val, size, Z_BEST_SPEED) == Z_OK &&
+          zlen <= size - size / 8) {
+        bytes = buf.data();
+        len = zlen;
+        raw = size;
+      }
+    }
+    if (!digest.empty())
+      return from_blob(blobs.insert(digest, bytes, bytes + len, raw), expires);
+    if (raw == 0 && len > chunk_list::CHUNK)
+      return {nullptr, expires, 0, nullptr, chunk_list::make(bytes, bytes + len)};
+    return {make_shared_vec(bytes, bytes + len), expires, raw};
+  }
+
+  /// Build the value to store for a client's bytes
+  ///
+  /// @param val     The client's bytes
+  /// @param expires The pair's expiry, or 0
+  KVTableEntry pack(const vec &val, uint64_t expires) {
+    return pack(val.data(), val.size(), expires);
+  }
+
+  /// Build the value to store for a client's bytes, taking over their buffer.
+  /// A value that is stored as it is (not compressed, shared, or chunked)
+  /// keeps the buffer it arrived in, so its bytes are never copied.
+  ///
+  /// @param val     The client's bytes
+  /// @param expires The pair's expiry, or 0
+  KVTableEntry pack(slab_vec &&val, uint64_t expires) {
+    size_t n = val.size();
+    if (n > chunk_list::CHUNK || (compress_min != 0 && n >= compress_min) ||
+        (dedup_min != 0 && n >= dedup_min))
+      return pack(val.data(), n, expires);
+    return {allocate_shared<slab_vec>(slab_allocator<slab_vec>(), std::move(val)),
+            expires};
+  }
+
+  /// Report the number of bytes a client sent, in either form
+  ///
+  /// @param val The client's bytes
+  static size_t input_size(const vec &val) { return val.size(); }
+  static size_t input_size(const slab_vec &val) { return val.size(); }
+
+  /// Build a stored value that refers to a blob
+  ///
+  /// @param b       The blob
+  /// @param expires The pair's expiry, or 0
+  static KVTableEntry from_blob(const shared_ptr<const BlobStore::blob_t> &b,
+                                uint64_t expires) {
+    return {shared_vec(b, &b->bytes), expires, b->raw_size, b.get()};
+  }
+
+  /// Report the number of bytes of a stored value that belong to its pair
+  /// alone (a shared blob is counted once, by the BlobStore)
+  ///
+  /// @param e The stored value
+  static size_t stored_size(const KVTableEntry &e) {
+    if (e.chunks != nullptr)
+      return e.chunks->size();
+    return e.blob != nullptr ? 0 : e.value->size();
+  }
+
+  /// Check if changes must be refused because the log has failed.  A change
+  /// that can't be logged is not applied, so that a client who gets
+  /// RES_ERR_SERVER can retry it, and so that a snapshot can clear the
+  /// failure (see GroupLog).
+  bool refusing() { return log.has_failed(); }
+
+  /// Report the approximate memory used by kv_store and its blobs, including
+  /// the values that kv_store has not yet freed because a lock-free reader
+  /// might still be copying them
+  size_t memory() {
+    return mem_used.load() + blobs.bytes() +
+           kv_store.retained([](const KVTableEntry &e) {
+             return stored_size(e) + PAIR_OVERHEAD;
+           });
+  }
+
+  /// Append the length and bytes of a value (with the compression bit) to a
+  /// buffer
+  ///
+  /// @param data     The buffer
+  /// @param bytes    The stored bytes
+  /// @param raw_size The length of the content, if bytes is compressed, or 0
+  template <typename T>
+  static void log_value(vec &data, const T &bytes, uint32_t raw_size) {
+    if (raw_size != 0) {
+      vec_append(data, (int)(bytes.size() | COMPRESSED));
+      vec_append(data, (int)(raw_size));
+    } else {
+      vec_append(data, (int)(bytes.size()));
+    }
+    data.insert(data.end(), bytes.begin(), bytes.end());
+  }
+
+  /// Append the BLOBBLOB record for a blob to a buffer
+  ///
+  /// @param data The buffer
+  /// @param b    The blob
+  static void log_blob_record(vec &data, const BlobStore::blob_t &b) {
+    vec_append(data, BLOBENTRY);
+    vec_append(data, (int)(b.digest.size()));
+    vec_append(data, b.digest);
+    log_value(data, b.bytes, b.raw_size);
+  }
+
+  /// Log records whose LSNs were reserved while a bucket lock was held, and
+  /// that are published once it has been released (see GroupLog::reserve())
+  typedef vector<pair<uint64_t, vec>> staged_t;
+
+  /// Reserve the LSN of a record, and keep the record to publish later
+  ///
+  /// @param st   The staged records
+  /// @param data The record, which is moved from
+  ///
+  /// @returns The record's LSN, or 0 if the record was empty
+  uint64_t stage(staged_t &st, vec &&data) {
+    if (data.empty())
+      return 0;
+    uint64_t lsn = log.reserve();
+    st.emplace_back(lsn, std::move(data));
+    return lsn;
+  }
+
+  /// Publish staged records.  This may block on a full log, so it must run
+  /// after every lock has been released.
+  ///
+  /// @param st The staged records, which are moved from
+  void publish(staged_t &st) {
+    for (auto &r : st)
+      log.publish(r.first, std::move(r.second));
+    st.clear();
+  }
+
+  /// Make sure that a stored value's blob (if it has one) is logged before
+  /// the records that refer to it.  The first thread to need a blob in the
+  /// current file reserves an LSN for it, while the others wait, so every
+  /// record that refers to the blob gets a later LSN.
+  ///
+  /// @param e  The stored value
+  /// @param st The staged records, to which the blob's record is added
+  void log_blob(const KVTableEntry &e, staged_t &st) {
+    if (e.blob == nullptr || e.blob->mark.load() == log_gen.load())
+      return;
+    lock_guard<mutex> g(e.blob->lock);
+    if (e.blob->mark.load() == log_gen.load())
+      return;
+    vec data;
+    log_blob_record(data, *e.blob);
+    stage(st, std::move(data));
+    e.blob->mark = log_gen.load();
+  }
+
+  /// Get the bytes of a stored value, decompressing or joining them if needed.
+  /// This should run after every lock is released.
+  ///
+  /// @param e The stored value
+  ///
+  /// @returns The client's bytes (empty, if compressed bytes are corrupt)
+  static shared_vec unpack(const KVTableEntry &e) {
+    if (e.chunks != nullptr) {
+      auto out = allocate_shared<slab_vec>(slab_allocator<slab_vec>());
+      out->reserve(e.chunks->size());
+      e.chunks->for_each([&](const slab_vec &c) {
+        out->insert(out->end(), c.begin(), c.end());
+      });
+      return out;
+    }
+    if (e.raw_size == 0)
+      return e.value;
+    auto out = allocate_shared<slab_vec>(slab_allocator<slab_vec>(), e.raw_size);
+    uLongf len = e.raw_size;
+    if (uncompress(out->data(), &len, e.value->data(), e.value->size()) != Z_OK)
+      out->clear();
+    return out;
+  }
+
+  /// Report the number of bytes a value has when it is sent to a client
+  ///
+  /// @param e The stored value
+  static size_t raw_size(const KVTableEntry &e) {
+    if (e.chunks != nullptr)
+      return e.chunks->size();
+    return e.raw_size != 0 ? e.raw_size : e.value->size();
+  }
+
+  /// Append a range of a stored value's bytes to a buffer.  Only the chunks
+  /// that hold the range are copied, and a compressed value is only inflated
+  /// as far as the end of the range.  This should run after every lock is
+  /// released.
+  ///
+  /// @param e   The stored value
+  /// @param off The offset of the first byte
+  /// @param len The number of bytes (off + len must be at most raw_size(e))
+  /// @param out The buffer
+  static void read_range(const KVTableEntry &e, size_t off, size_t len,
+                         vec &out) {
+    if (len == 0)
+      return;
+    if (e.chunks != nullptr) {
+      e.chunks->read(off, len, out);
+    } else if (e.raw_size == 0) {
+      out.insert(out.end(), e.value->begin() + off, e.value->begin() + off + len);
+    } else {
+      vec buf(off + len);
+      z_stream z = {};
+      z.next_in = const_cast<Bytef *>(e.value->data());
+      z.avail_in = e.value->size();
+      z.next_out = buf.data();
+      z.avail_out = buf.size();
+      if (inflateInit(&z) == Z_OK) {
+        inflate(&z, Z_FINISH);
+        inflateEnd(&z);
+      }
+      size_t got = buf.size() - z.avail_out;
+      if (got > off)
+        out.insert(out.end(), buf.begin() + off, buf.begin() + got);
+    }
+  }
+
+  /// Build the value that results from appending bytes to a stored value.  A
+  /// result that fits in one chunk stays flat; a longer one is chunked, so
+  /// that each later append only copies its last chunk.  A compressed or
+  /// shared value is decoded first, and the result is neither.  This runs
+  /// before any lock is taken.
+  ///
+  /// @param e     The stored value
+  /// @param begin The first byte to append
+  /// @param end   The byte after the last byte to append
+  static KVTableEntry appended(const KVTableEntry &e, const unsigned char *begin,
+                               const unsigned char *end) {
+    KVTableEntry r;
+    r.expires = e.expires;
+    if (e.chunks != nullptr) {
+      r.chunks = e.chunks->append(begin, end);
+      return r;
+    }
+    shared_vec old = unpack(e);
+    size_t len = old->size() + (end - begin);
+    if (len <= chunk_list::CHUNK) {
+      auto v = allocate_shared<slab_vec>(slab_allocator<slab_vec>());
+      v->reserve(len);
+      v->insert(v->end(), old->begin(), old->end());
+      v->insert(v->end(), begin, end);
+      r.value = v;
+    } else {
+      r.chunks = chunk_list::make(old->data(), old->data() + old->size())
+                     ->append(begin, end);
+    }
+    return r;
+  }
+
+  /// Append the record for a new or changed pair to a log buffer.  A pair that
+  /// expires gets a KVEXPIRE record, whatever the magic.  A compressed value
+  /// is written compressed, a shared one as a reference to its blob, and a
+  /// chunked one as its bytes, joined.
+  ///
+  /// @param data  The buffer
+  /// @param magic KVENTRY or KVUPDATE
+  /// @param key   The key
+  /// @param e     The stored value
+  static void log_pair(vec &data, const string &magic, string_view key,
+                       const KVTableEntry &e) {
+    vec_append(data, e.expires != 0 ? KVEXPIRE : magic);
+    vec_append(data, (int)(key.size()));
+    data.insert(data.end(), key.begin(), key.end());
+    if (e.expires != 0) {
+      auto *x = reinterpret_cast<const unsigned char *>(&e.expires);
+      data.insert(data.end(), x, x + sizeof(e.expires));
+    }
+    if (e.blob != nullptr) {
+      vec_append(data, (int)(e.blob->digest.size() | REFERENCE));
+      vec_append(data, e.blob->digest);
+    } else if (e.chunks != nullptr) {
+      vec_append(data, (int)(e.chunks->size()));
+      e.chunks->for_each([&](const slab_vec &c) {
+        data.insert(data.end(), c.begin(), c.end());
+      });
+    } else {
+      log_value(data, *e.value, e.raw_size);
+    }
+  }
+
+  /// Find the end of a length-prefixed field of a file's contents
+  ///
+  /// @param data The file's contents
+  /// @param size The number of bytes in the file
+  /// @param i    The offset of the field's 4-byte length, or 0 if an earlier
+  ///             field was bad
+  ///
+  /// @returns The offset just past the field, or 0 if it runs past the end
+  static size_t field_end(const unsigned char *data, size_t size, size_t i) {
+    uint32_t len;
+    if (i == 0 || size - i < sizeof(len))
+      return 0;
+    memcpy(&len, data + i, sizeof(len));
+    i += sizeof(len);
+    return size - i >= len ? i + len : 0;
+  }
+
+  /// Find the end of a persisted value (see log_value() and log_pair())
+  ///
+  /// @param data The file's contents
+  /// @param size The number of bytes in the file
+  /// @param i    The offset of the value's length, or 0 if an earlier field
+  ///             was bad
+  ///
+  /// @returns The offset just past the value, or 0 if it runs past the end
+  static size_t value_end(const unsigned char *data, size_t size, size_t i) {
+    uint32_t len;
+    if (i == 0 || size - i < sizeof(len))
+      return 0;
+    memcpy(&len, data + i, sizeof(len));
+    i += sizeof(len);
+    if (len & REFERENCE) {
+      len &= ~REFERENCE;
+    } else if (len & COMPRESSED) {
+      len &= ~COMPRESSED;
+      if (size - i < sizeof(uint32_t))
+        return 0;
+      i += sizeof(uint32_t);
+    }
+    return size - i >= len ? i + len : 0;
+  }
+
+  /// Find the end of the record at an offset of a file's contents, checking
+  /// that all of the record is in the file
+  ///
+  /// @param data The file's contents
+  /// @param size The number of bytes in the file
+  /// @param i    The offset of the record's magic
+  ///
+  /// @returns The offset just past the record, or 0 if the record is unknown
+  ///          or runs past the end of the file
+  static size_t record_end(const unsigned char *data, size_t size, size_t i) {
+    if (size - i < 8)
+      return 0;
+    string_view magic(reinterpret_cast<const char *>(data) + i, 8);
+    i += 8;
+    if (magic == AUTHENTRY)
+      return field_end(data, size, field_end(data, size, field_end(data, size, i)));
+    if (magic == AUTHDIFF || magic == KVAPPEND)
+      return field_end(data, size, field_end(data, size, i));
+    if (magic == KVDELETE)
+      return field_end(data, size, i);
+    if (magic == KVENTRY || magic == KVUPDATE || magic == BLOBENTRY)
+      return value_end(data, size, field_end(data, size, i));
+    if (magic == KVEXPIRE) {
+      i = field_end(data, size, i);
+      if (i == 0 || size - i < sizeof(uint64_t))
+        return 0;
+      return value_end(data, size, i + sizeof(uint64_t));
+    }
+    return 0;
+  }
+
+  /// Get a view of a length-prefixed field of a file's contents, which
+  /// record_end() has checked
+  ///
+  /// @param data The file's contents
+  /// @param i    The offset of the field's 4-byte length
+  static string_view field(const unsigned char *data, size_t i) {
+    uint32_t len;
+    memcpy(&len, data + i, sizeof(len));
+    return string_view(reinterpret_cast<const char *>(data) + i + sizeof(len), len);
+  }
+
+  /// Read the value of a K/V record from a file's contents, without
+  /// decompressing it.  A long uncompressed value is split into chunks.  A
+  /// reference is resolved against the blobs that load() has read; if there
+  /// is no such blob, e->value is left nullptr.
+  ///
+  /// @param data The file's contents
+  /// @param i    The offset of the value's length
+  /// @param e    The entry in which to put the value, or nullptr to skip it
+  ///
+  /// @returns The offset just past the value
+  size_t read_value(const unsigned char *data, size_t i, KVTableEntry *e) {
+    uint32_t len, raw = 0;
+    memcpy(&len, data + i, sizeof(len));
+    i += sizeof(len);
+    if (len & REFERENCE) {
+      len &= ~REFERENCE;
+      if (e != nullptr) {
+        auto b = loading.find(string_view(reinterpret_cast<const char *>(data) + i, len));
+        if (b != loading.end())
+          *e = from_blob(b->second, 0);
+      }
+      return i + len;
+    }
+    if (len & COMPRESSED) {
+      len &= ~COMPRESSED;
+      memcpy(&raw, data + i, sizeof(raw));
+      i += sizeof(raw);
+    }
+    if (e != nullptr && raw == 0 && len > chunk_list::CHUNK) {
+      e->chunks = chunk_list::make(data + i, data + i + len);
+    } else if (e != nullptr) {
+      e->value = make_shared_vec(data + i, data + i + len);
+      e->raw_size = raw;
+    }
+    return i + len;
+  }
+
+  /// Read a BLOBBLOB record of a file's contents into the blob store
+  ///
+  /// @param data The file's contents
+  /// @param i    The offset of the record's magic
+  ///
+  /// @returns The blob's digest (a view into data) and the blob
+  pair<string_view, shared_ptr<const BlobStore::blob_t>>
+  read_blob(const unsigned char *data, size_t i) {
+    string_view digest = field(data, i + 8);
+    KVTableEntry entry;
+    read_value(data, i + 12 + digest.size(), &entry);
+    shared_vec bytes = entry.chunks ? unpack(entry) : entry.value;
+    auto b = blobs.insert(string(digest), bytes->data(), bytes->data() + bytes->size(), entry.raw_size);
+    b->mark = log_gen.load();
+    return {digest, b};
+  }
+
+  /// Replay a K/V record of a file's contents into kv_store.  Records for the
+  /// same key must be replayed in file order, by one thread.
+  ///
+  /// @param data The file's contents
+  /// @param i    The offset of the record's magic
+  /// @param now  The time at which the load began
+  ///
+  /// @returns false if the record refers to a blob that is not in the file
+  bool apply_record(const unsigned char *data, size_t i, uint64_t now) {
+    string_view magic(reinterpret_cast<const char *>(data) + i, 8);
+    string_view key = field(data, i + 8);
+    i += 12 + key.size();
+    if (magic == KVDELETE) {
+      kv_store.remove(key, [](){});
+    } else if (magic == KVAPPEND) {
+      string_view more = field(data, i);
+      auto *bytes = reinterpret_cast<const unsigned char *>(more.data());
+      kv_store.do_with(key, [&](KVTableEntry &entry) {
+        entry = appended(entry, bytes, bytes + more.size());
+      });
+    } else {
+      uint64_t expires = 0;
+      if (magic == KVEXPIRE) {
+        memcpy(&expires, data + i, sizeof(expires));
+        i += sizeof(expires);
+        // A dead record still replaces the key's older value, but its own
+        // value is never built
+        if (expires <= now) {
+          kv_store.remove(key, [](){});
+          return true;
+        }
+      }
+      KVTableEntry entry;
+      read_value(data, i, &entry);
+      if (!entry.has_value())
+        return false;
+      entry.expires = expires;
+      if (magic == KVENTRY)
+        kv_store.insert(key, move(entry), [](){});
+      else
+        kv_store.upsert(key, move(entry), [](){}, [](const KVTableEntry &){});
+    }
+    return true;
+  }
+
+  /// Account for a pair that was removed from kv_store: drop the key from the
+  /// MRU and the index, stop counting its memory, and append a KVDELETE record
+  /// to a log buffer
+  ///
+  /// @param key  The key
+  /// @param old  The pair's value
+  /// @param data The buffer
+  void forget(string_view key, const KVTableEntry &old, vec &data) {
+    mem_used -= footprint(key.size(), stored_size(old));
+    mru.remove(string(key));
+    index_remove(key);
+    vec_append(data, KVDELETE);
+    vec_append(data, (int)(key.size()));
+    data.insert(data.end(), key.begin(), key.end());
+  }
+
+  /// Remove a key if its pair has expired.  The removal is logged as a
+  /// KVDELETE while the key's bucket is locked.
+  ///
+  /// @param key The key
+  ///
+  /// @returns true if an expired pair was removed
+  bool expire(string_view key) {
+    uint64_t now = now_ms();
+    staged_t st;
+    bool removed = kv_store.remove_if(key, [&](const KVTableEntry &e) {
+      return expired(e, now);
+    }, [&](const KVTableEntry &old) {
+      vec data;
+      forget(key, old, data);
+      stage(st, std::move(data));
+    });
+    publish(st);
+    return removed;
+  }
+
+  /// Put a key in the expiry wheel, if its pair expires
+  ///
+  /// @param key     The key
+  /// @param expires The pair's expiry, or 0
+  void schedule(string_view key, uint64_t expires) {
+    if (expires != 0)
+      expiries.schedule(expires, string(key));
+  }
+
+  /// The reaper's loop: once per tick, turn the wheel and expire the keys that
+  /// come due.  No part of the table is scanned.
+  void reap() {
+    unique_lock<mutex> g(reaper_lock);
+    while (!stopping) {
+      reaper_cv.wait_for(g, chrono::milliseconds(EXPIRY_TICK));
+      if (stopping)
+        break;
+      g.unlock();
+      // While the log has failed, expiries wait in the wheel, so that no
+      // removal is lost from the file (see refusing())
+      if (!refusing())
+        expiries.advance(now_ms(), [&](string &&key) { expire(key); });
+      maybe_compact();
+      g.lock();
+    }
+  }
+
+  /// Estimate the bytes that a snapshot of kv_store would take, from the
+  /// memory that its pairs use
+  size_t live_bytes() {
+    size_t over = kv_store.size() * (PAIR_OVERHEAD - RECORD_OVERHEAD);
+    size_t used = mem_used.load() + blobs.bytes();
+    return used > over ? used - over : 0;
+  }
+
+  /// Start a background snapshot if too much of the file is garbage (records
+  /// that later ones replaced), or if it has grown too much since the last
+  /// snapshot.  Either way, the snapshot bounds the time that the next load()
+  /// takes to replay the file.  Live bytes are an estimate, so a file must
+  /// grow a little after a snapshot before its garbage is measured again.
+  ///
+  /// When compaction is on and the log has failed, this starts a snapshot
+  /// every time, since a snapshot that succeeds is what clears the failure.
+  void maybe_compact() {
+    if ((compact_pct != 0 || compact_growth != 0) && refusing()) {
+      start_snapshot();
+      return;
+    }
+    uint64_t total = log.size(), base = log_base.load();
+    if (total == 0)
+      return;
+    bool grown = compact_growth != 0 && total >= base + compact_growth;
+    bool garbage = compact_pct != 0 && total >= COMPACT_MIN &&
+                   total > base + COMPACT_MIN / 16 &&
+                   (total - min<uint64_t>(total, live_bytes())) * 100 >=
+                       total * compact_pct;
+    if (grown || garbage)
+      start_snapshot();
+  }
+
+  /// Estimate the memory used by a pair
+  ///
+  /// @param key_len The length of the key
+  /// @param val_len The length of the value
+  static size_t footprint(size_t key_len, size_t val_len) {
+    return key_len + val_len + PAIR_OVERHEAD;
+  }
+
+  /// If kv_store is over its memory limit, evict cold pairs until it is under
+  /// the limit by 1/16th, so that eviction doesn't run on every write.  Each
+  /// eviction is logged as a KVDELETE while the pair's bucket is locked, so
+  /// that it is ordered correctly with other changes to the key.  If another
+  /// thread is already evicting, this returns right away.
+  void enforce_limit() {
+    if (mem_limit == 0 || memory() <= mem_limit || refusing())
+      return;
+    unique_lock<mutex> g(evicting, try_to_lock);
+    if (!g)
+      return;
+    size_t goal = mem_limit - mem_limit / 16;
+    for (size_t used = memory(); used > goal; used = memory()) {
+      // Aim for as many pairs as the excess holds, at the average pair size
+      size_t pairs = max((size_t)1, kv_store.size());
+      size_t avg = max((size_t)1, used / pairs);
+      size_t target = (used - goal) / avg + 1;
+      staged_t st;
+      size_t evicted = kv_store.evict(target, [&](string_view key, const KVTableEntry &val){
+        vec data;
+        forget(key, val, data);
+        stage(st, std::move(data));
+      });
+      publish(st);
+      if (evicted == 0)
+        return;
+    }
+  }
+
+  /// Add a key to the ordered index, if there is one
+  ///
+  /// @param key The key that was inserted into kv_store
+  void index_insert(string_view key) {
+    if (key_index)
+      key_index->insert(key);
+  }
+
+  /// Remove a key from the ordered index, if there is one
+  ///
+  /// @param key The key that was removed from kv_store
+  void index_remove(string_view key) {
+    if (key_index)
+      key_index->remove(key);
+  }
 };
 
+/// Hash a password, for storing in or comparing against the auth table
+///
+/// @param pass The password to hash
+///
+/// @returns The MD5 digest of the password's bytes
+static string hash_pass(string_view pass) {
+  unsigned char md5_digest[MD5_DIGEST_LENGTH];
+  MD5(reinterpret_cast<const unsigned char *>(pass.data()), pass.size(),
+      md5_digest);
+  return string(reinterpret_cast<char *>(md5_digest), MD5_DIGEST_LENGTH);
+}
+
+/// Append the bytes of a string_view to the end of a vector
+///
+/// @param v The vector to which we will append
+/// @param s The characters to append to the end of the vector
+static void vec_append_view(vec &v, string_view s) {
+  v.insert(v.end(), s.begin(), s.end());
+}
+
+/// Concatenate per-partition results, in partition order
+///
+/// @param out   The vector to which the results are appended
+/// @param parts The per-partition results
+static void merge_parts(vec &out, const vector<vec> &parts) {
+  for (const auto &p : parts)
+    out.insert(out.end(), p.begin(), p.end());
+}
+
 /// Construct an empty object and specify the file from which it should be
 /// loaded.  To avoid exceptions and errors in the constructor, the act of
 /// loading data is separate from construction.
@@ -109,9 +1110,23 @@ struct Storage::Internal {
 /// @param fname       The name of the file that should be used to load/store
 ///                    the data
 /// @param num_buckets The number of buckets for the hash
+/// @param key_index   Should an ordered index of the keys be kept?
+/// @param mem_limit   The memory limit for the kv_store, in bytes, or 0
+/// @param compress_min The smallest value to compress, in bytes, or 0
+/// @param dedup_min   The smallest value to share, in bytes, or 0
+/// @param log_sync    The log's sync policy: GroupLog::OS_BUFFERED,
+///                    GroupLog::EVERY_COMMIT, or milliseconds between syncs
+/// @param compact_pct The percent of the file that is garbage when it is
+///                    compacted, or 0
+/// @param compact_growth The bytes that the file grows after a snapshot before
+///                    it is compacted, or 0
 Storage::Storage(const string &fname, size_t num_buckets, size_t upq,
-                 size_t dnq, size_t rqq, double qd, size_t top)
-    : fields(new Internal(fname, num_buckets, upq, dnq, rqq, qd, top)) {}
+                 size_t dnq, size_t rqq, double qd, size_t top, bool key_index,
+                 size_t mem_limit, size_t compress_min, size_t dedup_min,
+                 int log_sync, size_t compact_pct, size_t compact_growth)
+    : fields(new Internal(fname, num_buckets, upq, dnq, rqq, qd, top,
+                          key_index, mem_limit, compress_min, dedup_min,
+                          log_sync, compact_pct, compact_growth)) {}
 
 /// Destructor for the storage object.
 ///
@@ -131,145 +1146,100 @@ bool Storage::load() {
   // TODO: loading a file should always clear the MRU, if it wasn't already
   // clear
 
-  this->fields->f_ptr = fopen(fields->filename.c_str(), "r");
-  if (this->fields->f_ptr == nullptr) {
+  mapped_file file(fields->filename);
+  if (!file.exists()) {
     cerr << "File not found: " << fields->filename << endl;
-    this->fields->f_ptr = fopen(fields->filename.c_str(), "w");
+    this->fields->log.open(fields->filename);
     return true;
   }
+  if (file.error())
+    return false;
   this->fields->mru.clear();
+  this->fields->expiries.clear(Storage::Internal::now_ms());
   this->fields->auth_table.clear();
   this->fields->kv_store.clear();
-  vec data = load_entire_file(this->fields->filename);
-  if(!data.size()) {
+  if (this->fields->key_index)
+    this->fields->key_index->clear();
+  if(!file.size()) {
+    this->fields->log.open(fields->filename);
     return true;
   }
-  size_t i = 0;
-  //cout << "parsing data of size " << data.size() << endl;
-  while(i < data.size()) {
-    //std::cout << "load: in while, i = " << i << ".\n";
-    string magic(reinterpret_cast<char*>(data.data()) + i, 8);
-    //cout << "magic = '" << magic << "'.\n";
-    if(!magic.compare(Storage::Internal::AUTHENTRY)) {
-      //handle authtable entry
-      i += 8;
-      int *u_len = (int32_t*)(data.data() + i);
-      //cout << "u_len = " << *u_len << endl;
-      i += 4;
-      string user(reinterpret_cast<char*>(data.data()) + i, *u_len);
-      //cout << "user = " << user << endl;
-      i += *u_len;
-      int *p_len = (int32_t*)(data.data() + i);
-      //cout << "p_len = " << *p_len << endl;
-      i += 4;
-      string pass(reinterpret_cast<char*>(data.data()) + i, *p_len);
-      //cout << "pass = " << pass << endl;
-      i += *p_len;
-      int *c_len = (int32_t*)(data.data() + i);
-      //cout << "c_len = " << *c_len << endl;
-      i += 4;
-      string content;
-      if(*c_len) {
-        content.assign(reinterpret_cast<char*>(data.data()) + i, *c_len);
-        //cout << "content = " << content << endl;
-        i += *c_len;
-      }
-
-      quota_tracker *q1 = new quota_tracker(this->fields->up_quota, this->fields->quota_dur);
-      quota_tracker *q2 = new quota_tracker(this->fields->down_quota, this->fields->quota_dur);
-      quota_tracker *q3 = new quota_tracker(this->fields->req_quota, this->fields->quota_dur);
-
-      Storage::Internal::AuthTableEntry new_user = {user, pass, vec_from_string(content), *q1, *q2, *q3 };
-      this->fields->auth_table.insert(user.c_str(), new_user, [](){});
-
-    } else if(!magic.compare(Storage::Internal::KVENTRY)) {
-      //handle kv entry
-      i += 8;
-      int *k_len = (int32_t*)(data.data() + i);
-      //cout << "k_len = " << *k_len << endl;
-      i += 4;
-      string key(reinterpret_cast<char*>(data.data()) + i, *k_len);
-      //cout << "key = " << key << endl;
-      i += *k_len;
-      int *v_len = (int32_t*)(data.data() + i);
-      //cout << "v_len = " << *v_len << endl;
-      i += 4;
-      string value(reinterpret_cast<char*>(data.data()) + i, *v_len);
-      //cout << "value = " << value << endl;
-      i += *v_len;
-
-      this->fields->kv_store.insert(key, vec_from_string(value), [&](){});
-    } /// - KVUPDATE: when a key's value is changed via upsert
-      ///   - Magic 8-byte constant KVUPDATE
-      ///    - 4-byte binary write of the length of the key
-      ///    - Binary write of the bytes of the key
-      ///    - Binary write of the length of value
-      ///    - Binary write of the bytes of value
-    else if(!magic.compare(Storage::Internal::KVUPDATE)) {
-      //handle kv entry
-      i += 8;
-      int *k_len = (int32_t*)(data.data() + i);
-      //cout << "k_len = " << *k_len << endl;
-      i += 4;
-      string key(reinterpret_cast<char*>(data.data()) + i, *k_len);
-      //cout << "key = " << key << endl;
-      i += *k_len;
-      int *v_len = (int32_t*)(data.data() + i);
-      //cout << "v_len = " << *v_len << endl;
-      i += 4;
-      string value(reinterpret_cast<char*>(data.data()) + i, *v_len);
-      //cout << "value = " << value << endl;
-      i += *v_len;
-
-      this->fields->kv_store.upsert(key, vec_from_string(value), [&](){}, [&](){});
-    } /// - KVDELETE: when a key is removed from the key/value store
-      ///   - Magic 8-byte constant KVDELETE
-      ///    - 4-byte binary write of the length of the key
-      ///    - Binary write of the bytes of the key
-    else if(!magic.compare(Storage::Internal::KVDELETE)) {
-      //handle kv entry
-      i += 8;
-      int *k_len = (int32_t*)(data.data() + i);
-      //cout << "k_len = " << *k_len << endl;
-      i += 4;
-      string key(reinterpret_cast<char*>(data.data()) + i, *k_len);
-      //cout << "key = " << key << endl;
-      i += *k_len;
-
-      this->fields->kv_store.remove(key, [&](){});
-    } /// - AUTHDIFF: when a user's content changes in the Auth table
-      ///   - Magic 8-byte constant AUTHDIFF
-      ///   - 4-byte binary write of the length of the username
-      ///   - Binary write of the bytes of the username
-      ///   - Binary write of num_bytes of the content
-      ///   - If num_bytes > 0, a binary write of the bytes field
-    else if(!magic.compare(Storage::Internal::AUTHDIFF)) {
-      //handle kv entry
-      i += 8;
-      int *u_len = (int32_t*)(data.data() + i);
-      //cout << "u_len = " << *u_len << endl;
-      i += 4;
-      string user(reinterpret_cast<char*>(data.data()) + i, *u_len);
-      //cout << "user = " << user << endl;
-      i += *u_len;
-      int *c_len = (int32_t*)(data.data() + i);
-      //cout << "c_len = " << *c_len << endl;
-      i += 4;
-      string content;
-      if(*c_len) {
-        content.assign(reinterpret_cast<char*>(data.data()) + i, *c_len);
-        //cout << "content = " << content << endl;
-        i += *c_len;
-      }
-      this->fields->auth_table.do_with(user, [&](Storage::Internal::AuthTableEntry &entry){entry.content = vec_from_string(content);});
-    } else if (i < data.size()) {
-      //unknown magic bytes 
+  const unsigned char *data = file.data();
+  size_t size = file.size();
+  // The first pass only hops from record to record.  Auth records are few, so
+  // they are applied right away.  K/V records are split by key, so that each
+  // worker sees every record for its keys, in file order.
+  size_t parts = scan_parts();
+  vector<vector<size_t>> kv_records(parts);
+  vector<size_t> blob_records;
+  for (size_t i = 0; i < size;) {
+    size_t next = Storage::Internal::record_end(data, size, i);
+    if (next == 0)
       return false;
+    string_view magic(reinterpret_cast<const char *>(data) + i, 8);
+    if (magic == Storage::Internal::AUTHENTRY) {
+      string_view user = Storage::Internal::field(data, i + 8);
+      string_view pass = Storage::Internal::field(data, i + 12 + user.size());
+      string_view content = Storage::Internal::field(data, i + 16 + user.size() + pass.size());
+      Storage::Internal::AuthTableEntry new_user = {string(user), string(pass), vec(content.begin(), content.end()),
+        quota_tracker(this->fields->up_quota, this->fields->quota_dur), quota_tracker(this->fields->down_quota, this->fields->quota_dur),
+        quota_tracker(this->fields->req_quota, this->fields->quota_dur)};
+      this->fields->auth_table.insert(user, new_user, [](){});
+    } else if (magic == Storage::Internal::AUTHDIFF) {
+      string_view user = Storage::Internal::field(data, i + 8);
+      string_view content = Storage::Internal::field(data, i + 12 + user.size());
+      this->fields->auth_table.do_with(user, [&](Storage::Internal::AuthTableEntry &entry){entry.content.assign(content.begin(), content.end());});
+    } else if (magic == Storage::Internal::BLOBENTRY) {
+      blob_records.push_back(i);
+    } else {
+      string_view key = Storage::Internal::field(data, i + 8);
+      kv_records[hash<string_view>()(key) % parts].push_back(i);
     }
+    i = next;
   }
+  // Every blob is loaded before any pair, so that every reference resolves
+  vector<vector<pair<string_view, shared_ptr<const BlobStore::blob_t>>>> blob_parts(parts);
+  vector<thread> workers;
+  for (size_t p = 0; p < parts; ++p)
+    workers.emplace_back([&, p]() {
+      for (size_t j = p; j < blob_records.size(); j += parts)
+        blob_parts[p].push_back(this->fields->read_blob(data, blob_records[j]));
+    });
+  for (auto &w : workers)
+    w.join();
+  for (auto &bp : blob_parts)
+    for (auto &b : bp)
+      this->fields->loading[b.first] = move(b.second);
+  workers.clear();
+  uint64_t now = Storage::Internal::now_ms();
+  atomic<bool> ok(true);
+  for (size_t p = 0; p < parts; ++p)
+    workers.emplace_back([&, p]() {
+      for (size_t i : kv_records[p])
+        if (!this->fields->apply_record(data, i, now)) {
+          ok = false;
+          return;
+        }
+    });
+  for (auto &w : workers)
+    w.join();
+  // Blobs that no key refers to any more die here
+  this->fields->loading.clear();
+  if (!ok)
+    return false;
+  // Build the key index, the memory count, and the expiry wheel once, from
+  // the final contents of the table, rather than replaying every insert and
+  // delete into them
+  this->fields->mem_used = 0;
+  this->fields->kv_store.do_all_readonly([&](string_view key, const Storage::Internal::KVTableEntry &val){
+    if (this->fields->key_index)
+      this->fields->key_index->insert(key);
+    this->fields->mem_used += Storage::Internal::footprint(key.size(), Storage::Internal::stored_size(val));
+    this->fields->schedule(key, val.expires);
+  }, [](){});
   cerr << "Loaded: " << this->fields->filename << "\n";
-  fclose(this->fields->f_ptr);
-  this->fields->f_ptr = fopen(fields->filename.c_str(), "a+");
+  this->fields->log.open(fields->filename);
+  this->fields->enforce_limit();
   return true;
 }
 
@@ -280,31 +1250,34 @@ bool Storage::load() {
 /// @param user_name The user name to register
 /// @param pass      The password to associate with that user name
 ///
-/// @returns False if the username already exists, true otherwise
+/// @returns False if the username already exists, or if the new user could
+///          not be written to the file, true otherwise
 bool Storage::add_user(const string &user_name, const string &pass) {
-  unsigned char md5_digest[MD5_DIGEST_LENGTH];
-  unsigned char* hashed = MD5((unsigned char*)&pass, pass.length(), (unsigned char*)&md5_digest);
-  const char* hashed_pass = reinterpret_cast<const char*>(hashed);
+  if (this->fields->refusing())
+    return false;
+  string hashed_pass = hash_pass(pass);
   //vec empty;
   Storage::Internal::AuthTableEntry new_user = {user_name, hashed_pass, vec(), quota_tracker(this->fields->up_quota, this->fields->quota_dur),
   quota_tracker(this->fields->down_quota, this->fields->quota_dur), quota_tracker(this->fields->req_quota, this->fields->quota_dur)};
   /*new_user.username = user_name;
   new_user.pass_hash = hashed_pass;*/
   vec data;
+  Storage::Internal::staged_t staged;
+  uint64_t ticket = 0;
   bool result = this->fields->auth_table.insert(user_name, new_user, [&]() {
     vec_append(data, Storage::Internal::AUTHENTRY);
     vec_append(data, (int)(new_user.username.size()));
     vec_append(data, new_user.username);
-    vec_append(data, (int)16);
-    vec hash(hashed_pass, hashed_pass + 16);
-    //vec_append(data, (int)new_user.pass_hash.size()); //why doesn't this work? (it works for persist)
-    //vec_append(data, new_user.pass_hash); // ^^ 
-    vec_append(data, hash);
+    vec_append(data, (int)new_user.pass_hash.size());
+    vec_append(data, new_user.pass_hash);
     vec_append(data, (int)new_user.content.size());
-    fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-    fflush(this->fields->f_ptr);
+    ticket = this->fields->stage(staged, std::move(data));
   });
+  this->fields->publish(staged);
   //std::cout << "add_user: result of insert = " << (bool)result << std::endl;
+  // A user who can't be persisted is reported as a failure
+  if (!this->fields->log.wait(ticket))
+    return false;
   return result;
 }
 
@@ -324,7 +1297,11 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
     //std::cerr << "error_check: authentication failed.\n"; 
     return vec_from_string(RES_ERR_LOGIN);
   }
+  if (this->fields->refusing())
+    return vec_from_string(RES_ERR_SERVER);
   vec data;
+  Storage::Internal::staged_t staged;
+  uint64_t ticket = 0;
   this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry) { 
     entry.content = content;
     vec_append(data, Storage::Internal::AUTHDIFF);
@@ -334,10 +1311,12 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
     if(content.size() > 0) {
       vec_append(data, content);
     }
-    fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-    fflush(this->fields->f_ptr);
+    ticket = this->fields->stage(staged, std::move(data));
   });
+  this->fields->publish(staged);
   //std::cout << "set_user_data: " << user_name << "'s content set to: " << reinterpret_cast<const char*>(content.data()) << std::endl;
+  if (!this->fields->log.wait(ticket))
+    return vec_from_string(RES_ERR_SERVER);
   return vec_from_string(RES_OK);
 }
 
@@ -387,10 +1366,11 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
     return {true, vec_from_string(RES_ERR_LOGIN)};
   }
   vec users;
-  this->fields->auth_table.do_all_readonly([&](const string user_name, const Storage::Internal::AuthTableEntry &entry) {
-    vec_append(users, user_name);
-    vec_append(users, '\n');
-  }, [](){});
+  vector<vec> parts(scan_parts());
+  this->fields->auth_table.snapshot_parallel(parts.size(), [&](size_t p, string_view user_name, const Storage::Internal::AuthTableEntry &entry) {
+    vec_append_view(parts[p], user_name);
+    vec_append(parts[p], '\n');
+  }, [&](){ merge_parts(users, parts); });
   return {false, users};
 }
 
@@ -401,19 +1381,21 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
 ///
 /// @returns True if the user and password are valid, false otherwise
 bool Storage::auth(const string &user_name, const string &pass) {
-  //std::cout << "auth: entered.\n";
-  //Storage::Internal::AuthTableEntry check;
-  unsigned char md5_digest[MD5_DIGEST_LENGTH];
-  unsigned char* hashed = MD5((unsigned char*)&pass, pass.length(), (unsigned char*)&md5_digest);
-  const char* hashed_pass;
-  hashed_pass = reinterpret_cast<const char*>(hashed);
-  //check.pass_hash = hashed_pass;
+  return auth(string_view(user_name), string_view(pass));
+}
+
+/// Authenticate a user, given views of the user name and password
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+///
+/// @returns True if the user and password are valid, false otherwise
+bool Storage::auth(string_view user_name, string_view pass) {
+  string hashed_pass = hash_pass(pass);
   bool authenticated = false;
-  //std::cout << "check.hashed_pass: " << hashed_pass << endl;
-  function check_func = [&](Storage::Internal::AuthTableEntry &entry){ 
-    if(entry.pass_hash.compare(hashed_pass)) authenticated = true;
-  };
-  this->fields->auth_table.do_with(user_name, check_func);
+  this->fields->auth_table.do_with_readonly(user_name, [&](const Storage::Internal::AuthTableEntry &entry){
+    authenticated = (entry.pass_hash == hashed_pass);
+  });
   return authenticated;
 }
 
@@ -422,31 +1404,32 @@ bool Storage::auth(const string &user_name, const string &pass) {
 /// must be written to a temporary file (this.filename.tmp).  Then the
 /// temporary file can be renamed to replace the older version of the Storage
 /// object.
-void Storage::persist() {
-  fclose(this->fields->f_ptr);
-  vec data = {};
-  this->fields->auth_table.do_all_readonly([&](const string user_name, const Storage::Internal::AuthTableEntry &entry){
-    vec_append(data, Storage::Internal::AUTHENTRY);
-    vec_append(data, (int)(entry.username.size()));
-    vec_append(data, entry.username);
-    vec_append(data, (int)(entry.pass_hash.size()));
-    vec_append(data, entry.pass_hash);
-    vec_append(data, (int)(entry.content.size()));
-    if(entry.content.size() > 0) {
-      vec_append(data, entry.content);
-    }
-  }, [&](){
-    fields->kv_store.do_all_readonly([&](const string key2, const vec &value2) {
-      vec_append(data, Storage::Internal::KVENTRY);
-      vec_append(data, (int)(key2.size()));
-      vec_append(data, key2);
-      vec_append(data, (int)(value2.size()));
-      vec_append(data, value2);
-      write_file(this->fields->filename + ".tmp", reinterpret_cast<const char*>(data.data()), data.size());
-    }, [](){});
-  });
-  write_file(this->fields->filename + ".tmp", reinterpret_cast<const char*>(data.data()), data.size());
-  rename((this->fields->filename + ".tmp").c_str(), this->fields->filename.c_str());
+///
+/// The snapshot runs in the background, and requests keep being served while
+/// it does: this only starts it (unless one is already running).  It captures
+/// kv_store at one point in time, without holding the table's locks while it
+/// scans, and streams it to the temporary file.  Changes made after that point
+/// keep going to the old file, so it stays complete until the rename.  Once
+/// the snapshot is synced, those changes are copied after it, and the log
+/// switches to the new file as it is renamed into place.
+void Storage::persist() { this->fields->start_snapshot(); }
+
+/// Report on the background snapshot that persist() started most recently
+///
+/// @returns A pair with a bool that is true while the snapshot is running,
+///          and a vec with its progress: the pairs written (of about how many),
+///          the bytes written, and the seconds it has run (or took)
+pair<bool, vec> Storage::persist_status() {
+  Storage::Internal *f = this->fields.get();
+  lock_guard<mutex> g(f->snap_lock);
+  double secs = f->snap_running
+                    ? chrono::duration<double>(chrono::steady_clock::now() - f->snap_start).count()
+                    : f->snap_seconds;
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s %zu/%zu pairs, %zu bytes, %.3f s",
+           f->snap_running ? "running" : (f->snap_ok ? "done" : "failed"),
+           f->snap_pairs.load(), f->snap_total.load(), f->snap_bytes.load(), secs);
+  return {f->snap_running, vec_from_string(msg)};
 }
 
 /// Create a new key/value mapping in the table
@@ -459,51 +1442,93 @@ void Storage::persist() {
 /// @returns A vec with the result message
 vec Storage::kv_insert(const string &user_name, const string &pass,
                        const string &key, const vec &val) {
-  /*cerr << "fuck";
-  if (!auth(user_name, pass)) {
-    return vec_from_string(RES_ERR_LOGIN);
-  }
-  vec data;
-  //std::cerr << "passed auth in kv_insert";
-  if (!this->fields->kv_store.insert(key, val, [&](){
-    vec_append(data, Storage::Internal::KVENTRY);
-    vec_append(data, (int)(key.size()));
-    vec_append(data, key);
-    vec_append(data, (int)(val.size()));
-    vec_append(data, val);
-    fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-    fflush(this->fields->f_ptr);
-  })) return vec_from_string(RES_ERR_KEY);
-  return vec_from_string(RES_OK);*/
-  if (!auth(user_name, pass)) {
-    return vec_from_string(RES_ERR_LOGIN);
-  }
-  vec data;
-  vec res;
-  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
-    if(!entry.requests.check(1)) {
-      res = vec_from_string(RES_ERR_QUOTA_REQ);
-      return;
-    } else {
-      entry.requests.add(1);
+  return kv_insert(string_view(user_name), string_view(pass), string_view(key),
+                   val);
+}
+
+/// Create a new key/value mapping in the table, given views of the user name,
+/// password, and key
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being created
+/// @param val       The value to copy into the map
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message
+vec Storage::kv_insert(string_view user_name, string_view pass,
+                       string_view key, const vec &val, uint32_t ttl) {
+  return kv_insert_value(user_name, pass, key, val, ttl);
+}
+
+/// Create a new key/value mapping in the table, taking over the value's buffer
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being created
+/// @param val       The value to move into the map
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message
+vec Storage::kv_insert(string_view user_name, string_view pass,
+                       string_view key, slab_vec &&val, uint32_t ttl) {
+  return kv_insert_value(user_name, pass, key, std::move(val), ttl);
+}
+
+/// The body of the kv_insert() overloads
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being created
+/// @param val       The value, as a vec or a slab_vec to move from
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message
+template <typename V>
+vec Storage::kv_insert_value(string_view user_name, string_view pass,
+                             string_view key, V &&val, uint32_t ttl) {
+  if (!auth(user_name, pass)) {
+    return vec_from_string(RES_ERR_LOGIN);
+  }
+  if (this->fields->refusing())
+    return vec_from_string(RES_ERR_SERVER);
+  vec data;
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(1)) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+      return;
+    } else {
+      entry.requests.add(1);
     } 
-    if(!entry.uploads.check(val.size())) {
+    size_t len = Storage::Internal::input_size(val);
+    if(!entry.uploads.check(len)) {
       res = vec_from_string(RES_ERR_QUOTA_UP);
     } else {
-      entry.uploads.add(val.size());
+      entry.uploads.add(len);
     }
   });
   if(res.size()) return res;
-  if (!this->fields->kv_store.insert(key, val, [&](){
-    this->fields->mru.insert(key);
-    vec_append(data, Storage::Internal::KVENTRY);
-    vec_append(data, (int)(key.size()));
-    vec_append(data, key);
-    vec_append(data, (int)(val.size()));
-    vec_append(data, val);
-    fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-    fflush(this->fields->f_ptr);  
-  })) return vec_from_string(RES_ERR_KEY);
+  uint64_t expires = Storage::Internal::deadline(ttl);
+  Storage::Internal::KVTableEntry entry = this->fields->pack(std::forward<V>(val), expires);
+  // An expired pair does not block an insert: remove it, and try again
+  bool inserted;
+  Storage::Internal::staged_t staged;
+  uint64_t ticket = 0;
+  while (!(inserted = this->fields->kv_store.insert(key, entry, [&](){
+    this->fields->mru.insert(string(key));
+    this->fields->index_insert(key);
+    this->fields->mem_used += Storage::Internal::footprint(key.size(), Storage::Internal::stored_size(entry));
+    this->fields->log_blob(entry, staged);
+    Storage::Internal::log_pair(data, Storage::Internal::KVENTRY, key, entry);
+    ticket = this->fields->stage(staged, std::move(data));
+    this->fields->schedule(key, expires);
+  })) && this->fields->expire(key)) {}
+  this->fields->publish(staged);
+  if (!inserted) return vec_from_string(RES_ERR_KEY);
+  if (!this->fields->log.wait(ticket))
+    return vec_from_string(RES_ERR_SERVER);
+  this->fields->enforce_limit();
   return vec_from_string(RES_OK);
 };
 
@@ -518,40 +1543,212 @@ vec Storage::kv_insert(const string &user_name, const string &pass,
 ///          attempt.
 pair<bool, vec> Storage::kv_get(const string &user_name, const string &pass,
                                 const string &key) {
+  return kv_get(string_view(user_name), string_view(pass), string_view(key));
+}
+
+/// Get a copy of the value to which a key is mapped, given views of the user
+/// name, password, and key
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being fetched
+///
+/// @returns A pair with a bool to indicate error, and a vector indicating the
+///          data (possibly an error message) that is the result of the
+///          attempt.
+pair<bool, vec> Storage::kv_get(string_view user_name, string_view pass,
+                                string_view key) {
+  // The copy happens here, after every lock has been released
+  auto res = kv_get_chunks(user_name, pass, key);
+  vec out;
+  for (const auto &part : res.second)
+    out.insert(out.end(), part->begin(), part->end());
+  return {res.first, std::move(out)};
+};
+
+/// Get a reference to the value to which a key is mapped, without copying it
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being fetched
+///
+/// @returns A pair with a bool to indicate error, and the value (or, on
+///          error, the error message)
+pair<bool, shared_vec> Storage::kv_get_shared(string_view user_name,
+                                              string_view pass,
+                                              string_view key) {
+  auto res = kv_get_chunks(user_name, pass, key);
+  if (res.second.size() == 1)
+    return {res.first, res.second[0]};
+  auto out = allocate_shared<slab_vec>(slab_allocator<slab_vec>());
+  for (const auto &part : res.second)
+    out->insert(out->end(), part->begin(), part->end());
+  return {res.first, out};
+}
+
+/// Get references to the pieces of the value to which a key is mapped,
+/// without copying them
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being fetched
+///
+/// @returns A pair with a bool to indicate error, and the value's pieces (or,
+///          on error, one piece with the error message)
+pair<bool, vector<shared_vec>> Storage::kv_get_chunks(string_view user_name,
+                                                      string_view pass,
+                                                      string_view key) {
+  if (!auth(user_name, pass)) {
+    return {true, {make_shared_vec(vec_from_string(RES_ERR_LOGIN))}};
+  }
+  // One lookup, which only takes a reference to the value
+  Storage::Internal::KVTableEntry value;
+  uint64_t now = Storage::Internal::now_ms();
+  this->fields->kv_store.do_with_readonly(key, [&](const Storage::Internal::KVTableEntry &v){
+    if (!Storage::Internal::expired(v, now))
+      value = v;
+  });
+  bool found = value.has_value();
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(1)) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+      return;
+    }
+    entry.requests.add(1);
+    if(!found) {
+      res = vec_from_string(RES_ERR_KEY);
+    } else if(!entry.downloads.check(Storage::Internal::raw_size(value))) {
+      res = vec_from_string(RES_ERR_QUOTA_DOWN);
+    } else {
+      entry.downloads.add(Storage::Internal::raw_size(value));
+    }
+  });
+  if(res.size()) {
+    return {true, {make_shared_vec(res)}};
+  }
+  this->fields->mru.insert(string(key));
+  if (value.chunks)
+    return {false, value.chunks->parts()};
+  return {false, {Storage::Internal::unpack(value)}};
+}
+
+/// Get a copy of a range of the bytes of the value to which a key is mapped
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being fetched
+/// @param offset    The offset of the first byte to fetch
+/// @param len       The number of bytes to fetch
+///
+/// @returns A pair with a bool to indicate error, and a vector indicating the
+///          data (possibly an error message) that is the result of the
+///          attempt.
+pair<bool, vec> Storage::kv_get_range(string_view user_name, string_view pass,
+                                      string_view key, size_t offset,
+                                      size_t len) {
   if (!auth(user_name, pass)) {
     return {true, vec_from_string(RES_ERR_LOGIN)};
   }
-  vec data;
+  Storage::Internal::KVTableEntry value;
+  uint64_t now = Storage::Internal::now_ms();
+  this->fields->kv_store.do_with_readonly(key, [&](const Storage::Internal::KVTableEntry &v){
+    if (!Storage::Internal::expired(v, now))
+      value = v;
+  });
+  bool found = value.has_value();
+  size_t size = found ? Storage::Internal::raw_size(value) : 0;
+  size_t n = offset < size ? min(len, size - offset) : 0;
   vec res;
   this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
     if(!entry.requests.check(1)) {
       res = vec_from_string(RES_ERR_QUOTA_REQ);
+      return;
+    }
+    entry.requests.add(1);
+    if(!found) {
+      res = vec_from_string(RES_ERR_KEY);
+    } else if(!entry.downloads.check(n)) {
+      res = vec_from_string(RES_ERR_QUOTA_DOWN);
+    } else {
+      entry.downloads.add(n);
+    }
+  });
+  if(res.size()) return {true, res};
+  this->fields->mru.insert(string(key));
+  vec bytes;
+  Storage::Internal::read_range(value, offset, n, bytes);
+  return {false, bytes};
+}
+
+/// Append bytes to the value to which a key is mapped
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being extended
+/// @param val       The bytes to append
+///
+/// @returns A vec with the result message
+vec Storage::kv_append(string_view user_name, string_view pass,
+                       string_view key, const vec &val) {
+  if (!auth(user_name, pass)) {
+    return vec_from_string(RES_ERR_LOGIN);
+  }
+  if (this->fields->refusing())
+    return vec_from_string(RES_ERR_SERVER);
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(1)) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else if(!entry.uploads.check(val.size())) {
+      entry.requests.add(1);
+      res = vec_from_string(RES_ERR_QUOTA_UP);
     } else {
       entry.requests.add(1);
+      entry.uploads.add(val.size());
     }
-    if(!this->fields->kv_store.do_with(key, [&](const vec value) {
-      if(!entry.downloads.check(value.size())) {
-        res = vec_from_string(RES_ERR_QUOTA_DOWN);
-      } else {
-        entry.downloads.add(value.size());
-      }
-    })) res = vec_from_string(RES_ERR_KEY);
   });
-  if(!res.size()) {
-    if(!this->fields->kv_store.do_with_readonly(key, [&](const vec value){
-          this->fields->mru.insert(key);
-          vec_append(data, value);})
-      )
-    {
-      return {true, vec_from_string(RES_ERR_KEY)};
+  if(res.size()) return res;
+  // The new value is built without holding a lock, and is only swapped in if
+  // the key still has the value it was built from.  Otherwise, another write
+  // got there first, so try again.  Only the appended bytes are logged.
+  Storage::Internal::staged_t staged;
+  uint64_t ticket = 0;
+  for(bool done = false; !done;) {
+    Storage::Internal::KVTableEntry old;
+    uint64_t now = Storage::Internal::now_ms();
+    this->fields->kv_store.do_with_readonly(key, [&](const Storage::Internal::KVTableEntry &v){
+      if (!Storage::Internal::expired(v, now))
+        old = v;
+    });
+    if(!old.has_value()) return vec_from_string(RES_ERR_KEY);
+    if(Storage::Internal::raw_size(old) + val.size() > (size_t)LEN_VAL) {
+      return vec_from_string(RES_ERR_MSG_FMT);
     }
+    Storage::Internal::KVTableEntry entry = Storage::Internal::appended(old, val.data(), val.data() + val.size());
+    this->fields->kv_store.do_with(key, [&](Storage::Internal::KVTableEntry &cur){
+      if(cur.value != old.value || cur.chunks != old.chunks || cur.expires != old.expires)
+        return;
+      this->fields->mem_used += Storage::Internal::stored_size(entry);
+      this->fields->mem_used -= Storage::Internal::stored_size(cur);
+      vec data;
+      vec_append(data, Storage::Internal::KVAPPEND);
+      vec_append(data, (int)(key.size()));
+      vec_append_view(data, key);
+      vec_append(data, (int)(val.size()));
+      vec_append(data, val);
+      ticket = this->fields->stage(staged, std::move(data));
+      cur = entry;
+      done = true;
+    });
   }
-  //if(!data.size()) return {true, vec_from_string(RES_ERR_NO_DATA)};
-  if(res.size()) {
-    return {true, res};
-  }
-  return {false, data};
-};
+  this->fields->publish(staged);
+  if (!this->fields->log.wait(ticket))
+    return vec_from_string(RES_ERR_SERVER);
+  this->fields->mru.insert(string(key));
+  this->fields->enforce_limit();
+  return vec_from_string(RES_OK);
+}
 
 /// Delete a key/value mapping
 ///
@@ -562,10 +1759,24 @@ pair<bool, vec> Storage::kv_get(const string &user_name, const string &pass,
 /// @returns A vec with the result message
 vec Storage::kv_delete(const string &user_name, const string &pass,
                        const string &key) {
+  return kv_delete(string_view(user_name), string_view(pass), string_view(key));
+}
+
+/// Delete a key/value mapping, given views of the user name, password, and key
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose value is being deleted
+///
+/// @returns A vec with the result message
+vec Storage::kv_delete(string_view user_name, string_view pass,
+                       string_view key) {
   vec data;
   if (!auth(user_name, pass)) {
     return vec_from_string(RES_ERR_LOGIN);
   }
+  if (this->fields->refusing())
+    return vec_from_string(RES_ERR_SERVER);
   vec res;
   this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
     if(!entry.requests.check(1)) {
@@ -575,16 +1786,23 @@ vec Storage::kv_delete(const string &user_name, const string &pass,
     }
   });
   if(!res.size()) {
-    if(!this->fields->kv_store.remove(key,[&](){
-      this->fields->mru.remove(key);
-      vec_append(data, Storage::Internal::KVDELETE);
-      vec_append(data, (int)(key.size()));
-      vec_append(data, key);
-      fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-      fflush(this->fields->f_ptr);
-    })) {
+    // An expired pair is removed, but as far as the client knows, it was
+    // already gone
+    bool was_expired = false;
+    uint64_t now = Storage::Internal::now_ms();
+    Storage::Internal::staged_t staged;
+    uint64_t ticket = 0;
+    bool removed = this->fields->kv_store.remove(key,[&](const Storage::Internal::KVTableEntry &old){
+      was_expired = Storage::Internal::expired(old, now);
+      this->fields->forget(key, old, data);
+      ticket = this->fields->stage(staged, std::move(data));
+    });
+    this->fields->publish(staged);
+    if(!removed || was_expired) {
       return vec_from_string(RES_ERR_KEY);
     }
+    if (!this->fields->log.wait(ticket))
+      return vec_from_string(RES_ERR_SERVER);
     res = vec_from_string(RES_OK);
   }
   return res;
@@ -601,51 +1819,269 @@ vec Storage::kv_delete(const string &user_name, const string &pass,
 ///          messages, depending on whether we get an insert or an update.
 vec Storage::kv_upsert(const string &user_name, const string &pass,
                        const string &key, const vec &val) {
+  return kv_upsert(string_view(user_name), string_view(pass), string_view(key),
+                   val);
+}
+
+/// Insert or update, so that the given key is mapped to the give value, given
+/// views of the user name, password, and key
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being upserted
+/// @param val       The value to copy into the map
+///
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message.  Note that there are two "OK"
+///          messages, depending on whether we get an insert or an update.
+vec Storage::kv_upsert(string_view user_name, string_view pass,
+                       string_view key, const vec &val, uint32_t ttl) {
+  return kv_upsert_value(user_name, pass, key, val, ttl);
+}
+
+/// Insert or update, so that the given key is mapped to the given value,
+/// taking over the value's buffer
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being upserted
+/// @param val       The value to move into the map
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message
+vec Storage::kv_upsert(string_view user_name, string_view pass,
+                       string_view key, slab_vec &&val, uint32_t ttl) {
+  return kv_upsert_value(user_name, pass, key, std::move(val), ttl);
+}
+
+/// The body of the kv_upsert() overloads
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being upserted
+/// @param val       The value, as a vec or a slab_vec to move from
+/// @param ttl       The number of seconds until the mapping expires, or 0
+///
+/// @returns A vec with the result message
+template <typename V>
+vec Storage::kv_upsert_value(string_view user_name, string_view pass,
+                             string_view key, V &&val, uint32_t ttl) {
   //std::cout << "kv_upsert: entered.\n";
   vec data;
   // Authenticate
   if (!auth(user_name, pass)) {
     return vec_from_string(RES_ERR_LOGIN);
   }
+  if (this->fields->refusing())
+    return vec_from_string(RES_ERR_SERVER);
   vec res;
+  size_t len = Storage::Internal::input_size(val);
   this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
     if(!entry.requests.check(1)) {
       res = vec_from_string(RES_ERR_QUOTA_REQ);
-    } else if(!entry.uploads.check(val.size())) {
+    } else if(!entry.uploads.check(len)) {
       entry.requests.add(1);
       res = vec_from_string(RES_ERR_QUOTA_UP);
     } else {
       entry.requests.add(1);
-      entry.uploads.add(val.size());
+      entry.uploads.add(len);
     }
   });
   if(!res.size()) {
-    if (fields->kv_store.upsert(key, vec(val), [&](){
-      this->fields->mru.insert(key);
-      vec_append(data, Storage::Internal::KVENTRY);
-      vec_append(data, (int)(key.size()));
-      vec_append(data, key);
-      vec_append(data, (int)(val.size()));
-      vec_append(data, val);
-      fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-      fflush(this->fields->f_ptr);
-    }, [&]() {
-      this->fields->mru.insert(key);
-      vec_append(data, Storage::Internal::KVUPDATE);
-      vec_append(data, (int)(key.size()));
-      vec_append(data, key);
-      vec_append(data, (int)(val.size()));
-      vec_append(data, val);
-      fwrite(data.data(), sizeof(char), data.size(), this->fields->f_ptr);
-      fflush(this->fields->f_ptr);
-    })) {
-      return vec_from_string(RES_OKINS);
-    }
-    res = vec_from_string(RES_OKINS);
+    uint64_t expires = Storage::Internal::deadline(ttl);
+    Storage::Internal::KVTableEntry entry = this->fields->pack(std::forward<V>(val), expires);
+    Storage::Internal::staged_t staged;
+    uint64_t ticket = 0;
+    uint64_t now = Storage::Internal::now_ms();
+    bool live = false;
+    bool inserted = fields->kv_store.upsert(key, entry, [&](){
+      this->fields->mru.insert(string(key));
+      this->fields->index_insert(key);
+      this->fields->mem_used += Storage::Internal::footprint(key.size(), Storage::Internal::stored_size(entry));
+      this->fields->log_blob(entry, staged);
+      Storage::Internal::log_pair(data, Storage::Internal::KVENTRY, key, entry);
+      ticket = this->fields->stage(staged, std::move(data));
+      this->fields->schedule(key, expires);
+    }, [&](const Storage::Internal::KVTableEntry &old) {
+      this->fields->mru.insert(string(key));
+      this->fields->mem_used += Storage::Internal::stored_size(entry);
+      this->fields->mem_used -= Storage::Internal::stored_size(old);
+      // Replacing an expired pair is an insert, as far as the client knows
+      live = !Storage::Internal::expired(old, now);
+      this->fields->log_blob(entry, staged);
+      Storage::Internal::log_pair(data, Storage::Internal::KVUPDATE, key, entry);
+      ticket = this->fields->stage(staged, std::move(data));
+      this->fields->schedule(key, expires);
+    });
+    this->fields->publish(staged);
+    if (!this->fields->log.wait(ticket))
+      return vec_from_string(RES_ERR_SERVER);
+    this->fields->enforce_limit();
+    res = vec_from_string(inserted || !live ? RES_OKINS : RES_OKUPD);
   }
   return res;
 };
 
+/// Get copies of the values to which a batch of keys are mapped
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param keys      The keys whose values are being fetched
+///
+/// @returns One result per key, in the same form as kv_get() returns
+vector<pair<bool, vec>> Storage::kv_multi_get(string_view user_name,
+                                              string_view pass,
+                                              const vector<string_view> &keys) {
+  if (!auth(user_name, pass)) {
+    return vector<pair<bool, vec>>(keys.size(), {true, vec_from_string(RES_ERR_LOGIN)});
+  }
+  vector<Storage::Internal::KVTableEntry> values(keys.size());
+  size_t bytes = 0;
+  uint64_t now = Storage::Internal::now_ms();
+  this->fields->kv_store.multi_get(keys, [&](size_t i, const Storage::Internal::KVTableEntry &value) {
+    if (Storage::Internal::expired(value, now))
+      return;
+    values[i] = value;
+    bytes += Storage::Internal::raw_size(value);
+  });
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(keys.size())) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else if(!entry.downloads.check(bytes)) {
+      entry.requests.add(keys.size());
+      res = vec_from_string(RES_ERR_QUOTA_DOWN);
+    } else {
+      entry.requests.add(keys.size());
+      entry.downloads.add(bytes);
+    }
+  });
+  if(res.size()) return vector<pair<bool, vec>>(keys.size(), {true, res});
+  vector<pair<bool, vec>> results;
+  results.reserve(keys.size());
+  for(size_t i = 0; i < keys.size(); ++i) {
+    if(values[i].has_value()) {
+      this->fields->mru.insert(string(keys[i]));
+      shared_vec bytes = Storage::Internal::unpack(values[i]);
+      results.push_back({false, vec(bytes->begin(), bytes->end())});
+    } else {
+      results.push_back({true, vec_from_string(RES_ERR_KEY)});
+    }
+  }
+  return results;
+}
+
+/// Insert or update a batch of key/value mappings
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param items     The keys and the values to copy into the map
+///
+/// @returns One result message per item, or the same error for every item
+vector<vec> Storage::kv_multi_upsert(string_view user_name, string_view pass,
+                                     const vector<pair<string_view, vec>> &items) {
+  if (!auth(user_name, pass)) {
+    return vector<vec>(items.size(), vec_from_string(RES_ERR_LOGIN));
+  }
+  if (this->fields->refusing())
+    return vector<vec>(items.size(), vec_from_string(RES_ERR_SERVER));
+  size_t bytes = 0;
+  for(const auto &item : items) bytes += item.second.size();
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(items.size())) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else if(!entry.uploads.check(bytes)) {
+      entry.requests.add(items.size());
+      res = vec_from_string(RES_ERR_QUOTA_UP);
+    } else {
+      entry.requests.add(items.size());
+      entry.uploads.add(bytes);
+    }
+  });
+  if(res.size()) return vector<vec>(items.size(), res);
+  vector<vec> results(items.size());
+  vec data;
+  Storage::Internal::staged_t staged;
+  // Values are compressed before any lock is taken
+  vector<Storage::Internal::KVTableEntry> entries;
+  entries.reserve(items.size());
+  for(const auto &item : items)
+    entries.push_back(this->fields->pack(item.second, 0));
+  auto log = [&](size_t i, const string &magic) {
+    this->fields->mru.insert(string(items[i].first));
+    this->fields->log_blob(entries[i], staged);
+    Storage::Internal::log_pair(data, magic, items[i].first, entries[i]);
+  };
+  vector<pair<string_view, Storage::Internal::KVTableEntry>> shared;
+  shared.reserve(items.size());
+  for(size_t i = 0; i < items.size(); ++i)
+    shared.push_back({items[i].first, entries[i]});
+  uint64_t now = Storage::Internal::now_ms();
+  uint64_t ticket = 0;
+  this->fields->kv_store.multi_upsert(move(shared), [&](size_t i) {
+    this->fields->index_insert(items[i].first);
+    this->fields->mem_used += Storage::Internal::footprint(items[i].first.size(), Storage::Internal::stored_size(entries[i]));
+    log(i, Storage::Internal::KVENTRY);
+    results[i] = vec_from_string(RES_OKINS);
+  }, [&](size_t i, const Storage::Internal::KVTableEntry &old) {
+    this->fields->mem_used += Storage::Internal::stored_size(entries[i]);
+    this->fields->mem_used -= Storage::Internal::stored_size(old);
+    log(i, Storage::Internal::KVUPDATE);
+    // Replacing an expired pair is an insert, as far as the client knows
+    results[i] = vec_from_string(Storage::Internal::expired(old, now) ? RES_OKINS : RES_OKUPD);
+  }, [&]() {
+    ticket = this->fields->stage(staged, std::move(data));
+  });
+  this->fields->publish(staged);
+  if (!this->fields->log.wait(ticket))
+    return vector<vec>(items.size(), vec_from_string(RES_ERR_SERVER));
+  this->fields->enforce_limit();
+  return results;
+}
+
+/// Delete a batch of key/value mappings
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param keys      The keys whose values are being deleted
+///
+/// @returns One result message per key, or the same error for every key
+vector<vec> Storage::kv_multi_delete(string_view user_name, string_view pass,
+                                     const vector<string_view> &keys) {
+  if (!auth(user_name, pass)) {
+    return vector<vec>(keys.size(), vec_from_string(RES_ERR_LOGIN));
+  }
+  if (this->fields->refusing())
+    return vector<vec>(keys.size(), vec_from_string(RES_ERR_SERVER));
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(keys.size())) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else {
+      entry.requests.add(keys.size());
+    }
+  });
+  if(res.size()) return vector<vec>(keys.size(), res);
+  vector<vec> results(keys.size(), vec_from_string(RES_ERR_KEY));
+  vec data;
+  Storage::Internal::staged_t staged;
+  uint64_t now = Storage::Internal::now_ms();
+  uint64_t ticket = 0;
+  this->fields->kv_store.multi_remove(keys, [&](size_t i, const Storage::Internal::KVTableEntry &old) {
+    this->fields->forget(keys[i], old, data);
+    if (!Storage::Internal::expired(old, now))
+      results[i] = vec_from_string(RES_OK);
+  }, [&]() {
+    ticket = this->fields->stage(staged, std::move(data));
+  });
+  this->fields->publish(staged);
+  if (!this->fields->log.wait(ticket))
+    return vector<vec>(keys.size(), vec_from_string(RES_ERR_SERVER));
+  return results;
+}
+
 /// Return all of the keys in the kv_store, as a "\n"-delimited string
 ///
 /// @param user_name The name of the user who made the request
@@ -661,10 +2097,14 @@ pair<bool, vec> Storage::kv_all(const string &user_name, const string &pass) {
     return {true, vec_from_string(RES_ERR_LOGIN)};
   }
   vec values;
-  this->fields->kv_store.do_all_readonly([&](string key, vec value){
-    vec_append(values, key);
-    vec_append(values, "\n");
-  }, [](){});
+  vector<vec> parts(scan_parts());
+  uint64_t now = Storage::Internal::now_ms();
+  this->fields->kv_store.snapshot_parallel(parts.size(), [&](size_t p, string_view key, const Storage::Internal::KVTableEntry &value){
+    if (Storage::Internal::expired(value, now))
+      return;
+    vec_append_view(parts[p], key);
+    vec_append(parts[p], "\n");
+  }, [&](){ merge_parts(values, parts); });
   vec res;
   this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
     if(!entry.requests.check(1)) {
@@ -684,6 +2124,133 @@ pair<bool, vec> Storage::kv_all(const string &user_name, const string &pass) {
   return {false, values};
 };
 
+/// Return one page of the keys in the kv_store
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param cursor    0 to start a scan, or the cursor from the previous page
+/// @param count     The number of keys to aim for (at most MAX_PAGE)
+///
+/// @returns A pair with a bool to indicate errors, and a vec with the result
+///          (possibly an error message).
+pair<bool, vec> Storage::kv_page(const string &user_name, const string &pass,
+                                 uint64_t cursor, size_t count) {
+  if(!auth(user_name, pass)) {
+    return {true, vec_from_string(RES_ERR_LOGIN)};
+  }
+  // The cursor comes from the client, so it must name a real bucket
+  if(!this->fields->kv_store.valid_cursor(cursor)) {
+    return {true, vec_from_string(RES_ERR_MSG_FMT)};
+  }
+  vec keys;
+  uint64_t now = Storage::Internal::now_ms();
+  uint64_t next = this->fields->kv_store.scan_page(cursor, min(count, MAX_PAGE), [&](string_view key, const Storage::Internal::KVTableEntry &value){
+    if (Storage::Internal::expired(value, now))
+      return;
+    vec_append_view(keys, key);
+    vec_append(keys, "\n");
+  });
+  vec page = vec_from_string(to_string(next) + "\n");
+  vec_append(page, keys);
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(1)) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else if (!entry.downloads.check(page.size())) {
+      entry.requests.add(1);
+      res = vec_from_string(RES_ERR_QUOTA_DOWN);
+    } else {
+      entry.requests.add(1);
+      entry.downloads.add(page.size());
+    }
+  });
+  if(res.size()) return {true, res};
+  return {false, page};
+}
+
+/// Return the keys in the kv_store that are in a range, in ascending order
+///
+/// @param user_name   The name of the user who made the request
+/// @param pass        The password for the user, used to authenticate
+/// @param from        The smallest key to return
+/// @param to          The key at which to stop (exclusive), or "" for none
+/// @param count       The maximum number of keys (at most MAX_PAGE)
+/// @param with_values Should the values be returned with the keys?
+///
+/// @returns A pair with a bool to indicate errors, and a vec with the result
+///          (possibly an error message).
+pair<bool, vec> Storage::kv_range(const string &user_name, const string &pass,
+                                  string_view from, string_view to,
+                                  size_t count, bool with_values) {
+  if(!auth(user_name, pass)) {
+    return {true, vec_from_string(RES_ERR_LOGIN)};
+  }
+  if(!this->fields->key_index) {
+    return {true, vec_from_string(RES_ERR_INV_CMD)};
+  }
+  vector<string> keys;
+  this->fields->key_index->range(from, to, min(count, MAX_PAGE), [&](const string &key){
+    keys.push_back(key);
+  });
+  // The index may briefly list a key that was just removed from kv_store, and
+  // it lists expired keys until the reaper gets to them, so every key is
+  // checked against kv_store, and keys without a live value are skipped
+  vector<string_view> views(keys.begin(), keys.end());
+  vector<Storage::Internal::KVTableEntry> values(keys.size());
+  uint64_t now = Storage::Internal::now_ms();
+  this->fields->kv_store.multi_get(views, [&](size_t i, const Storage::Internal::KVTableEntry &value){
+    if (!Storage::Internal::expired(value, now))
+      values[i] = value;
+  });
+  vec result;
+  for(size_t i = 0; i < keys.size(); ++i) {
+    if(!values[i].has_value()) continue;
+    if(!with_values) {
+      vec_append(result, keys[i]);
+      vec_append(result, "\n");
+    } else {
+      shared_vec bytes = Storage::Internal::unpack(values[i]);
+      vec_append(result, (int)keys[i].size());
+      vec_append(result, keys[i]);
+      vec_append(result, (int)bytes->size());
+      vec_append(result, *bytes);
+    }
+  }
+  vec res;
+  this->fields->auth_table.do_with(user_name, [&](Storage::Internal::AuthTableEntry &entry){
+    if(!entry.requests.check(1)) {
+      res = vec_from_string(RES_ERR_QUOTA_REQ);
+    } else if (!entry.downloads.check(result.size())) {
+      entry.requests.add(1);
+      res = vec_from_string(RES_ERR_QUOTA_DOWN);
+    } else {
+      entry.requests.add(1);
+      entry.downloads.add(result.size());
+    }
+  });
+  if(res.size()) return {true, res};
+  if(!result.size()) return {true, vec_from_string(RES_ERR_NO_DATA)};
+  return {false, result};
+}
+
+/// Return the keys in the kv_store that start with a prefix, in ascending
+/// order
+///
+/// @param user_name   The name of the user who made the request
+/// @param pass        The password for the user, used to authenticate
+/// @param prefix      The prefix of the keys to return
+/// @param count       The maximum number of keys (at most MAX_PAGE)
+/// @param with_values Should the values be returned with the keys?
+///
+/// @returns A pair with a bool to indicate errors, and a vec with the result
+///          (possibly an error message).
+pair<bool, vec> Storage::kv_prefix(const string &user_name, const string &pass,
+                                   string_view prefix, size_t count,
+                                   bool with_values) {
+  return kv_range(user_name, pass, prefix, OrderedIndex::prefix_end(prefix),
+                  count, with_values);
+}
+
 /// Return all of the keys in the kv_store's MRU cache, as a "\n"-delimited
 /// string
 ///
@@ -713,8 +2280,13 @@ pair<bool, vec> Storage::kv_top(const string &user_name, const string &pass) {
   return {false, vec_from_string(rv)};
 };
 
-/// Close any open files related to incremental persistence
+/// Wait for a background snapshot, if one is running, and then write and sync
+/// every entry that is waiting in the log
 ///
 /// NB: this cannot be called until all threads have stopped accessing the
 ///     Storage object
-void Storage::shutdown() {}
+void Storage::shutdown() {
+  this->fields->wait_snapshot();
+  if (!this->fields->log.flush())
+    cerr << "Could not write: " << this->fields->filename << endl;
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include "../common/vec.h"
 
@@ -17,13 +20,23 @@
 /// command handlers need only parse a request, send its parts to the Storage
 /// object, and then format and return the result.
 ///
+/// Some functions have no request yet: the ttl overloads, kv_get_range(),
+/// kv_append(), the kv_multi_* batches, kv_page(), kv_range(), kv_prefix()
+/// and persist_status().  The command handlers in this tree are prebuilt, and
+/// only dispatch the requests that protocol.h describes, so these functions
+/// are only reachable from code that links with Storage.
+///
 /// Storage is a persistent object.  Persistence can be achieved by writing the
 /// entire object to disk in response to SAV messages.  In addition, any
 /// successful server_cmd_reg, server_cmd_set, server_cmd_kvi, server_cmd_kvu,
 /// or server_cmd_kvd operation will write a "DIFF" entry to the file.  Note
 /// that the file will be open at all times, so that these operations can
-/// perform an fwrite followed by an fflush.  The file should only open and
-/// close in response to load() and persist() calls.
+/// append to it.  The file should only open and close in response to load()
+/// and persist() calls.  Entries go through a group-commit log: concurrent
+/// operations share one write (and one fdatasync), and an operation replies
+/// once its entry is as durable as the log's sync policy promises.  When the
+/// file has too much garbage, or has grown too much, a background snapshot
+/// compacts it, as if a SAV had been received.
 ///
 /// We use a relatively simple binary wire format to write every Auth table
 /// entry and every K/V pair to disk:
@@ -61,6 +74,46 @@
 ///   - Magic 8-byte constant KVDELETE
 ///    - 4-byte binary write of the length of the key
 ///    - Binary write of the bytes of the key
+/// - KVEXPIRE: when a key is mapped to a value that expires (in place of
+///   KVKVKVKV or KVUPDATE).  load() skips a KVEXPIRE whose expiry has passed,
+///   and removes the key's older value.
+///   - Magic 8-byte constant KVEXPIRE
+///    - 4-byte binary write of the length of the key
+///    - Binary write of the bytes of the key
+///    - 8-byte binary write of the expiry, in milliseconds since the epoch
+///    - Binary write of the length of value
+///    - Binary write of the bytes of value
+///
+/// A value in a K/V entry, KVUPDATE, or KVEXPIRE may be compressed (with
+/// zlib).  If so, the high bit of its length is set, the length is followed by
+/// a 4-byte binary write of the value's decompressed length, and the bytes are
+/// the compressed bytes.  Values are kept compressed in memory, too, and are
+/// only decompressed when they are sent to a client.
+///
+/// - KVAPPEND: when bytes are appended to a key's value.  The record holds only
+///   the appended bytes, so an append never rewrites the value.
+///   - Magic 8-byte constant KVAPPEND
+///    - 4-byte binary write of the length of the key
+///    - Binary write of the bytes of the key
+///    - Binary write of the number of appended bytes
+///    - Binary write of the appended bytes
+///
+/// When identical values are shared, a value may instead be a reference to a
+/// blob, which is written once (per file) before the first record that
+/// refers to it:
+///
+/// - BLOBBLOB: a value that is shared by many keys
+///   - Magic 8-byte constant BLOBBLOB
+///    - 4-byte binary write of the length of the digest
+///    - Binary write of the SHA-256 digest of the value
+///    - Binary write of the length of value (with the compression bit)
+///    - Binary write of the bytes of value
+/// - A reference, in place of a value, has the second-highest bit of the
+///   value's length set, and the digest of the blob in place of its bytes.
+///
+/// In memory, a value that is longer than one chunk (see chunk_list), and is
+/// neither compressed nor shared, is kept as a list of chunks.  It is still
+/// written to the file as one value, and load() splits it into chunks again.
 ///
 /// Note that there are other operations that need to incrementally persist
 /// by adding to the file, but they do not need DIFF messages... they can use
@@ -74,12 +127,46 @@ class Storage {
   /// A reference to the internal fields of the Storage object
   std::unique_ptr<Internal> fields;
 
+  /// The body of the kv_insert() overloads, for a value that is a vec or a
+  /// slab_vec to move from
+  template <typename V>
+  vec kv_insert_value(std::string_view user_name, std::string_view pass,
+                      std::string_view key, V &&val, uint32_t ttl);
+
+  /// The body of the kv_upsert() overloads, for a value that is a vec or a
+  /// slab_vec to move from
+  template <typename V>
+  vec kv_upsert_value(std::string_view user_name, std::string_view pass,
+                      std::string_view key, V &&val, uint32_t ttl);
+
+  /// Get references to the pieces of the value to which a key is mapped,
+  /// without copying or joining them.  A value that is stored in chunks has
+  /// one piece per chunk, and any other value has one piece.  kv_get() and
+  /// kv_get_shared() join the pieces after every lock has been released.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose value is being fetched
+  ///
+  /// @returns A pair with a bool to indicate error, and the value's pieces (or,
+  ///          on error, one piece with the error message)
+  std::pair<bool, std::vector<shared_vec>>
+  kv_get_chunks(std::string_view user_name, std::string_view pass,
+                std::string_view key);
+
 public:
+  /// The most keys that one page of kv_page(), kv_range() or kv_prefix() asks
+  /// for
+  inline static const size_t MAX_PAGE = 4096;
+
   /// Construct an empty object and specify the file from which it should be
   /// loaded.  To avoid exceptions and errors in the constructor, the act of
   /// loading data is separate from construction.
   Storage(const std::string &fname, size_t num_buckets, size_t upq, size_t dnq,
-          size_t rqq, double qd, size_t top);
+          size_t rqq, double qd, size_t top, bool key_index = false,
+          size_t mem_limit = 0, size_t compress_min = 0,
+          size_t dedup_min = 0, int log_sync = -1, size_t compact_pct = 0,
+          size_t compact_growth = 0);
 
   /// Destructor for the storage object.
   ~Storage();
@@ -99,7 +186,8 @@ public:
   /// @param user_name The user name to register
   /// @param pass      The password to associate with that user name
   ///
-  /// @returns False if the username already exists, true otherwise
+  /// @returns False if the username already exists, or if the new user could
+  ///          not be written to the file, true otherwise
   bool add_user(const std::string &user_name, const std::string &pass);
 
   /// Set the data bytes for a user, but do so if and only if the password
@@ -147,13 +235,24 @@ public:
   /// @returns True if the user and password are valid, false otherwise
   bool auth(const std::string &user_name, const std::string &pass);
 
+  /// A version of auth() that takes views, so that the user name and password
+  /// can point directly into a request buffer
+  bool auth(std::string_view user_name, std::string_view pass);
+
   /// Write the entire Storage object to the file specified by this.filename.
   /// To ensure durability, Storage must be persisted in two steps.  First, it
   /// must be written to a temporary file (this.filename.tmp).  Then the
   /// temporary file can be renamed to replace the older version of the Storage
-  /// object.
+  /// object.  The snapshot is taken at one point in time and written in the
+  /// background, while requests are served; this returns once it has started.
   void persist();
 
+  /// Report on the background snapshot that persist() started most recently
+  ///
+  /// @returns A pair with a bool that is true while the snapshot is running,
+  ///          and a vec with its progress and duration
+  std::pair<bool, vec> persist_status();
+
   /// Create a new key/value mapping in the table
   ///
   /// @param user_name The name of the user who made the request
@@ -165,6 +264,19 @@ public:
   vec kv_insert(const std::string &user_name, const std::string &pass,
                 const std::string &key, const vec &val);
 
+  /// A version of kv_insert() that takes views of the user name, password, and
+  /// key, so that they can point directly into a request buffer.  If ttl is
+  /// not 0, the mapping expires after ttl seconds.
+  vec kv_insert(std::string_view user_name, std::string_view pass,
+                std::string_view key, const vec &val, uint32_t ttl = 0);
+
+  /// A version of kv_insert() that takes over the value's buffer.  A value
+  /// that is stored as it is (not compressed, shared, or longer than a chunk)
+  /// keeps that buffer, so no byte of it is copied between the caller and the
+  /// table.
+  vec kv_insert(std::string_view user_name, std::string_view pass,
+                std::string_view key, slab_vec &&val, uint32_t ttl = 0);
+
   /// Get a copy of the value to which a key is mapped
   ///
   /// @param user_name The name of the user who made the request
@@ -177,6 +289,60 @@ public:
   std::pair<bool, vec> kv_get(const std::string &user_name,
                               const std::string &pass, const std::string &key);
 
+  /// A version of kv_get() that takes views of the user name, password, and
+  /// key, so that they can point directly into a request buffer
+  std::pair<bool, vec> kv_get(std::string_view user_name,
+                              std::string_view pass, std::string_view key);
+
+  /// Get a reference to the value to which a key is mapped, without copying
+  /// it.  The kv_store's bucket lock is held only long enough to take the
+  /// reference, and the value stays valid even if the key is later updated or
+  /// deleted, so the caller can encrypt and send it without holding any lock.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose value is being fetched
+  ///
+  /// @returns A pair with a bool to indicate error, and the value (or, on
+  ///          error, the error message)
+  std::pair<bool, shared_vec> kv_get_shared(std::string_view user_name,
+                                            std::string_view pass,
+                                            std::string_view key);
+
+  /// Get a copy of a range of the bytes of the value to which a key is
+  /// mapped.  The range is cut short at the end of the value, and only the
+  /// bytes returned count against the download quota.  A value that is stored
+  /// in chunks only has the chunks that hold the range copied.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose value is being fetched
+  /// @param offset    The offset of the first byte to fetch
+  /// @param len       The number of bytes to fetch
+  ///
+  /// @returns A pair with a bool to indicate error, and a vector indicating the
+  ///          data (possibly an error message) that is the result of the
+  ///          attempt.
+  std::pair<bool, vec> kv_get_range(std::string_view user_name,
+                                    std::string_view pass,
+                                    std::string_view key, size_t offset,
+                                    size_t len);
+
+  /// Append bytes to the value to which a key is mapped.  The append is
+  /// atomic, keeps the mapping's expiry, and writes only the appended bytes
+  /// to the file.  A value that grows past one chunk is stored in chunks, so
+  /// that later appends only copy its last chunk.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose value is being extended
+  /// @param val       The bytes to append
+  ///
+  /// @returns A vec with the result message (RES_ERR_KEY if the key has no
+  ///          value, or RES_ERR_MSG_FMT if the value would exceed LEN_VAL)
+  vec kv_append(std::string_view user_name, std::string_view pass,
+                std::string_view key, const vec &val);
+
   /// Delete a key/value mapping
   ///
   /// @param user_name The name of the user who made the request
@@ -187,6 +353,11 @@ public:
   vec kv_delete(const std::string &user_name, const std::string &pass,
                 const std::string &key);
 
+  /// A version of kv_delete() that takes views of the user name, password, and
+  /// key, so that they can point directly into a request buffer
+  vec kv_delete(std::string_view user_name, std::string_view pass,
+                std::string_view key);
+
   /// Insert or update, so that the given key is mapped to the give value
   ///
   /// @param user_name The name of the user who made the request
@@ -199,6 +370,59 @@ public:
   vec kv_upsert(const std::string &user_name, const std::string &pass,
                 const std::string &key, const vec &val);
 
+  /// A version of kv_upsert() that takes views of the user name, password, and
+  /// key, so that they can point directly into a request buffer.  If ttl is
+  /// not 0, the mapping expires after ttl seconds; otherwise any earlier
+  /// expiry of the key is cleared.
+  vec kv_upsert(std::string_view user_name, std::string_view pass,
+                std::string_view key, const vec &val, uint32_t ttl = 0);
+
+  /// A version of kv_upsert() that takes over the value's buffer, as
+  /// kv_insert() does
+  vec kv_upsert(std::string_view user_name, std::string_view pass,
+                std::string_view key, slab_vec &&val, uint32_t ttl = 0);
+
+  /// Get copies of the values to which a batch of keys are mapped.  The keys
+  /// are looked up together, so each bucket of the kv_store is locked once.
+  /// The batch is charged as one request per key.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param keys      The keys whose values are being fetched
+  ///
+  /// @returns One result per key, in the same form as kv_get() returns.  If
+  ///          the whole batch fails (login or quota), every result is the
+  ///          same error.
+  std::vector<std::pair<bool, vec>>
+  kv_multi_get(std::string_view user_name, std::string_view pass,
+               const std::vector<std::string_view> &keys);
+
+  /// Insert or update a batch of key/value mappings, locking each bucket of
+  /// the kv_store once and writing the batch to the file with one fwrite
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param items     The keys and the values to copy into the map
+  ///
+  /// @returns One result message per item (RES_OKINS or RES_OKUPD), or the
+  ///          same error message for every item
+  std::vector<vec>
+  kv_multi_upsert(std::string_view user_name, std::string_view pass,
+                  const std::vector<std::pair<std::string_view, vec>> &items);
+
+  /// Delete a batch of key/value mappings, locking each bucket of the
+  /// kv_store once and writing the batch to the file with one fwrite
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param keys      The keys whose values are being deleted
+  ///
+  /// @returns One result message per key (RES_OK or RES_ERR_KEY), or the same
+  ///          error message for every key
+  std::vector<vec> kv_multi_delete(std::string_view user_name,
+                                   std::string_view pass,
+                                   const std::vector<std::string_view> &keys);
+
   /// Return all of the keys in the kv_store, as a "\n"-delimited string
   ///
   /// @param user_name The name of the user who made the request
@@ -209,6 +433,56 @@ public:
   std::pair<bool, vec> kv_all(const std::string &user_name,
                               const std::string &pass);
 
+  /// Return one page of the keys in the kv_store.  The page is the cursor for
+  /// the next page, as a decimal line, followed by "\n"-delimited keys.  Only
+  /// the buckets that the page covers are locked, one at a time.
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param cursor    0 to start a scan, or the cursor from the previous page
+  /// @param count     The number of keys to aim for (at most MAX_PAGE)
+  ///
+  /// @returns A pair with a bool to indicate errors, and a vec with the page
+  ///          (possibly an error message).  The cursor is 0 on the last page.
+  std::pair<bool, vec> kv_page(const std::string &user_name,
+                               const std::string &pass, uint64_t cursor,
+                               size_t count);
+
+  /// Return the keys in the kv_store that are in a range, in ascending order.
+  /// Only available when the Storage object keeps an ordered key index.
+  ///
+  /// @param user_name   The name of the user who made the request
+  /// @param pass        The password for the user, used to authenticate
+  /// @param from        The smallest key to return
+  /// @param to          The key at which to stop (exclusive), or "" for none
+  /// @param count       The maximum number of keys (at most MAX_PAGE)
+  /// @param with_values If false, the result is "\n"-delimited keys.  If true,
+  ///                    it is a 4-byte length, key, 4-byte length and value
+  ///                    for each key.
+  ///
+  /// @returns A pair with a bool to indicate errors, and a vec with the result
+  ///          (possibly an error message).
+  std::pair<bool, vec> kv_range(const std::string &user_name,
+                                const std::string &pass, std::string_view from,
+                                std::string_view to, size_t count,
+                                bool with_values);
+
+  /// Return the keys in the kv_store that start with a prefix, in ascending
+  /// order.  See kv_range().
+  ///
+  /// @param user_name   The name of the user who made the request
+  /// @param pass        The password for the user, used to authenticate
+  /// @param prefix      The prefix of the keys to return
+  /// @param count       The maximum number of keys (at most MAX_PAGE)
+  /// @param with_values Should the values be returned with the keys?
+  ///
+  /// @returns A pair with a bool to indicate errors, and a vec with the result
+  ///          (possibly an error message).
+  std::pair<bool, vec> kv_prefix(const std::string &user_name,
+                                 const std::string &pass,
+                                 std::string_view prefix, size_t count,
+                                 bool with_values);
+
   /// Return all of the keys in the kv_store's MRU cache, as a "\n"-delimited
   /// string
   ///
@@ -220,7 +494,8 @@ public:
   std::pair<bool, vec> kv_top(const std::string &user_name,
                               const std::string &pass);
 
-  /// Close any open files related to incremental persistence
+  /// Wait for a background snapshot, if one is running, and then write and
+  /// sync every entry that is waiting in the log
   ///
   /// NB: this cannot be called until all threads have stopped accessing the
   ///     Storage object
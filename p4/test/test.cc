@@ -0,0 +1,751 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <set>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/file.h"
+#include "../common/flat_hashtable.h"
+#include "../common/group_log.h"
+#include "../common/hashtable.h"
+#include "../common/ordered_index.h"
+#include "../common/protocol.h"
+#include "../common/vec.h"
+#include "../server/server_storage.h"
+
+using namespace std;
+
+/// The number of checks that have failed
+static size_t failures = 0;
+
+/// Report a check that failed, and count it
+///
+/// @param ok   The result of the check
+/// @param what A description of the check
+static void check(bool ok, const string &what) {
+  if (!ok) {
+    cout << "  FAILED: " << what << endl;
+    ++failures;
+  }
+}
+
+/// The bytes that operator new has handed out to this thread.  Other threads
+/// (such as the log's writer) are not counted, so a test can measure the
+/// copies that one call makes.
+static thread_local size_t allocated = 0;
+
+void *operator new(size_t n) {
+  allocated += n;
+  if (void *p = malloc(n ? n : 1))
+    return p;
+  throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/// Report the bytes that operator new handed to this thread while a function
+/// ran
+///
+/// @param f The function
+template <typename F> static size_t bytes_allocated(F &&f) {
+  size_t before = allocated;
+  f();
+  return allocated - before;
+}
+
+/// Make a value of some length that compresses well
+///
+/// @param len The length
+/// @param c   The byte to repeat
+static vec repeated(size_t len, char c) { return vec(len, c); }
+
+/// Make a value of some length that does not compress
+///
+/// @param len  The length
+/// @param seed The first byte of the pattern
+static vec noise(size_t len, unsigned seed) {
+  vec v(len);
+  for (auto &b : v) {
+    seed = seed * 1103515245 + 12345;
+    b = (unsigned char)(seed >> 16);
+  }
+  return v;
+}
+
+/// Check that a key has a value in a Storage object
+///
+/// @param s    The Storage object
+/// @param key  The key
+/// @param want The expected value
+/// @param when A description of the Storage object's state
+static void expect(Storage &s, const string &key, const vec &want,
+                   const string &when) {
+  auto res = s.kv_get("alice", "pw", key);
+  check(!res.first && res.second == want, key + " " + when);
+}
+
+/// Count the times that some bytes appear in a file
+///
+/// @param file The name of the file
+/// @param what The bytes to find
+static size_t occurrences(const string &file, const vec &what) {
+  vec all = load_entire_file(file);
+  size_t n = 0;
+  for (auto i = all.begin();
+       (i = search(i, all.end(), what.begin(), what.end())) != all.end(); ++i)
+    ++n;
+  return n;
+}
+
+/// Write records of every kind to a data file, replay it, snapshot it, and
+/// load the snapshot.  Each load must give back exactly what was written:
+///  - KVEXPIRE, for a pair with a ttl
+///  - KVAPPEND, for an append
+///  - BLOBBLOB, and values with the REFERENCE bit, for shared values
+///  - values with the COMPRESSED bit, for compressible values
+///
+/// @param file The data file to use, which is deleted first
+static void test_round_trip(const string &file) {
+  cout << "persist/load round trip" << endl;
+  unlink(file.c_str());
+  const size_t BIG = 1 << 30;
+  // Compress values of at least 64 bytes, and share values of at least 256
+  auto make = [&]() {
+    return new Storage(file, 64, BIG, BIG, BIG, 60, 4, false, 0, 64, 256,
+                       GroupLog::EVERY_COMMIT);
+  };
+  vec packed = repeated(1000, 'c');
+  vec shared = noise(300, 7);
+  vec expiring = noise(40, 9);
+  vec appended = vec_from_string("abc");
+  vec appended_all = vec_from_string("abcdefghi");
+  {
+    Storage *s = make();
+    check(s->load(), "load of a missing file");
+    check(s->add_user("alice", "pw"), "add_user");
+    check(s->kv_insert(string_view("alice"), "pw", "packed", packed) ==
+              vec_from_string(RES_OK),
+          "insert of a compressible value");
+    check(s->kv_upsert(string_view("alice"), "pw", "shared1", shared) ==
+              vec_from_string(RES_OKINS),
+          "upsert of a shared value");
+    check(s->kv_upsert(string_view("alice"), "pw", "shared2", shared) ==
+              vec_from_string(RES_OKINS),
+          "upsert of a second reference");
+    check(s->kv_upsert(string_view("alice"), "pw", "expiring", expiring,
+                       3600) == vec_from_string(RES_OKINS),
+          "upsert with a ttl");
+    check(s->kv_insert(string_view("alice"), "pw", "appended", appended) ==
+              vec_from_string(RES_OK),
+          "insert before append");
+    check(s->kv_append("alice", "pw", "appended", vec_from_string("def")) ==
+              vec_from_string(RES_OK),
+          "first append");
+    check(s->kv_append("alice", "pw", "appended", vec_from_string("ghi")) ==
+              vec_from_string(RES_OK),
+          "second append");
+    s->shutdown();
+    delete s;
+  }
+  // Make sure that the log holds the records that the loads must replay
+  for (auto magic : {"KVEXPIRE", "KVAPPEND", "BLOBBLOB"})
+    check(occurrences(file, vec_from_string(magic)) > 0,
+          string(magic) + " record in the log");
+  check(occurrences(file, repeated(100, 'c')) == 0,
+        "the compressible value is stored compressed");
+  check(occurrences(file, shared) == 1,
+        "the shared value is stored once, and referenced twice");
+  auto verify = [&](const string &when) {
+    Storage *s = make();
+    check(s->load(), "load " + when);
+    expect(*s, "packed", packed, when);
+    expect(*s, "shared1", shared, when);
+    expect(*s, "shared2", shared, when);
+    expect(*s, "expiring", expiring, when);
+    expect(*s, "appended", appended_all, when);
+    return s;
+  };
+  // The first load replays the log; the second loads a snapshot of it
+  Storage *s = verify("after replaying the log");
+  s->persist();
+  while (s->persist_status().first)
+    this_thread::sleep_for(chrono::milliseconds(10));
+  s->shutdown();
+  delete s;
+  s = verify("after a snapshot");
+  s->shutdown();
+  delete s;
+  unlink(file.c_str());
+}
+
+/// A value for a GUARDED table that names its key, and holds a token, so that
+/// the token's use count tells how many values are still alive
+struct tagged {
+  /// The key and generation that the value was made for
+  shared_ptr<const string> tag;
+
+  /// A token that every value copies
+  shared_ptr<int> token;
+};
+
+/// Replace and remove values in a GUARDED table with no readers and no later
+/// traffic, and check that the table destroys every one of them right away
+static void test_reclaim() {
+  cout << "GUARDED reclamation" << endl;
+  ConcurrentHashTable<string, tagged, true> tbl(1024);
+  auto token = make_shared<int>(0);
+  const int N = 1000;
+  for (int i = 0; i < N; ++i)
+    tbl.insert("key" + to_string(i), {nullptr, token}, []() {});
+  check(token.use_count() == N + 1, "every inserted value is alive");
+  for (int i = 0; i < N; i += 2)
+    tbl.upsert("key" + to_string(i), {nullptr, token}, []() {}, []() {});
+  check(token.use_count() == N + 1, "replaced values are destroyed");
+  for (int i = 0; i < N; ++i)
+    tbl.remove("key" + to_string(i), []() {});
+  check(tbl.size() == 0, "every key is removed");
+  check(token.use_count() == 1, to_string(token.use_count() - 1) +
+                                    " removed values are still alive");
+  check(tbl.retained([](const tagged &) { return 1; }) == 0,
+        "nothing is left in limbo");
+}
+
+/// Read a GUARDED table without locks while writers replace, remove and
+/// insert values and make the table resize.  Every value that a reader sees
+/// must be the one for its key, and once the writers stop, every value that
+/// was replaced or removed must be destroyed.
+static void test_guarded_reads() {
+  cout << "GUARDED reads under concurrent writers" << endl;
+  ConcurrentHashTable<string, tagged, true> tbl(4);
+  auto token = make_shared<int>(0);
+  const int KEYS = 512, ROUNDS = 40;
+  auto key = [](int i) { return "k" + to_string(i); };
+  auto make = [&](int i, int gen) {
+    return tagged{make_shared<const string>(key(i) + "/" + to_string(gen)),
+                  token};
+  };
+  atomic<bool> done{false};
+  atomic<size_t> torn{0}, hits{0};
+  vector<thread> threads;
+  for (int w = 0; w < 2; ++w)
+    threads.emplace_back([&, w]() {
+      for (int r = 0; r < ROUNDS; ++r)
+        for (int i = w; i < KEYS; i += 2) {
+          if (r % 3 == 2)
+            tbl.remove(key(i), []() {});
+          else
+            tbl.upsert(key(i), make(i, r), []() {}, []() {});
+        }
+    });
+  for (int rd = 0; rd < 2; ++rd)
+    threads.emplace_back([&]() {
+      while (!done)
+        for (int i = 0; i < KEYS; ++i) {
+          string k = key(i);
+          tbl.do_with_readonly(k, [&](const tagged &v) {
+            ++hits;
+            if (v.tag == nullptr || v.tag->compare(0, k.size() + 1, k + "/"))
+              ++torn;
+          });
+        }
+    });
+  threads[0].join();
+  threads[1].join();
+  done = true;
+  for (size_t i = 2; i < threads.size(); ++i)
+    threads[i].join();
+  check(hits > 0, "readers found values");
+  check(torn == 0, to_string(torn) + " reads saw another key's value");
+  // One more write lets the epoch pass the readers' last reads
+  tbl.remove(key(0), []() {});
+  check(token.use_count() == (long)tbl.size() + 1,
+        to_string(token.use_count() - 1 - tbl.size()) +
+            " replaced or removed values are still alive");
+}
+
+/// Read a value by copy and by reference, and check that the reference is to
+/// the stored buffer, so that a read by reference copies none of its bytes
+///
+/// @param file The data file to use, which is deleted first
+static void test_shared_get(const string &file) {
+  cout << "shared reads" << endl;
+  unlink(file.c_str());
+  const size_t LEN = 32 * 1024;
+  Storage s(file, 64, 1 << 30, 1 << 30, 1 << 30, 60, 4);
+  s.load();
+  s.add_user("alice", "pw");
+  s.kv_insert(string_view("alice"), "pw", "big", noise(LEN, 3));
+  size_t copied = bytes_allocated([&]() { s.kv_get("alice", "pw", string("big")); });
+  shared_vec first, second;
+  size_t shared = bytes_allocated([&]() {
+    first = s.kv_get_shared("alice", "pw", "big").second;
+  });
+  second = s.kv_get_shared("alice", "pw", "big").second;
+  cout << "  a " << LEN << "-byte value: kv_get allocates " << copied
+       << " bytes, kv_get_shared " << shared << endl;
+  check(copied >= LEN, "kv_get copies the value");
+  check(shared < LEN / 16, "kv_get_shared does not copy the value");
+  vec want = noise(LEN, 3);
+  check(first != nullptr && first == second &&
+            equal(first->begin(), first->end(), want.begin(), want.end()),
+        "kv_get_shared returns the stored buffer");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+/// Run batches with repeated and missing keys through a table.  Every
+/// callback gets the index of its key in the batch, and a key that appears
+/// twice is applied in batch order: an upsert inserts it once and then
+/// updates it, and a remove removes it once.
+///
+/// @param name A name for the table type
+template <class TABLE> void test_multi_table(const string &name) {
+  cout << "batches (" << name << ")" << endl;
+  TABLE tbl(4);
+  vector<size_t> ins, upd;
+  size_t inserted = tbl.multi_upsert(
+      {{"a", 1}, {"b", 2}, {"a", 3}, {"c", 4}},
+      [&](size_t i) { ins.push_back(i); }, [&](size_t i) { upd.push_back(i); },
+      []() {});
+  sort(ins.begin(), ins.end());
+  check(inserted == 3 && ins == vector<size_t>({0, 1, 3}),
+        "multi_upsert inserts each new key once");
+  check(upd == vector<size_t>({2}), "a repeated key is an update");
+  vector<int> got(5, -1);
+  size_t found = tbl.multi_get({"b", "x", "a", "b", "c"},
+                               [&](size_t i, const int &v) { got[i] = v; });
+  check(found == 4 && got == vector<int>({2, -1, 3, 2, 4}),
+        "multi_get reports each value at its key's index");
+  vector<size_t> gone;
+  size_t removed = tbl.multi_remove({"a", "x", "a", "c"},
+                                    [&](size_t i) { gone.push_back(i); },
+                                    []() {});
+  sort(gone.begin(), gone.end());
+  check(removed == 2 && gone == vector<size_t>({0, 3}),
+        "multi_remove removes a repeated key once");
+  check(tbl.size() == 1, "only the key that was not removed is left");
+}
+
+/// Run batches through a Storage object, and check the per-item results, and
+/// that the log replays a repeated key in batch order
+///
+/// @param file The data file to use, which is deleted first
+static void test_multi_storage(const string &file) {
+  cout << "batches (Storage)" << endl;
+  unlink(file.c_str());
+  auto v = [](const string &s) { return vec_from_string(s); };
+  {
+    Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+    s.load();
+    s.add_user("alice", "pw");
+    auto res = s.kv_multi_upsert(
+        "alice", "pw", {{"a", v("1")}, {"b", v("2")}, {"a", v("3")}});
+    check(res == vector<vec>({v(RES_OKINS), v(RES_OKINS), v(RES_OKUPD)}),
+          "kv_multi_upsert reports an insert, then an update, for a repeated "
+          "key");
+    auto got = s.kv_multi_get("alice", "pw", {"a", "x", "b"});
+    check(got.size() == 3 && !got[0].first && got[0].second == v("3") &&
+              got[1].first && !got[2].first && got[2].second == v("2"),
+          "kv_multi_get answers in key order");
+    auto del = s.kv_multi_delete("alice", "pw", {"b", "b", "x"});
+    check(del == vector<vec>({v(RES_OK), v(RES_ERR_KEY), v(RES_ERR_KEY)}),
+          "kv_multi_delete deletes a repeated key once");
+    s.shutdown();
+  }
+  Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+  s.load();
+  expect(s, "a", v("3"), "after replaying a batch");
+  check(s.kv_get("alice", "pw", string("b")).first,
+        "a key deleted by a batch stays deleted after a replay");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+/// Give keys a short ttl, let the reaper's wheel come around, and check that
+/// the reaper removed the expired pair on its own, by logging a KVDELETE that
+/// no read asked for, while a pair whose ttl was cleared by an upsert stays
+///
+/// @param file The data file to use, which is deleted first
+static void test_reaper(const string &file) {
+  cout << "ttl reaper" << endl;
+  unlink(file.c_str());
+  auto v = [](const string &s) { return vec_from_string(s); };
+  {
+    Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+    s.load();
+    s.add_user("alice", "pw");
+    s.kv_upsert(string_view("alice"), "pw", "short", v("1"), 1);
+    s.kv_upsert(string_view("alice"), "pw", "cleared", v("2"), 1);
+    s.kv_upsert(string_view("alice"), "pw", "cleared", v("3"));
+    s.kv_upsert(string_view("alice"), "pw", "long", v("4"), 3600);
+    // A pair expires after its ttl, and the wheel turns once per second
+    this_thread::sleep_for(chrono::milliseconds(3500));
+    s.shutdown();
+  }
+  check(occurrences(file, v("KVDELETE")) == 1,
+        "the reaper logs one removal, for the expired pair only");
+  Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+  s.load();
+  check(s.kv_get("alice", "pw", string("short")).first,
+        "an expired pair is gone after a reload");
+  expect(s, "cleared", v("3"), "after its ttl was cleared");
+  expect(s, "long", v("4"), "before its ttl");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+/// Insert far more than a Storage object's memory limit, and check that CLOCK
+/// eviction keeps the pairs within the limit, that evicted keys are gone, and
+/// that the evictions are logged, so a reload gives back the same keys
+///
+/// @param file The data file to use, which is deleted first
+static void test_eviction(const string &file) {
+  cout << "CLOCK eviction" << endl;
+  unlink(file.c_str());
+  const size_t LIMIT = 64 << 10, LEN = 1000, KEYS = 400;
+  // The pairs that fit in the limit, at their stored size plus PAIR_OVERHEAD
+  const size_t MOST = LIMIT / (LEN + 128);
+  auto keys_of = [](Storage &s) {
+    auto res = s.kv_all("alice", "pw");
+    set<string> keys;
+    if (res.first)
+      return keys;
+    string all(res.second.begin(), res.second.end());
+    for (size_t at = 0, nl; (nl = all.find('\n', at)) != string::npos;
+         at = nl + 1)
+      keys.insert(all.substr(at, nl - at));
+    return keys;
+  };
+  set<string> kept;
+  {
+    Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4, false, LIMIT);
+    s.load();
+    s.add_user("alice", "pw");
+    for (size_t i = 0; i < KEYS; ++i)
+      check(s.kv_upsert(string_view("alice"), "pw", "k" + to_string(i),
+                        noise(LEN, i)) == vec_from_string(RES_OKINS),
+            "upsert past the memory limit");
+    kept = keys_of(s);
+    check(!kept.empty() && kept.size() <= MOST,
+          "eviction keeps the pairs within the limit (" +
+              to_string(kept.size()) + " of " + to_string(KEYS) + " kept)");
+    size_t gone = 0;
+    for (size_t i = 0; i < KEYS; ++i) {
+      string key = "k" + to_string(i);
+      auto res = s.kv_get("alice", "pw", key);
+      if (kept.count(key))
+        check(!res.first && res.second == noise(LEN, i), key + " is kept");
+      else
+        gone += res.first && res.second == vec_from_string(RES_ERR_KEY);
+    }
+    check(gone == KEYS - kept.size(), "evicted keys are gone");
+    s.shutdown();
+  }
+  Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4, false, LIMIT);
+  s.load();
+  check(keys_of(s) == kept, "a reload gives back the keys that were kept");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+/// Check the bounds of OrderedIndex's range and prefix scans, including
+/// prefixes that end in (or are all) 0xFF bytes, and of Storage's kv_prefix()
+///
+/// @param file The data file to use, which is deleted first
+static void test_ordered_index(const string &file) {
+  cout << "ordered index bounds" << endl;
+  check(OrderedIndex::prefix_end("ab") == "ac", "prefix_end of ab");
+  check(OrderedIndex::prefix_end("a\xfe") == "a\xff", "prefix_end of a,FE");
+  check(OrderedIndex::prefix_end("a\xff") == "b", "prefix_end of a,FF");
+  check(OrderedIndex::prefix_end("a\xff\xff") == "b", "prefix_end of a,FF,FF");
+  check(OrderedIndex::prefix_end("\xff\xff") == "", "prefix_end of FF,FF");
+  check(OrderedIndex::prefix_end("") == "", "prefix_end of nothing");
+  vector<string> keys = {"a",       "ab",       "abc",    "abd",
+                         "ac",      "a\xff",    "a\xff\x01", "b",
+                         "\xff",    "\xff\xff"};
+  OrderedIndex idx;
+  for (auto &k : keys)
+    idx.insert(k);
+  check(!idx.insert("ab"), "a key is only added once");
+  auto range = [&](string_view from, string_view to, size_t limit) {
+    vector<string> out;
+    idx.range(from, to, limit, [&](const string &k) { out.push_back(k); });
+    return out;
+  };
+  auto prefix = [&](string_view p) {
+    vector<string> out;
+    idx.prefix(p, 100, [&](const string &k) { out.push_back(k); });
+    return out;
+  };
+  vector<string> sorted = keys;
+  sort(sorted.begin(), sorted.end());
+  check(range("", "", 100) == sorted, "an unbounded range visits every key, "
+                                      "with 0xFF bytes sorted last");
+  check(range("ab", "ac", 100) == vector<string>({"ab", "abc", "abd"}),
+        "a range includes its start and excludes its end");
+  check(range("aa", "", 2) == vector<string>({"ab", "abc"}),
+        "a range starts at the first key at or after its start, and stops at "
+        "its limit");
+  check(range(string("ab") + '\0', "ac", 100) ==
+            vector<string>({"abc", "abd"}),
+        "a range from a key plus a 0 byte resumes after the key");
+  check(prefix("ab") == vector<string>({"ab", "abc", "abd"}), "prefix ab");
+  check(prefix("a\xff") == vector<string>({"a\xff", "a\xff\x01"}),
+        "a prefix that ends in 0xFF stops before the next letter");
+  check(prefix("\xff") == vector<string>({"\xff", "\xff\xff"}),
+        "a prefix of 0xFF bytes runs to the end");
+  check(idx.remove("abc") && !idx.remove("abc"), "a key is only removed once");
+  check(prefix("ab") == vector<string>({"ab", "abd"}),
+        "a removed key is not visited");
+  // Storage skips keys that the index lists but that have no live value
+  unlink(file.c_str());
+  Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4, true);
+  s.load();
+  s.add_user("alice", "pw");
+  for (auto k : {"k\xff" "1", "k\xff" "2", "k\xfe", "l", "kx"})
+    s.kv_insert(string_view("alice"), "pw", k, vec_from_string("v"));
+  s.kv_delete(string_view("alice"), "pw", "k\xff" "2");
+  auto res = s.kv_prefix("alice", "pw", "k\xff", 100, false);
+  check(!res.first && res.second == vec_from_string("k\xff" "1\n"),
+        "kv_prefix of k,FF");
+  res = s.kv_range("alice", "pw", "k", "l", 2, false);
+  check(!res.first && res.second == vec_from_string("kx\nk\xfe\n"),
+        "kv_range stops at its limit and its end");
+  Storage plain(file + ".plain", 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+  plain.add_user("alice", "pw");
+  check(plain.kv_prefix("alice", "pw", "k", 100, false).second ==
+            vec_from_string(RES_ERR_INV_CMD),
+        "kv_prefix without an index is refused");
+  plain.shutdown();
+  s.shutdown();
+  unlink(file.c_str());
+  unlink((file + ".plain").c_str());
+}
+
+/// Write values by copy and by move, and check that a moved value is stored
+/// in the caller's buffer, so that a write by move copies none of its bytes
+/// into the table.  Both kinds of write build the same log record, which
+/// holds a copy of the bytes.
+///
+/// @param file The data file to use, which is deleted first
+static void test_move_write(const string &file) {
+  cout << "moved writes" << endl;
+  unlink(file.c_str());
+  const size_t LEN = 32 * 1024;
+  Storage s(file, 64, 1 << 30, 1 << 30, 1 << 30, 60, 4);
+  s.load();
+  s.add_user("alice", "pw");
+  vec bytes = noise(LEN, 5);
+  slab_vec moved_ins(bytes.begin(), bytes.end());
+  slab_vec moved_upd(bytes.begin(), bytes.end());
+  const unsigned char *buf = moved_upd.data();
+  size_t copy_ins = bytes_allocated([&]() {
+    s.kv_insert(string_view("alice"), "pw", "copied", bytes);
+  });
+  size_t move_ins = bytes_allocated([&]() {
+    s.kv_insert(string_view("alice"), "pw", "moved", std::move(moved_ins));
+  });
+  size_t copy_upd = bytes_allocated([&]() {
+    s.kv_upsert(string_view("alice"), "pw", "copied", bytes);
+  });
+  size_t move_upd = bytes_allocated([&]() {
+    s.kv_upsert(string_view("alice"), "pw", "moved", std::move(moved_upd));
+  });
+  cout << "  a " << LEN << "-byte value: insert allocates " << copy_ins
+       << " bytes by copy, " << move_ins << " by move; upsert " << copy_upd
+       << " by copy, " << move_upd << " by move" << endl;
+  check(copy_ins >= move_ins + LEN, "an insert by move saves a copy");
+  check(copy_upd >= move_upd + LEN, "an upsert by move saves a copy");
+  check(s.kv_get_shared("alice", "pw", "moved").second->data() == buf,
+        "a moved value keeps the caller's buffer");
+  expect(s, "moved", bytes, "after a moved upsert");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+/// Page through a table with small pages while another thread inserts enough
+/// keys to make it resize several times.  Every key that was there before the
+/// scan must be visited exactly once, and no key may be visited twice.
+///
+/// @param name A name for the table type
+template <class TABLE> void test_resize_scan(const string &name) {
+  cout << "concurrent-resize scan (" << name << ")" << endl;
+  const int BEFORE = 4096, DURING = 65536;
+  TABLE tbl(4);
+  for (int i = 0; i < BEFORE; ++i)
+    tbl.insert(i, i, []() {});
+  size_t buckets = tbl.bucket_count();
+  atomic<bool> started{false};
+  thread writer([&]() {
+    for (int i = BEFORE; i < BEFORE + DURING; ++i) {
+      tbl.insert(i, i, []() {});
+      // Let the scan take a page now and then, even on one core
+      if (i % 256 == 0) {
+        started = true;
+        this_thread::yield();
+      }
+    }
+  });
+  while (!started)
+    this_thread::yield();
+  unordered_map<int, int> seen;
+  uint64_t cursor = 0;
+  do {
+    check(tbl.valid_cursor(cursor), "cursor returned by scan_page is valid");
+    cursor = tbl.scan_page(cursor, 8, [&](int k, int) { ++seen[k]; });
+    this_thread::yield();
+  } while (cursor != 0);
+  size_t after = tbl.bucket_count();
+  writer.join();
+  check(after > buckets, "the table resized during the scan");
+  size_t missing = 0, twice = 0;
+  for (int i = 0; i < BEFORE; ++i)
+    missing += seen.count(i) == 0;
+  for (auto &p : seen)
+    twice += p.second > 1;
+  check(missing == 0, to_string(missing) + " keys present before the scan "
+                                           "were not visited");
+  check(twice == 0, to_string(twice) + " keys were visited more than once");
+  check(!tbl.valid_cursor(uint64_t(1) << 40), "a cursor past the base slots "
+                                              "is rejected");
+  check(!tbl.valid_cursor(1), "a cursor finer than the table is rejected");
+  check(tbl.scan_page(1, 8, [](int, int) {}) == 0,
+        "scan_page ends the scan for a cursor that no table is aligned with");
+}
+
+/// Open a log on a device where every write fails, and check that the failure
+/// reaches the writer, under each sync policy
+static void test_log_failure() {
+  cout << "GroupLog write failure" << endl;
+  for (int policy : {GroupLog::OS_BUFFERED, GroupLog::EVERY_COMMIT, 5}) {
+    string p = " (policy " + to_string(policy) + ")";
+    GroupLog log(policy);
+    log.open("/dev/full");
+    uint64_t lsn = log.append(vec_from_string("record"));
+    bool waited = log.wait(lsn);
+    check(!log.flush(), "flush reports the failure" + p);
+    check(log.has_failed(), "the failure is latched" + p);
+    check(policy > 0 || !waited, "wait reports the failure" + p);
+    check(log.durable_lsn() < lsn, "a failed record is not durable" + p);
+    check(!log.wait(log.append(vec_from_string("later"))),
+          "a record after the failure is not acknowledged" + p);
+  }
+  // A Storage whose file can't be written answers with an error
+  Storage s("/dev/full", 64, 1 << 20, 1 << 20, 1 << 20, 60, 4, false, 0, 0,
+            0, GroupLog::EVERY_COMMIT);
+  s.load();
+  check(!s.add_user("bob", "pw"), "add_user reports the failure");
+}
+
+/// Make a log fail, and check that a switch to a prepared file clears the
+/// failure, and that a Storage refuses changes until a snapshot succeeds.
+/// Writes are made to fail by limiting the size of the files that this
+/// process may write.
+///
+/// @param file The data file to use, which is deleted first
+static void test_log_recovery(const string &file) {
+  cout << "GroupLog recovery" << endl;
+  {
+    GroupLog log(GroupLog::EVERY_COMMIT);
+    log.open("/dev/full");
+    uint64_t lsn = log.append(vec_from_string("lost"));
+    check(!log.wait(lsn), "a write to a full device fails");
+    check(log.dropped_lsn() == lsn, "the failed record is reported dropped");
+    unlink(file.c_str());
+    log.open(file);
+    check(log.has_failed(), "a switch without a prepare keeps the failure");
+    log.open(file, [](int) { return true; });
+    check(!log.has_failed(), "a prepared switch clears the failure");
+    check(log.wait(log.append(vec_from_string("kept"))),
+          "a record after a prepared switch is durable");
+    check(load_entire_file(file) == vec_from_string("kept"),
+          "only the record after the switch is in the file");
+  }
+  unlink(file.c_str());
+  signal(SIGXFSZ, SIG_IGN);
+  rlimit old;
+  getrlimit(RLIMIT_FSIZE, &old);
+  auto ok = vec_from_string(RES_OK), okins = vec_from_string(RES_OKINS),
+       err = vec_from_string(RES_ERR_SERVER);
+  {
+    Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4, false, 0, 0, 0,
+              GroupLog::EVERY_COMMIT);
+    s.load();
+    check(s.add_user("alice", "pw"), "add_user");
+    check(s.kv_insert(string_view("alice"), "pw", "before",
+                      vec_from_string("1")) == ok,
+          "insert before the failure");
+    // Let the file grow by less than a record, so the next write fails
+    rlimit small = old;
+    small.rlim_cur = load_entire_file(file).size() + 4;
+    setrlimit(RLIMIT_FSIZE, &small);
+    check(s.kv_insert(string_view("alice"), "pw", "during",
+                      vec_from_string("2")) == err,
+          "a change whose record can't be written reports ERR_SERVER");
+    check(s.kv_insert(string_view("alice"), "pw", "refused",
+                      vec_from_string("3")) == err,
+          "a change after the failure reports ERR_SERVER");
+    check(s.kv_get("alice", "pw", string("refused")).first,
+          "a change after the failure is not applied");
+    check(s.kv_append("alice", "pw", "before", vec_from_string("x")) == err,
+          "an append after the failure is refused");
+    expect(s, "before", vec_from_string("1"), "after a refused append");
+    check(!s.add_user("bob", "pw"), "add_user after the failure is refused");
+    setrlimit(RLIMIT_FSIZE, &old);
+    s.persist();
+    while (s.persist_status().first)
+      this_thread::sleep_for(chrono::milliseconds(10));
+    check(s.kv_insert(string_view("alice"), "pw", "after",
+                      vec_from_string("4")) == ok,
+          "a snapshot clears the failure");
+    check(s.kv_upsert(string_view("alice"), "pw", "refused",
+                      vec_from_string("3")) == okins,
+          "a refused change can be retried");
+    s.shutdown();
+  }
+  setrlimit(RLIMIT_FSIZE, &old);
+  Storage s(file, 64, 1 << 20, 1 << 20, 1 << 20, 60, 4);
+  check(s.load(), "load after recovery");
+  for (auto kv : {make_pair("before", "1"), make_pair("during", "2"),
+                  make_pair("refused", "3"), make_pair("after", "4")})
+    expect(s, kv.first, vec_from_string(kv.second), "after recovery");
+  s.shutdown();
+  unlink(file.c_str());
+}
+
+int main(int argc, char **argv) {
+  string dir = argc > 1 ? argv[1] : "/tmp";
+  test_round_trip(dir + "/kvtest_" + to_string(getpid()) + ".dat");
+  test_shared_get(dir + "/kvget_" + to_string(getpid()) + ".dat");
+  test_move_write(dir + "/kvmove_" + to_string(getpid()) + ".dat");
+  test_multi_table<ConcurrentHashTable<string, int>>("chained");
+  test_multi_table<FlatHashTable<string, int>>("flat");
+  test_multi_storage(dir + "/kvmulti_" + to_string(getpid()) + ".dat");
+  test_reaper(dir + "/kvreap_" + to_string(getpid()) + ".dat");
+  test_eviction(dir + "/kvevict_" + to_string(getpid()) + ".dat");
+  test_ordered_index(dir + "/kvindex_" + to_string(getpid()) + ".dat");
+  test_reclaim();
+  test_guarded_reads();
+  test_resize_scan<ConcurrentHashTable<int, int>>("chained");
+  test_resize_scan<FlatHashTable<int, int>>("flat");
+  test_log_failure();
+  test_log_recovery(dir + "/kvlog_" + to_string(getpid()) + ".dat");
+  if (failures != 0) {
+    cout << failures << " checks failed" << endl;
+    return 1;
+  }
+  cout << "all checks passed" << endl;
+  return 0;
+}